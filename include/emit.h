@@ -1,6 +1,9 @@
 #ifndef EMIT_H_
 #define EMIT_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define RAX "%rax"
 #define RBX "%rbx"
 #define RCX "%rcx"
@@ -22,9 +25,20 @@
 #define MEM(reg) "(" reg ")"
 #define ARRAY_MEM(array, index, stride) "(" array "," index "," stride ")"
 
-#define DIRECTIVE(fmt, ...) printf(fmt "\n" __VA_OPT__(, ) __VA_ARGS__)
-#define LABEL(name, ...) printf(name ":\n" __VA_OPT__(, ) __VA_ARGS__)
-#define EMIT(fmt, ...) printf("\t" fmt "\n" __VA_OPT__(, ) __VA_ARGS__)
+// Emitted lines are buffered, so the peephole optimizer can rewrite them before they are printed.
+// Implemented in peephole.c
+void emit_line(const char *format, ...);
+
+#define DIRECTIVE(fmt, ...) emit_line("" fmt __VA_OPT__(, ) __VA_ARGS__)
+#define LABEL(name, ...) emit_line(name ":" __VA_OPT__(, ) __VA_ARGS__)
+#define EMIT(fmt, ...) emit_line("\t" fmt __VA_OPT__(, ) __VA_ARGS__)
+
+// Returns a mask with one bit for every general purpose register named in the text, by any of its names.
+// Implemented in peephole.c
+uint32_t register_mask(const char *text);
+
+// The registers a call to a function outside the program may change, following System V
+#define SYSTEM_V_CALLER_SAVED RAX RCX RDX RSI RDI R8 R9 R10 R11
 
 #define MOVQ(src, dst) EMIT("movq %s, %s", (src), (dst))
 #define PUSHQ(src) EMIT("pushq %s", (src))
@@ -48,6 +62,9 @@
 #define JE(label) EMIT("je %s", (label))    // Conditional jump
 #define JGE(label) EMIT("jge %s", (label))  // Conditional jump
 #define JLE(label) EMIT("jle %s", (label))  // Conditional jump
+#define JL(label) EMIT("jl %s", (label))    // Conditional jump
+#define JG(label) EMIT("jg %s", (label))    // Conditional jump
+#define JA(label) EMIT("ja %s", (label))    // Conditional jump, comparing as unsigned
 #define JMP(label) EMIT("jmp %s", (label))  // Unconditional jump
 
 // These directives are set based on platform,
@@ -57,6 +74,7 @@
 #ifdef __APPLE__
 #define ASM_BSS_SECTION "__DATA, __bss"
 #define ASM_STRING_SECTION "__TEXT, __cstring"
+#define ASM_RODATA_SECTION "__TEXT, __const"
 #define ASM_DECLARE_SYMBOLS  \
     ".set printf, _printf"   \
     "\n"                     \
@@ -74,6 +92,7 @@
 #else
 #define ASM_BSS_SECTION ".bss"
 #define ASM_STRING_SECTION ".rodata"
+#define ASM_RODATA_SECTION ".rodata"
 #define ASM_DECLARE_SYMBOLS ".global main"
 #endif
 
@@ -0,0 +1,97 @@
+#ifndef INSTRUCTION_SELECTION_H
+#define INSTRUCTION_SELECTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "tree.h"
+#include "register_allocation.h"
+
+// The kinds of leaves a tree pattern can have, and what they produce as operands of the rule
+typedef enum {
+    OPERAND_REG,         // Any expression, evaluated into a register by the generator first
+    OPERAND_RVAR,        // A variable kept in a register
+    OPERAND_MEM,         // A memory operand: a variable in memory, or an element at a constant index,
+                         // of an array or from a pointer kept in a register
+    OPERAND_VAR,         // Either OPERAND_RVAR or OPERAND_MEM
+    OPERAND_SAME,        // The same variable as the first leaf of the pattern
+    OPERAND_NUMBER,      // Any number, given without the leading $
+    OPERAND_IMM,         // A number that fits in the sign extended 32-bit immediate of most instructions
+    OPERAND_ZERO,        // The number 0
+    OPERAND_SCALE,       // 2, 4 or 8, the scale factors of an address
+    OPERAND_LEA_FACTOR,  // 3, 5 or 9. The operand is one less, making x * 5 into (x, x, 4)
+    OPERAND_SHIFT,       // A power of two from 2 to 2^62. The operand is the exponent
+    OPERAND_FACTOR,      // A number multiplied by without imulq, see split_factor
+    OPERAND_DIVISOR,     // Any number but 0 and -1, which are left to idivq, as dividing by them can trap
+    OPERAND_ARRAY,       // The name of an array
+} operand_class_t;
+
+// How the generator emits the code of a rule, once the registers of the pattern are evaluated
+typedef enum {
+    ACTION_TEMPLATE,         // Expand the template of the rule
+    ACTION_CALL,             // Call a function
+    ACTION_ELEMENT,          // Load an array element. The index has been evaluated into the destination
+    ACTION_DIVIDE,           // Divide the destination by the second operand, using idivq
+    ACTION_MULTIPLY,         // Multiply the destination by the constant second leaf, using leaq and shifts
+    ACTION_DIVIDE_CONSTANT,  // Divide the destination by the constant second leaf, multiplying by its reciprocal
+} rule_action_t;
+
+typedef struct pattern pattern_t;
+
+/**
+ * A tree pattern, the cost of the instructions it is replaced with, roughly in cycles, and how to emit them.
+ * Templates are instructions separated by ';', where %d is the destination register, %D its
+ * lower 32 bits, and %0, %1, ... are the operands of the leaves, in the order they appear in the pattern.
+ * A literal % is written as %%.
+ */
+typedef struct {
+    const pattern_t *pattern;
+    int cost;
+    bool commutative;  // The pattern also matches with the two children of the root swapped
+    rule_action_t action;
+    const char *template;
+} rule_t;
+
+#define MAX_PATTERN_LEAVES 4
+
+// A rule matched against a subtree, with the nodes matched by each of the leaves of the pattern
+typedef struct {
+    const rule_t *rule;
+    bool swapped;  // The children of the root were matched in the opposite order
+    node_t *leaves[MAX_PATTERN_LEAVES];
+    operand_class_t classes[MAX_PATTERN_LEAVES];
+    size_t n_leaves;
+    int cost;  // The total cost of the rule, including evaluating its OPERAND_REG leaves
+} match_t;
+
+// Must be called before selecting instructions for a function, to know where its variables live
+void instruction_selection_begin(register_allocation_t *allocation);
+void instruction_selection_end(void);
+
+// Returns the cheapest way of evaluating the expression into a register
+match_t select_expression(node_t *expression);
+
+// Returns the cheapest way of setting the flags according to the left side compared to the right
+match_t select_relation(node_t *relation);
+
+// Finds a rule computing the assignment statement directly on its destination, if there is any
+bool select_assignment(node_t *statement, match_t *match);
+
+// Returns true if the node can be used directly as a memory operand, see OPERAND_MEM
+bool is_memory_operand(node_t *node);
+
+// A multiplication by a constant done by at most two leaq and shifts, in the order of the fields
+typedef struct {
+    int lea_factors[2];  // 3, 5 or 9
+    size_t n_lea_factors;
+    int shift;
+    bool negate;
+} factor_t;
+
+// Splits the factor into the steps of multiplying by it, returning false if it takes more than two
+bool split_factor(int64_t factor, factor_t *steps);
+
+// Returns true if evaluating the expression makes a call
+bool contains_call(node_t *node);
+
+#endif  // INSTRUCTION_SELECTION_H
@@ -35,6 +35,7 @@ NODELIST_BEGIN
     NODE(VARIABLE),
     NODE(ARRAY_DECLARATION),
     NODE(ARRAY_INDEXING),
+    NODE(POINTER_INDEXING),
     NODE(FUNCTION),
     NODE(PARAMETER_LIST),
     NODE(STATEMENT),
@@ -49,6 +50,7 @@ NODELIST_BEGIN
     NODE(BREAK_STATEMENT),
     NODE(IF_STATEMENT),
     NODE(WHILE_STATEMENT),
+    NODE(VECTOR_LOOP),
     NODE(RELATION),
     NODE(FOR_STATEMENT),
     NODE(ARGUMENT_LIST),
@@ -0,0 +1,23 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewrites the lines emitted so far, looking at a few instructions at a time, until no more rewrites apply
+void peephole_optimize(void);
+
+// Prints every emitted line to stdout, and empties the buffer
+void flush_emitted_lines(void);
+
+// The number of lines emitted so far, which the lines after can be taken back from
+size_t count_emitted_lines(void);
+void discard_emitted_lines(size_t first);
+
+// Returns a mask of the registers named by the lines emitted since the given one, see register_mask in emit.h
+uint32_t registers_named_since(size_t first_line);
+
+// The size of the lines emitted since the given one, as they will be printed
+size_t count_emitted_bytes_since(size_t first_line);
+
+#endif  // PEEPHOLE_H
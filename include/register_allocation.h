@@ -0,0 +1,44 @@
+#ifndef REGISTER_ALLOCATION_H
+#define REGISTER_ALLOCATION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "symbols.h"
+
+// Where a parameter or local variable lives for the whole duration of its function
+typedef struct {
+    const char *reg;   // The register holding the variable, or NULL if it lives in memory
+    // Index of the stack slot holding the variable, shared with variables that are never live at the same
+    // time. Parameters passed on the stack that are not given a register have neither a register nor a slot,
+    // and stay where the caller put them
+    int stack_slot;
+    bool referenced;   // False for variables that never appear in the function body
+    bool needs_zero;   // The variable may be read before it is assigned, so it must start out as 0
+} variable_location_t;
+
+// The result of running the register allocator over one function
+typedef struct {
+    variable_location_t *locations;  // Indexed by the sequence number of the symbol
+    size_t n_locations;
+
+    // The callee-saved registers the function writes to, which must be saved in the prologue
+    const char **callee_saved;
+    size_t n_callee_saved;
+
+    size_t n_stack_slots;
+
+    // The parameters before this one are passed in registers, and the rest on the stack
+    size_t n_register_params;
+} register_allocation_t;
+
+// Assigns every parameter and local variable of the given function to a register or stack slot,
+// using linear scan over live intervals computed from the bound syntax tree.
+// Variables live across calls are kept out of the registers the callees change, given by clobbers,
+// which holds a register_mask for every function, indexed by its sequence number.
+// register_params is the number of parameters passed in registers, or -1 to let the allocator choose.
+register_allocation_t *allocate_registers(symbol_t *function, const uint32_t *clobbers, int register_params);
+
+void register_allocation_destroy(register_allocation_t *allocation);
+
+#endif  // REGISTER_ALLOCATION_H
@@ -17,12 +17,19 @@ typedef enum
         [SYMBOL_PARAMETER] = "PARAMETER",         \
         [SYMBOL_LOCAL_VAR] = "LOCAL_VAR"})
 
+// How the elements of a global array are stored, see narrow_arrays in optimizer.c
+typedef enum
+{
+    ELEMENT_QUADWORD, ELEMENT_DOUBLEWORD, ELEMENT_WORD, ELEMENT_BYTE, ELEMENT_BIT,
+} element_width_t;
+
 typedef struct symbol
 {
     char *name;             // Symbol name ( not owned )
     symtype_t type;         // Symbol type
     node_t *node;           // The AST node that defined this symbol ( not owned )
     size_t sequence_number; // Sequence number in the symbol table this symbol belongs to
+    element_width_t element_width; // Only set for global arrays
 
     /* Global variables and arrays have function_symtable = NULL
      * Functions point to their own symbol tables here, but the function itself is a global symbol
@@ -37,6 +44,7 @@ extern size_t string_list_len;
 
 void create_tables ( void );
 void print_tables ( void );
+void remove_unused_globals ( void );
 void destroy_tables ( void );
 
 #endif // SYMBOLS_H
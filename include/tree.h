@@ -23,6 +23,16 @@ void node_init ( node_t * nd, node_type_t type, void *data, uint64_t n_children,
 void print_syntax_tree ( void );
 void simplify_syntax_tree ( void );
 void destroy_syntax_tree ( void );
+void destroy_subtree ( node_t *discard );
+
+// The name of the local variable holding the end value of a lowered for-loop
+#define FOR_END_VARIABLE "__FOR_END__"
+
+// The optimizer replaces some ARRAY_INDEXING nodes with POINTER_INDEXING nodes, which have a local
+// variable holding the address of an element as the first child, and the index from there as the second.
+// It can also give a WHILE_STATEMENT a third child, the preheader, run once when the loop is entered.
+// A VECTOR_LOOP placed in front of a for-loop has the condition and the body of the loop as its children,
+// and runs as many of its iterations as fit in whole vectors, leaving the rest to the loop
 
 // Special function used when syntax trees are output as graphviz graphs.
 // Implemented in graphviz_output.c
@@ -15,9 +15,61 @@
 /* Definition of the symbol table, and functions for building it */
 #include "symbols.h"
 
+/* Optimizations on the bound syntax tree, in optimizer.c */
+void optimize_syntax_tree(void);
+
 /* Function for generating machine code, in generator.c */
 void generate_program(void);
 
+/* Command line flag in vslc.c, asking the optimizations to report what they did on stderr */
+extern bool report_optimizations;
+
+/* Command line flags in vslc.c, controlling the loop unrolling in optimizer.c */
+extern bool unroll_loops;
+extern int unroll_factor;
+
+/* Command line flag in vslc.c, controlling the vectorization of loops in optimizer.c */
+extern bool vectorize_loops;
+
+/* Command line flags in vslc.c, controlling the inlining of calls in optimizer.c */
+extern bool inline_calls;
+extern int inline_limit;
+
+/* Command line flags in vslc.c, controlling the evaluation of calls at compile time in optimizer.c */
+extern bool evaluate_calls;
+extern int evaluate_limit;
+
+/* Command line flags in vslc.c, controlling the specialization of functions in optimizer.c */
+extern bool specialize_calls;
+extern int specialize_limit;
+
+/* Command line flag in vslc.c, controlling the memoization of functions in optimizer.c */
+extern bool memoize_calls;
+
+/* Command line flag in vslc.c, controlling how narrow the array elements stored by optimizer.c may be */
+extern bool array_narrowing;
+
+/* Command line flag in vslc.c, controlling the promotion of global variables in loops by optimizer.c */
+extern bool global_promotion;
+
+/* Command line flag in vslc.c, controlling what optimizer.c knows about the globals each function uses */
+extern bool mod_ref_summaries;
+
+/* Command line flag in vslc.c, controlling the common subexpression elimination in optimizer.c */
+extern bool common_subexpressions;
+
+/* Command line flag in vslc.c, controlling the tail calls made by generator.c */
+extern bool tail_calls;
+
+/* Command line flag in vslc.c, controlling the conditional moves made by generator.c */
+extern bool conditional_moves;
+
+/* Command line flag in vslc.c, controlling how generator.c dispatches on else-if chains */
+extern bool jump_tables;
+
+/* Command line flag in vslc.c, controlling the identical code folding done by generator.c */
+extern bool identical_code_folding;
+
 /* The main driver function of the parser generated by bison */
 int yyparse();
 
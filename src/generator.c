@@ -2,10 +2,18 @@
 
 // This header defines a bunch of macros we can use to emit assembly to stdout
 #include "emit.h"
+#include "register_allocation.h"
+#include "instruction_selection.h"
+#include "peephole.h"
 
-// In the System V calling convention, the first 6 integer parameters are passed in registers
-#define NUM_REGISTER_PARAMS 6
-static const char *REGISTER_PARAMS[6] = {RDI, RSI, RDX, RCX, R8, R9};
+/**
+ * The functions of the program call each other with a convention of their own. Up to 8 parameters are
+ * passed in registers, the 6 of System V followed by %r10 and %r11, and a call only clobbers the registers
+ * the callee actually writes to, see function_clobbers. System V is only followed by main and printing.
+ * The last 2 are only passed in registers when the callee keeps them there, see function_register_params
+ */
+#define NUM_REGISTER_PARAMS 8
+static const char *REGISTER_PARAMS[NUM_REGISTER_PARAMS] = {RDI, RSI, RDX, RCX, R8, R9, R10, R11};
 
 // Takes in a symbol of type SYMBOL_FUNCTION, and returns how many parameters the function takes
 #define FUNC_PARAM_COUNT(func) ((func)->node->children[1]->n_children)
@@ -13,10 +21,50 @@ static const char *REGISTER_PARAMS[6] = {RDI, RSI, RDX, RCX, R8, R9};
 static void generate_string_table(void);
 static void generate_global_variables(void);
 static void generate_function(symbol_t *function);
+static bool fold_identical_function(symbol_t *function);
+static uint64_t hash_function_node(node_t *node, symbol_t *function);
+static uint64_t mix_hash(uint64_t hash, uint64_t value);
+static bool is_same_function_node(node_t *a, symbol_t *function_a, node_t *b, symbol_t *function_b);
+static bool is_same_reference(symbol_t *a, symbol_t *function_a, symbol_t *b, symbol_t *function_b);
+static void generate_function_and_callees(symbol_t *function, bool *generated);
+static void find_callees(node_t *node, bool *generated);
+static void find_tail_called_functions(node_t *node, symbol_t *function);
+static bool generate_function_code(symbol_t *function, bool leaf);
+static bool is_leaf(node_t *node);
+static const char *frame_pointer(void);
+static int stack_argument_offset(int stack_index);
+static int get_register_params(symbol_t *function);
+static void push_quadword(const char *source);
+static void pop_quadword(const char *destination);
+static void drop_quadwords(int count);
+static bool is_argument_operand(node_t *argument);
+static bool can_place_arguments(node_t *argument_list, size_t n);
+static void generate_argument_placement(node_t *argument_list, size_t n);
+static bool is_argument_in_place(node_t *argument, int stack_index);
 static void generate_expression(node_t *expression);
+static void generate_expression_into(node_t *expression, const char *dest);
+static void generate_match(const match_t *match, node_t *node, const char *dest);
+static int register_need(node_t *node);
+static bool is_same_register(const char *a, const char *b);
 static void generate_statement(node_t *node);
 static void generate_main(symbol_t *first);
 static void generate_block_statement(node_t *node);
+static bool generate_conditional_move(node_t *statement);
+static bool generate_dispatch(node_t *statement);
+static void generate_jump_table(int dispatch, const char *value, int64_t min, int64_t max);
+static void generate_binary_search(int dispatch, const char *value, size_t first, size_t end);
+static void generate_case_compare(const char *value, int64_t constant);
+static node_t *get_single_assignment(node_t *statement);
+static int speculation_cost(node_t *node);
+static void generate_epilogue(void);
+static void generate_frame_teardown(void);
+static bool is_tail_call(node_t *expression);
+static bool has_self_tail_call(node_t *node);
+static void generate_tail_call(node_t *call);
+static const char *generate_symbol_access(symbol_t *symbol);
+static void generate_parallel_move(const char **sources, const char **destinations, size_t n);
+static void generate_vector_loop(node_t *statement);
+static void generate_cpu_dispatch(void);
 static symbol_t *get_topmost_function();
 static bool is_less_than_relation(const char *str);
 static bool is_greater_than_relation(const char *str);
@@ -26,19 +74,141 @@ static bool is_not_equal_relation(const char *str);
 /* Global variable used to make the functon currently being generated acessiable from anywhere */
 static symbol_t *current_function;
 
+// How far the index is shifted to address an element, for each width of array elements, see narrow_arrays in optimizer.c
+static const int ELEMENT_SHIFTS[] = {
+    [ELEMENT_QUADWORD] = 3, [ELEMENT_DOUBLEWORD] = 2, [ELEMENT_WORD] = 1, [ELEMENT_BYTE] = 0};
+
+/* The registers and stack slots the variables of the current function have been placed in */
+static register_allocation_t *current_allocation;
+
+/**
+ * The caller-saved registers each function may change, including through the functions it calls, indexed by
+ * the sequence number of the function. Functions are generated after the ones they call, so only recursive
+ * calls are made to functions that are not done yet, which are assumed to clobber every caller-saved register.
+ * The masks have one bit per register, see register_mask.
+ * current_clobbers gathers the registers changed by the functions the current function calls.
+ */
+static uint32_t *function_clobbers;
+static uint32_t current_clobbers;
+
+/**
+ * How many parameters each function is passed in registers, indexed by its sequence number. The register
+ * allocator chooses, unless a recursive call has been generated before the function, see get_register_params.
+ */
+static int *function_register_params;
+
+/**
+ * Leaf functions keep their variables in the 128 byte red zone below %rsp, which the System V ABI leaves
+ * alone for them, and need neither %rbp nor a frame. Nothing can be pushed, which would overwrite them.
+ */
+#define RED_ZONE_SIZE 128
+static bool omits_frame_pointer;
+
+/**
+ * The number of quadwords pushed below the frame of the current function. The frame keeps the stack
+ * 16-byte aligned, and calls are padded to keep it that way. stack_touched is set by any push at all.
+ */
+static int stack_depth;
+static bool stack_touched;
+
+// Registers expressions are evaluated in, in the order they are handed out.
+// The ones the register allocator has given to variables of the current function are skipped.
+static const char *SCRATCH_REGISTERS[] = {RAX, R10, R11, RCX, RSI, RDI, R8, R9, RDX};
+#define NUM_SCRATCH_REGISTERS (sizeof(SCRATCH_REGISTERS) / sizeof(*SCRATCH_REGISTERS))
+static bool scratch_in_use[NUM_SCRATCH_REGISTERS];
+static bool scratch_holds_variable[NUM_SCRATCH_REGISTERS];
+
+// The register need of a call. Calls clobber every scratch register, so they get more than there are
+#define CALL_REGISTER_NEED 1000
+
 static const int BUFFER_SIZE_IN_BYTES = 1024;
 
+/* Global variable used to give every while loop its own labels */
+static int while_counter = 0;
+
 /**
  * Global variable used to keep track of the innermost while loop, so we can jump to the correct
- * place when a break statement is encountered 
+ * place when a break statement is encountered. -1 outside of loops
  **/
-static int while_counter = 0;
+static int innermost_while = -1;
 
 /**
  * Global variable used to keep track of the current if statement.
  */
 static int if_counter = 0;
 
+/* Gives every else-if chain generated by generate_dispatch its own labels */
+static int dispatch_counter = 0;
+
+/* The cases of the else-if chain being dispatched on, see generate_dispatch */
+typedef struct {
+    int64_t value;
+    node_t *statement;
+    size_t label;  // The index of the case in the chain, numbering its label
+} dispatch_case_t;
+static dispatch_case_t *dispatch_cases;
+static size_t n_dispatch_cases;
+
+/**
+ * Identical code folding. Functions whose bodies are the same, up to the names of their own parameters and
+ * local variables, and up to calling themselves, are generated once. The others become aliases of its label.
+ * folding_candidates are the functions generated so far, with the hash of their body and the bytes of
+ * assembly it took, indexed by sequence number
+ */
+static symbol_t **folding_candidates;
+static size_t n_folding_candidates;
+static uint64_t *function_hashes;
+static size_t *function_sizes;
+static size_t n_folded_functions, folded_bytes;
+
+/* The vector registers, used by the vectorized loops, which make no calls. None of them are callee-saved */
+#define NUM_VECTOR_REGISTERS 16
+static const char *XMM_REGISTERS[NUM_VECTOR_REGISTERS] = {
+    "%xmm0", "%xmm1", "%xmm2",  "%xmm3",  "%xmm4",  "%xmm5",  "%xmm6",  "%xmm7",
+    "%xmm8", "%xmm9", "%xmm10", "%xmm11", "%xmm12", "%xmm13", "%xmm14", "%xmm15",
+};
+static const char *YMM_REGISTERS[NUM_VECTOR_REGISTERS] = {
+    "%ymm0", "%ymm1", "%ymm2",  "%ymm3",  "%ymm4",  "%ymm5",  "%ymm6",  "%ymm7",
+    "%ymm8", "%ymm9", "%ymm10", "%ymm11", "%ymm12", "%ymm13", "%ymm14", "%ymm15",
+};
+
+/**
+ * The instruction sets vectorized loops are generated for. Every x86-64 processor has SSE2, and main
+ * checks for AVX2, which has twice as wide registers, and instructions taking separate destinations
+ */
+typedef struct {
+    const char *name;
+    int lanes;  // Quadwords per vector register
+    bool avx;
+} vector_isa_t;
+static const vector_isa_t SSE2 = {"sse", 2, false};
+static const vector_isa_t AVX2 = {"avx", 4, true};
+
+/* Global variable used to give every vectorized loop its own labels */
+static int vector_counter = 0;
+
+/* Set when a vectorized loop has been generated, making main find out if the processor has AVX2 */
+static bool uses_vector_dispatch = false;
+
+/**
+ * State for the vectorized loop being generated. Numbers and variables are broadcast into vector registers
+ * of their own in front of the loop, as is the loop variable, which is increased along with the index.
+ * Temporary registers are freed again as soon as their value has been used.
+ */
+static const vector_isa_t *vector_isa;
+static bool vector_in_use[NUM_VECTOR_REGISTERS];
+static bool vector_temporary[NUM_VECTOR_REGISTERS];
+static node_t **vector_operands;  // The numbers and variables in the loop, with the register they are broadcast to
+static int *vector_operand_registers;
+static size_t n_vector_operands;
+static symbol_t **vector_arrays;  // The arrays in the loop, with the register holding their address
+static const char **vector_bases;
+static size_t n_vector_arrays;
+static symbol_t *vector_variable;
+static const char *vector_index;  // The register holding the loop variable while the loop runs
+static bool vector_uses_variable;  // The value of the loop variable is used, not just as an index
+static int vector_variable_register, vector_step_register;
+
 static bool is_less_than_relation(const char *str) {
     return strcmp(str, "<") == 0;
 }
@@ -55,16 +225,45 @@ static bool is_not_equal_relation(const char *str) {
     return strcmp(str, "!=") == 0;
 }
 
+/* Returns the condition code of the relation, as used in the names of jumps and conditional moves */
+static const char *relation_condition(const char *str) {
+    if (is_equal_relation(str))
+        return "e";
+    if (is_not_equal_relation(str))
+        return "ne";
+    if (is_less_than_relation(str))
+        return "l";
+    assert(is_greater_than_relation(str) && "Unknown relation");
+    return "g";
+}
+
 static symbol_t *get_topmost_function() {
     symbol_t *first_function = NULL;
+    bool *generated = calloc(global_symbols->n_symbols, sizeof(bool));
+    function_clobbers = malloc(global_symbols->n_symbols * sizeof(uint32_t));
+    function_register_params = malloc(global_symbols->n_symbols * sizeof(int));
+    folding_candidates = malloc(global_symbols->n_symbols * sizeof(symbol_t *));
+    function_hashes = malloc(global_symbols->n_symbols * sizeof(uint64_t));
+    function_sizes = malloc(global_symbols->n_symbols * sizeof(size_t));
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+        function_clobbers[i] = register_mask(SYSTEM_V_CALLER_SAVED);
+        function_register_params[i] = -1;
+    }
+    for (size_t i = 0; i < global_symbols->n_symbols && tail_calls; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION)
+            find_tail_called_functions(symbol->node->children[2], symbol);
+    }
+
     for (size_t i = 0; i < global_symbols->n_symbols; i++) {
         symbol_t *symbol = global_symbols->symbols[i];
         if (symbol->type != SYMBOL_FUNCTION)
             continue;
         if (!first_function)
             first_function = symbol;
-        generate_function(symbol);
+        generate_function_and_callees(symbol, generated);
     }
+    free(generated);
 
     if (first_function == NULL) {
         fprintf(stderr, "error: program contained no functions\n");
@@ -74,6 +273,26 @@ static symbol_t *get_topmost_function() {
     return first_function;
 }
 
+/* Generates the functions called by the function before the function itself, so their clobbers are known */
+static void generate_function_and_callees(symbol_t *function, bool *generated) {
+    if (generated[function->sequence_number])
+        return;
+    generated[function->sequence_number] = true;
+    find_callees(function->node->children[2], generated);
+    generate_function(function);
+}
+
+static void find_callees(node_t *node, bool *generated) {
+    if (node->type == EXPRESSION && node->data != NULL && strcmp(node->data, "call") == 0) {
+        symbol_t *symbol = node->children[0]->symbol;
+        if (symbol->type == SYMBOL_FUNCTION)
+            generate_function_and_callees(symbol, generated);
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL)
+            find_callees(node->children[i], generated);
+}
+
 /* Entry point for code generation */
 void generate_program(void) {
     generate_string_table();
@@ -82,6 +301,17 @@ void generate_program(void) {
     DIRECTIVE(".text");
     symbol_t *first_function = get_topmost_function();
     generate_main(first_function);
+    free(function_clobbers);
+    free(function_register_params);
+    free(folding_candidates);
+    free(function_hashes);
+    free(function_sizes);
+    if (report_optimizations && n_folded_functions > 0)
+        fprintf(stderr, "icf: %zu functions folded, %zu bytes of assembly saved\n", n_folded_functions, folded_bytes);
+
+    // Everything has been emitted to a buffer, which is cleaned up before it is printed
+    peephole_optimize();
+    flush_emitted_lines();
 }
 
 /* Prints one .asciz entry for each string in the global string_list */
@@ -116,7 +346,11 @@ static void generate_global_variables(void) {
                 exit(EXIT_FAILURE);
             }
             int64_t length = *(int64_t *)child->data;
-            DIRECTIVE(".%s: \t.zero %ld", symbol->name, length * 8);
+            int64_t size = symbol->element_width == ELEMENT_BIT ? (length + 63) / 64 * 8
+                                                                 : length << ELEMENT_SHIFTS[symbol->element_width];
+            // Arrays start at 32-byte boundaries, where vectors loaded from the start of them never cross a cache line
+            DIRECTIVE(".align 32");
+            DIRECTIVE(".%s: \t.zero %ld", symbol->name, size);
         }
     }
 
@@ -125,40 +359,451 @@ static void generate_global_variables(void) {
 
 /* Prints the entry point. preamble, statements and epilouge of the given function */
 static void generate_function(symbol_t *function) {
+    if (identical_code_folding && fold_identical_function(function))
+        return;
+
+    size_t first_line = count_emitted_lines();
+    if (!generate_function_code(function, is_leaf(function->node->children[2]))) {
+        // The leaf function pushed something after all, so it is generated again, with a frame
+        discard_emitted_lines(first_line);
+        generate_function_code(function, false);
+    }
+
+    // Callee-saved registers are restored before returning, so only the caller-saved ones named are changed.
+    // The caller writes the registers carrying the arguments, even those never read, and gets the result in %rax
+    uint32_t clobbers = registers_named_since(first_line) & register_mask(SYSTEM_V_CALLER_SAVED);
+    clobbers |= current_clobbers | register_mask(RAX);
+    for (int i = 0; i < get_register_params(function); i++)
+        clobbers |= register_mask(REGISTER_PARAMS[i]);
+    function_clobbers[function->sequence_number] = clobbers;
+
+    function_sizes[function->sequence_number] = count_emitted_bytes_since(first_line);
+    folding_candidates[n_folding_candidates++] = function;
+}
+
+/**
+ * Makes the function an alias of a function generated before it with the same body, if there is one.
+ * Calls to either function then pass their arguments the same way, and are known to change the same registers
+ */
+static bool fold_identical_function(symbol_t *function) {
+    node_t *body = function->node->children[2];
+    uint64_t hash = hash_function_node(body, function);
+    function_hashes[function->sequence_number] = hash;
+
+    for (size_t i = 0; i < n_folding_candidates; i++) {
+        symbol_t *candidate = folding_candidates[i];
+        if (function_hashes[candidate->sequence_number] != hash)
+            continue;
+
+        // The register allocator decides how the parameters are passed, unless recursion has fixed it already
+        int register_params = function_register_params[function->sequence_number];
+        if (register_params >= 0 && register_params != function_register_params[candidate->sequence_number])
+            continue;
+
+        symbol_table_t *locals = function->function_symtable, *candidate_locals = candidate->function_symtable;
+        if (FUNC_PARAM_COUNT(function) != FUNC_PARAM_COUNT(candidate) || locals->n_symbols != candidate_locals->n_symbols)
+            continue;
+        bool same_locals = true;
+        for (size_t j = 0; j < locals->n_symbols; j++)
+            same_locals &= locals->symbols[j]->type == candidate_locals->symbols[j]->type;
+        if (!same_locals || !is_same_function_node(body, function, candidate->node->children[2], candidate))
+            continue;
+
+        DIRECTIVE(".set .%s, .%s", function->name, candidate->name);
+        DIRECTIVE();
+        function_register_params[function->sequence_number] = function_register_params[candidate->sequence_number];
+        function_clobbers[function->sequence_number] = function_clobbers[candidate->sequence_number];
+        n_folded_functions++;
+        folded_bytes += function_sizes[candidate->sequence_number];
+        if (report_optimizations)
+            fprintf(stderr, "icf: '%s' folded into '%s'\n", function->name, candidate->name);
+        return true;
+    }
+    return false;
+}
+
+/* Hashes the subtree, giving the same hash to the subtrees is_same_function_node finds to be the same */
+static uint64_t hash_function_node(node_t *node, symbol_t *function) {
+    uint64_t hash = mix_hash(mix_hash(14695981039346656037u, node->type), node->n_children);
+    switch (node->type) {
+        case NUMBER_DATA:
+            hash = mix_hash(hash, *(int64_t *)node->data);
+            break;
+        case STRING_DATA:
+            for (const char *c = string_list[*(int64_t *)node->data]; *c != '\0'; c++)
+                hash = mix_hash(hash, *c);
+            break;
+        case IDENTIFIER_DATA: {
+            // Parameters and local variables are told apart by their place in the symbol table of the function
+            symbol_t *symbol = node->symbol;
+            if (symbol == NULL)
+                hash = mix_hash(hash, 2);
+            else if (symbol == function)
+                hash = mix_hash(hash, 1);
+            else if (symbol->type == SYMBOL_PARAMETER || symbol->type == SYMBOL_LOCAL_VAR)
+                hash = mix_hash(mix_hash(hash, symbol->type), symbol->sequence_number);
+            else
+                hash = mix_hash(hash, (uintptr_t)symbol);
+            break;
+        }
+        default:
+            if (node->data != NULL)
+                for (const char *c = node->data; *c != '\0'; c++)
+                    hash = mix_hash(hash, *c);
+            break;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL)
+            hash = mix_hash(hash, hash_function_node(node->children[i], function));
+    return hash;
+}
+
+/* One step of the 64-bit FNV-1a hash, taking a whole value at a time */
+static uint64_t mix_hash(uint64_t hash, uint64_t value) {
+    return (hash ^ value) * 1099511628211u;
+}
+
+static bool is_same_function_node(node_t *a, symbol_t *function_a, node_t *b, symbol_t *function_b) {
+    if (a == NULL || b == NULL)
+        return a == b;
+    if (a->type != b->type || a->n_children != b->n_children)
+        return false;
+
+    switch (a->type) {
+        case NUMBER_DATA:
+            if (*(int64_t *)a->data != *(int64_t *)b->data)
+                return false;
+            break;
+        case STRING_DATA:
+            if (strcmp(string_list[*(int64_t *)a->data], string_list[*(int64_t *)b->data]) != 0)
+                return false;
+            break;
+        case IDENTIFIER_DATA:
+            if (!is_same_reference(a->symbol, function_a, b->symbol, function_b))
+                return false;
+            break;
+        default:
+            if ((a->data == NULL) != (b->data == NULL) || (a->data != NULL && strcmp(a->data, b->data) != 0))
+                return false;
+            break;
+    }
+
+    for (size_t i = 0; i < a->n_children; i++)
+        if (!is_same_function_node(a->children[i], function_a, b->children[i], function_b))
+            return false;
+    return true;
+}
+
+/* Returns true if the two symbols, named in the bodies of the two functions, play the same part in them */
+static bool is_same_reference(symbol_t *a, symbol_t *function_a, symbol_t *b, symbol_t *function_b) {
+    if (a == NULL || b == NULL)
+        return a == b;
+    if (a == function_a || b == function_b)
+        return a == function_a && b == function_b;
+    if (a->type == SYMBOL_PARAMETER || a->type == SYMBOL_LOCAL_VAR)
+        return a->type == b->type && a->sequence_number == b->sequence_number;
+    return a == b;
+}
+
+/**
+ * Generates the function. Its frame is reserved with a single subq, holding the saved callee-saved registers
+ * followed by the stack slots, and rounded up to keep the stack 16-byte aligned.
+ * Leaf functions whose frame fits in the red zone get no frame at all, see omits_frame_pointer.
+ * Returns false if such a function pushed something, in which case the code must be thrown away.
+ */
+static bool generate_function_code(symbol_t *function, bool leaf) {
     LABEL(".%s", function->name);
     current_function = function;
+    int *register_params = &function_register_params[function->sequence_number];
+    current_allocation = allocate_registers(function, function_clobbers, *register_params);
+    *register_params = current_allocation->n_register_params;
+    current_clobbers = 0;
+    instruction_selection_begin(current_allocation);
+    stack_depth = 0;
+    stack_touched = false;
+
+    // Registers holding variables can not be used for evaluating expressions
+    for (size_t i = 0; i < NUM_SCRATCH_REGISTERS; i++) {
+        scratch_in_use[i] = false;
+        scratch_holds_variable[i] = false;
+        for (size_t j = 0; j < current_allocation->n_locations; j++) {
+            const char *reg = current_allocation->locations[j].reg;
+            if (reg != NULL && is_same_register(reg, SCRATCH_REGISTERS[i]))
+                scratch_holds_variable[i] = true;
+        }
+    }
 
-    PUSHQ(RBP);
-    MOVQ(RSP, RBP);
+    int frame_size = 8 * (current_allocation->n_callee_saved + current_allocation->n_stack_slots);
+    omits_frame_pointer = leaf && frame_size <= RED_ZONE_SIZE;
+    if (!omits_frame_pointer) {
+        PUSHQ(RBP);
+        MOVQ(RSP, RBP);
+        // The return address and %rbp make 16 bytes, so the frame is padded to a multiple of 16
+        frame_size = (frame_size + 15) & -16;
+        if (frame_size > 0)
+            EMIT("subq $%d, %s", frame_size, RSP);
+    }
+
+    // Save the callee-saved registers that have been handed out to variables
+    for (size_t i = 0; i < current_allocation->n_callee_saved; i++) {
+        EMIT("movq %s, %ld(%s)", current_allocation->callee_saved[i], -8 * (i + 1), frame_pointer());
+    }
 
-    // Up to 6 prameters have been passed in registers. Place them on the stack instead
-    for (size_t i = 0; i < FUNC_PARAM_COUNT(function) && i < NUM_REGISTER_PARAMS; i++) {
-        PUSHQ(REGISTER_PARAMS[i]);
+    // The stack slots are placed right below the saved registers, in order, and shared by variables that
+    // are never live at the same time. Register parameters that did not get a register of their own are
+    // spilled to their slot, and local variables that could be read before they are assigned start out as 0
+    for (size_t i = 0; i < current_allocation->n_locations; i++) {
+        variable_location_t *location = &current_allocation->locations[i];
+        symbol_t *symbol = function->function_symtable->symbols[i];
+        if (location->stack_slot < 0)
+            continue;
+        if (symbol->type == SYMBOL_PARAMETER)
+            MOVQ(REGISTER_PARAMS[symbol->sequence_number], generate_symbol_access(symbol));
+        else if (location->needs_zero)
+            EMIT("movq $0, %s", generate_symbol_access(symbol));
     }
 
-    // Now, for each local variable, push 8-byte 0 values to the stack
-    for (size_t i = 0; i < function->function_symtable->n_symbols; i++) {
+    // Move the parameters that were given registers into place, and zero the local variables
+    // in registers that could be read before they are assigned
+    const char **sources = malloc(current_allocation->n_locations * sizeof(const char *));
+    const char **destinations = malloc(current_allocation->n_locations * sizeof(const char *));
+    size_t n_moves = 0;
+    for (size_t i = 0; i < current_allocation->n_locations; i++) {
+        variable_location_t *location = &current_allocation->locations[i];
         symbol_t *symbol = function->function_symtable->symbols[i];
-        if (symbol->type == SYMBOL_LOCAL_VAR) {
-            PUSHQ("$0");
+        if (location->reg == NULL || symbol->type != SYMBOL_PARAMETER)
+            continue;
+
+        int stack_index = (int)symbol->sequence_number - (int)current_allocation->n_register_params;
+        if (stack_index < 0) {
+            sources[n_moves] = REGISTER_PARAMS[symbol->sequence_number];
+        } else {
+            char *stack_argument = malloc(32);
+            snprintf(stack_argument, 32, "%d(%s)", stack_argument_offset(stack_index), frame_pointer());
+            sources[n_moves] = stack_argument;
         }
+        destinations[n_moves++] = location->reg;
+    }
+    generate_parallel_move(sources, destinations, n_moves);
+    for (size_t i = 0; i < n_moves; i++) {
+        if (sources[i][0] != '%')
+            free((char *)sources[i]);
+    }
+    free(sources);
+    free(destinations);
+
+    for (size_t i = 0; i < current_allocation->n_locations; i++) {
+        variable_location_t *location = &current_allocation->locations[i];
+        if (location->reg != NULL && location->needs_zero && function->function_symtable->symbols[i]->type == SYMBOL_LOCAL_VAR)
+            MOVQ("$0", location->reg);
     }
 
+    // Tail calls to the function itself jump back here, see generate_tail_call
     node_t *function_body = function->node->children[2];
+    if (has_self_tail_call(function_body))
+        LABEL("tail_%s", function->name);
     generate_statement(function_body);
+    assert(stack_depth == 0);
 
     // In case the function didn't return, return 0 here
     MOVQ("$0", RAX);
+    generate_epilogue();
 
-    // leaveq is written out manually, to increase clarity of what happens
-    MOVQ(RBP, RSP);
-    POPQ(RBP);
+    DIRECTIVE();
+
+    instruction_selection_end();
+    register_allocation_destroy(current_allocation);
+    current_allocation = NULL;
+    return !(omits_frame_pointer && stack_touched);
+}
+
+/* Returns true if the statement makes no calls, which includes printing */
+static bool is_leaf(node_t *node) {
+    if (node->type == PRINT_STATEMENT || (node->type == EXPRESSION && node->data != NULL && strcmp(node->data, "call") == 0))
+        return false;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL && !is_leaf(node->children[i]))
+            return false;
+    return true;
+}
+
+/* The register the variables on the stack are addressed from */
+static const char *frame_pointer(void) {
+    return omits_frame_pointer ? RSP : RBP;
+}
+
+/* Returns where the given parameter of the ones passed on the stack is, from the frame pointer */
+static int stack_argument_offset(int stack_index) {
+    // The first is right above the return address, and %rbp when it is saved, with further parameters moving up
+    int offset = 8 + stack_index * 8;
+    return omits_frame_pointer ? offset : offset + 8;
+}
+
+/**
+ * Functions returned from by other functions get all the parameters they can in registers, so that passing
+ * arguments on the stack does not keep the calls from becoming jumps, see is_tail_call
+ */
+static void find_tail_called_functions(node_t *node, symbol_t *function) {
+    if (node->type == RETURN_STATEMENT) {
+        node_t *expression = node->children[0];
+        if (expression->type == EXPRESSION && expression->data != NULL && strcmp(expression->data, "call") == 0) {
+            symbol_t *callee = expression->children[0]->symbol;
+            if (callee->type == SYMBOL_FUNCTION && callee != function)
+                get_register_params(callee);
+        }
+        return;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL)
+            find_tail_called_functions(node->children[i], function);
+}
+
+/**
+ * Returns how many parameters are passed to the function in registers. If the register allocator has not
+ * been run for the function yet, it is fixed here to as many as possible, which the allocator then follows.
+ */
+static int get_register_params(symbol_t *function) {
+    int *register_params = &function_register_params[function->sequence_number];
+    if (*register_params < 0) {
+        int parameter_count = FUNC_PARAM_COUNT(function);
+        *register_params = parameter_count < NUM_REGISTER_PARAMS ? parameter_count : NUM_REGISTER_PARAMS;
+    }
+    return *register_params;
+}
+
+static void push_quadword(const char *source) {
+    PUSHQ(source);
+    stack_depth++;
+    stack_touched = true;
+}
+
+static void pop_quadword(const char *destination) {
+    POPQ(destination);
+    stack_depth--;
+}
+
+/* Removes the given number of quadwords from the top of the stack */
+static void drop_quadwords(int count) {
+    if (count > 0)
+        EMIT("addq $%d, %s", count * 8, RSP);
+    stack_depth -= count;
+}
+
+/* Restores the callee-saved registers and the caller's frame, and returns from the current function */
+static void generate_epilogue(void) {
+    generate_frame_teardown();
     RET;
+}
 
-    DIRECTIVE();
+/* Restores the callee-saved registers and the caller's frame, leaving the return address on top of the stack */
+static void generate_frame_teardown(void) {
+    for (size_t i = 0; i < current_allocation->n_callee_saved; i++) {
+        EMIT("movq %ld(%s), %s", -8 * (i + 1), frame_pointer(), current_allocation->callee_saved[i]);
+    }
+
+    // leaveq is written out manually, to increase clarity of what happens
+    if (!omits_frame_pointer) {
+        MOVQ(RBP, RSP);
+        POPQ(RBP);
+    }
+}
+
+/**
+ * Moves every source into its destination register as if all the moves happened at once,
+ * so that no source is overwritten before it has been read. Cycles are broken using %rax.
+ */
+static void generate_parallel_move(const char **sources, const char **destinations, size_t n) {
+    const char **pending_sources = malloc(n * sizeof(const char *));
+    bool *done = calloc(n, sizeof(bool));
+    size_t remaining = n;
+
+    for (size_t i = 0; i < n; i++) {
+        pending_sources[i] = sources[i];
+        // Values that are already in place need no moving
+        if (strcmp(sources[i], destinations[i]) == 0) {
+            done[i] = true;
+            remaining--;
+        }
+    }
+
+    while (remaining > 0) {
+        bool progress = false;
+        for (size_t i = 0; i < n; i++) {
+            if (done[i])
+                continue;
+
+            // A move must wait until no other pending move reads the register it overwrites
+            bool blocked = false;
+            for (size_t j = 0; j < n && !blocked; j++)
+                blocked = !done[j] && j != i && strcmp(pending_sources[j], destinations[i]) == 0;
+            if (blocked)
+                continue;
+
+            MOVQ(pending_sources[i], destinations[i]);
+            done[i] = true;
+            remaining--;
+            progress = true;
+        }
+
+        if (!progress) {
+            // Only cycles are left. Break one by moving a source out of the way
+            size_t i = 0;
+            while (done[i])
+                i++;
+            MOVQ(pending_sources[i], RAX);
+            pending_sources[i] = RAX;
+        }
+    }
+
+    free(done);
+    free(pending_sources);
+}
+
+static bool is_same_register(const char *a, const char *b) {
+    return strcmp(a, b) == 0;
+}
+
+static size_t scratch_register_index(const char *reg) {
+    for (size_t i = 0; i < NUM_SCRATCH_REGISTERS; i++)
+        if (is_same_register(SCRATCH_REGISTERS[i], reg))
+            return i;
+    assert(false && "Not a scratch register");
+    return 0;
+}
+
+static bool is_scratch_register_in_use(const char *reg) {
+    return scratch_in_use[scratch_register_index(reg)];
+}
+
+static void reserve_scratch_register(const char *reg) {
+    size_t index = scratch_register_index(reg);
+    assert(!scratch_in_use[index] && !scratch_holds_variable[index]);
+    scratch_in_use[index] = true;
+}
+
+static void release_scratch_register(const char *reg) {
+    scratch_in_use[scratch_register_index(reg)] = false;
+}
+
+/**
+ * Returns a free scratch register, and marks it as in use, or NULL if all of them are taken.
+ * The division registers RAX and RDX can be avoided, for values that must survive an idivq.
+ */
+static const char *allocate_scratch_register(bool avoid_division_registers) {
+    for (size_t i = 0; i < NUM_SCRATCH_REGISTERS; i++) {
+        const char *reg = SCRATCH_REGISTERS[i];
+        if (scratch_in_use[i] || scratch_holds_variable[i])
+            continue;
+        if (avoid_division_registers && (is_same_register(reg, RAX) || is_same_register(reg, RDX)))
+            continue;
+        scratch_in_use[i] = true;
+        return reg;
+    }
+    return NULL;
 }
 
-static void generate_function_call(node_t *call) {
+/* Generates code for calling a function, and places the returned value in dest */
+static void generate_function_call(node_t *call, const char *dest) {
     symbol_t *symbol = call->children[0]->symbol;
     if (symbol->type != SYMBOL_FUNCTION) {
         fprintf(stderr, "error: '%s' is not a function\n", symbol->name);
@@ -174,22 +819,149 @@ static void generate_function_call(node_t *call) {
         exit(EXIT_FAILURE);
     }
 
-    // We evaluate all parameters from right to left, pushing them to the stack
-    for (int i = parameter_count - 1; i >= 0; i--) {
-        generate_expression(argument_list->children[i]);
-        PUSHQ(RAX);
+    // Temporaries of the surrounding expression in registers the callee changes are saved on the stack.
+    // The destination is only written once the call returns, so it is free for evaluating the arguments
+    uint32_t clobbers = function_clobbers[symbol->sequence_number];
+    current_clobbers |= clobbers;
+    const char *saved[NUM_SCRATCH_REGISTERS];
+    size_t n_saved = 0;
+    bool holds_destination[NUM_SCRATCH_REGISTERS] = {false};
+    for (size_t i = 0; i < NUM_SCRATCH_REGISTERS; i++) {
+        if (scratch_in_use[i] && is_same_register(SCRATCH_REGISTERS[i], dest)) {
+            holds_destination[i] = true;
+            scratch_in_use[i] = false;
+        } else if (scratch_in_use[i] && (register_mask(SCRATCH_REGISTERS[i]) & clobbers)) {
+            saved[n_saved++] = SCRATCH_REGISTERS[i];
+            push_quadword(SCRATCH_REGISTERS[i]);
+            scratch_in_use[i] = false;
+        }
     }
 
-    // Up to 6 parameters should be passed through registers instead. Pop them off the stack
-    for (size_t i = 0; i < parameter_count && i < NUM_REGISTER_PARAMS; i++) {
-        POPQ(REGISTER_PARAMS[i]);
+    // The call is made with the stack 16-byte aligned, so it is padded below the arguments left on it
+    int register_arguments = get_register_params(symbol);
+    int stack_arguments = parameter_count - register_arguments;
+    int padding = (stack_depth + stack_arguments) % 2;
+    if (padding > 0) {
+        SUBQ("$8", RSP);
+        stack_depth++;
+    }
+
+    if (stack_arguments == 0 && can_place_arguments(argument_list, parameter_count)) {
+        generate_argument_placement(argument_list, parameter_count);
+    } else {
+        // We evaluate all parameters from right to left, pushing them to the stack
+        for (int i = parameter_count - 1; i >= 0; i--) {
+            const char *argument = allocate_scratch_register(false);
+            generate_expression_into(argument_list->children[i], argument);
+            push_quadword(argument);
+            release_scratch_register(argument);
+        }
+
+        // Up to 8 parameters should be passed through registers instead. Pop them off the stack
+        for (int i = 0; i < register_arguments; i++) {
+            pop_quadword(REGISTER_PARAMS[i]);
+        }
     }
 
+    assert(stack_depth % 2 == 0);
     EMIT("call .%s", symbol->name);
 
     // Now pop away any stack passed parameters still left on the stack, by moving %rsp upwards
-    if (parameter_count > NUM_REGISTER_PARAMS) {
-        EMIT("addq $%d, %s", (parameter_count - NUM_REGISTER_PARAMS) * 8, RSP);
+    drop_quadwords(stack_arguments + padding);
+
+    if (!is_same_register(dest, RAX))
+        MOVQ(RAX, dest);
+    for (size_t i = 0; i < NUM_SCRATCH_REGISTERS; i++)
+        if (holds_destination[i])
+            reserve_scratch_register(SCRATCH_REGISTERS[i]);
+
+    for (size_t i = n_saved; i > 0; i--) {
+        pop_quadword(saved[i - 1]);
+        reserve_scratch_register(saved[i - 1]);
+    }
+}
+
+/* Numbers and variables are moved straight into the register of their parameter */
+static bool is_argument_operand(node_t *argument) {
+    if (argument->type == NUMBER_DATA)
+        return true;
+    if (argument->type != IDENTIFIER_DATA)
+        return false;
+    symtype_t type = argument->symbol->type;
+    return type == SYMBOL_GLOBAL_VAR || type == SYMBOL_PARAMETER || type == SYMBOL_LOCAL_VAR;
+}
+
+/**
+ * Returns true if the first n arguments, which are passed in registers, can be evaluated right into them.
+ * There can be no calls that would clobber the ones already placed, and there must be
+ * a free scratch register for every argument that is not an operand.
+ */
+static bool can_place_arguments(node_t *argument_list, size_t n) {
+    size_t n_expressions = 0;
+    for (size_t i = 0; i < argument_list->n_children; i++) {
+        node_t *argument = argument_list->children[i];
+        if (contains_call(argument))
+            return false;
+        if (i < n && !is_argument_operand(argument))
+            n_expressions++;
+    }
+
+    // %rax is kept free for breaking cycles in the parallel move, and %rdx is clobbered by divisions
+    size_t n_free = 0;
+    for (size_t i = 0; i < NUM_SCRATCH_REGISTERS; i++) {
+        const char *reg = SCRATCH_REGISTERS[i];
+        if (!scratch_in_use[i] && !scratch_holds_variable[i] && !is_same_register(reg, RAX) && !is_same_register(reg, RDX))
+            n_free++;
+    }
+    return n_expressions <= n_free;
+}
+
+/**
+ * Evaluates the first n arguments from right to left into the registers they are passed in, or into other
+ * scratch registers when those are taken, and moves them and the numbers and variables into place all at once.
+ */
+static void generate_argument_placement(node_t *argument_list, size_t n) {
+    const char *sources[NUM_REGISTER_PARAMS];
+    bool evaluated[NUM_REGISTER_PARAMS];
+    for (int i = n - 1; i >= 0; i--) {
+        node_t *argument = argument_list->children[i];
+        evaluated[i] = !is_argument_operand(argument);
+        if (!evaluated[i])
+            continue;
+
+        size_t index = scratch_register_index(REGISTER_PARAMS[i]);
+        const char *reg;
+        if (!scratch_in_use[index] && !scratch_holds_variable[index]) {
+            reg = REGISTER_PARAMS[i];
+            reserve_scratch_register(reg);
+        } else {
+            reg = allocate_scratch_register(true);
+            assert(reg != NULL);
+        }
+        generate_expression_into(argument, reg);
+        sources[i] = reg;
+    }
+
+    // The operands are read after every expression has been evaluated, as their registers may be moved into
+    for (size_t i = 0; i < n; i++) {
+        node_t *argument = argument_list->children[i];
+        if (evaluated[i])
+            continue;
+        if (argument->type == NUMBER_DATA) {
+            char *number = malloc(32);
+            snprintf(number, 32, "$%ld", *(int64_t *)argument->data);
+            sources[i] = number;
+        } else {
+            sources[i] = strdup(generate_symbol_access(argument->symbol));
+        }
+    }
+
+    generate_parallel_move(sources, REGISTER_PARAMS, n);
+    for (size_t i = 0; i < n; i++) {
+        if (evaluated[i])
+            release_scratch_register(sources[i]);
+        else
+            free((char *)sources[i]);
     }
 }
 
@@ -197,39 +969,33 @@ static void generate_function_call(node_t *call) {
 static const char *generate_variable_access(node_t *node) {
     assert(node->type == IDENTIFIER_DATA);
 
+    return generate_symbol_access(node->symbol);
+}
+
+/* Returns a string for accessing the quadword of the variable, valid until the next access */
+static const char *generate_symbol_access(symbol_t *symbol) {
     static char result[100];
 
-    symbol_t *symbol = node->symbol;
     switch (symbol->type) {
         case SYMBOL_GLOBAL_VAR: {
             snprintf(result, sizeof(result), ".%s(%s)", symbol->name, RIP);
             return result;
         }
-        case SYMBOL_LOCAL_VAR: {
-            // If we have more than 6 parameters, subtract away the hole in the sequence numbers
-            int call_frame_offset = symbol->sequence_number;
-            if (FUNC_PARAM_COUNT(current_function) > NUM_REGISTER_PARAMS) {
-                call_frame_offset -= FUNC_PARAM_COUNT(current_function) - NUM_REGISTER_PARAMS;
-            }
-
-            // The stack grows down, in multiples of 8, and sequence number 0 corresponds to -8
-            call_frame_offset = (-call_frame_offset - 1) * 8;
-
-            snprintf(result, sizeof(result), "%d(%s)", call_frame_offset, RBP);
-            return result;
-        }
+        case SYMBOL_LOCAL_VAR:
         case SYMBOL_PARAMETER: {
+            variable_location_t *location = &current_allocation->locations[symbol->sequence_number];
+            if (location->reg != NULL)
+                return location->reg;
+
             int call_frame_offset;
-            // Handle the first 6 parameters differently
-            if (symbol->sequence_number < NUM_REGISTER_PARAMS) {
-                // Move along down the stack, with parameter 0 at position -8(%rbp)
-                call_frame_offset = (-symbol->sequence_number - 1) * 8;
+            if (location->stack_slot >= 0) {
+                // The stack grows down, in multiples of 8, with the slots placed below the saved registers
+                call_frame_offset = (-(int)current_allocation->n_callee_saved - location->stack_slot - 1) * 8;
             } else {
-                // Parameter 6 is at 16(%rbp), with further parameters moving up from there
-                call_frame_offset = 16 + (symbol->sequence_number - NUM_REGISTER_PARAMS) * 8;
+                call_frame_offset = stack_argument_offset(symbol->sequence_number - current_allocation->n_register_params);
             }
 
-            snprintf(result, sizeof(result), "%d(%s)", call_frame_offset, RBP);
+            snprintf(result, sizeof(result), "%d(%s)", call_frame_offset, frame_pointer());
             return result;
         }
         case SYMBOL_FUNCTION: {
@@ -245,123 +1011,594 @@ static const char *generate_variable_access(node_t *node) {
     }
 }
 
-/**
- * Returns a string for accessing the quadword referenced by the ARRAY_INDEXING node.
- * Code for evaluating the index will be emitted, which can potentially mess with all registers.
- * The resulting memory access string will not make use of the %rax register.
- */
-static const char *generate_array_access(node_t *node) {
-    assert(node->type == ARRAY_INDEXING);
-
+/* Returns the symbol of the array indexed by the ARRAY_INDEXING node */
+static symbol_t *get_indexed_array(node_t *node) {
     symbol_t *symbol = node->children[0]->symbol;
     if (symbol->type != SYMBOL_GLOBAL_ARRAY) {
         fprintf(stderr, "error: symbol '%s' is not an array\n", symbol->name);
         exit(EXIT_FAILURE);
     }
+    return symbol;
+}
+
+/**
+ * Returns a string for accessing the element of the array at the index held in the given register.
+ * The string is only valid until another scratch register is handed out, and the index may be overwritten.
+ */
+static const char *generate_element_access(symbol_t *array, const char *index) {
+    static char result[100];
+    assert(array->element_width != ELEMENT_BIT);
+    int shift = ELEMENT_SHIFTS[array->element_width];
+
+    const char *base = allocate_scratch_register(false);
+    if (base != NULL) {
+        // Place the base of the array into a register of its own, and scale the index in the address
+        EMIT("leaq .%s(%s), %s", array->name, RIP, base);
+        snprintf(result, sizeof(result), "(%s, %s, %d)", base, index, 1 << shift);
+        release_scratch_register(base);
+    } else {
+        // Out of registers, so add the scaled index to the base of the array through the stack
+        if (shift > 0)
+            EMIT("shlq $%d, %s", shift, index);
+        push_quadword(index);
+        EMIT("leaq .%s(%s), %s", array->name, RIP, index);
+        ADDQ(MEM(RSP), index);
+        drop_quadwords(1);
+        snprintf(result, sizeof(result), "(%s)", index);
+    }
+    return result;
+}
+
+/* Loads the element of the array at the index held in the register into the register, extending narrow elements */
+static void generate_element_load(symbol_t *array, const char *index) {
+    static const char *NARROW_LOADS[] = {
+        [ELEMENT_DOUBLEWORD] = "movslq", [ELEMENT_WORD] = "movswq", [ELEMENT_BYTE] = "movsbq"};
+    switch (array->element_width) {
+        case ELEMENT_QUADWORD:
+            MOVQ(generate_element_access(array, index), index);
+            break;
+        case ELEMENT_BIT:
+            // The bit goes into the carry flag, and subtracting the register and the carry from itself gives 0 or -1
+            EMIT("btq %s, .%s(%s)", index, array->name, RIP);
+            EMIT("sbbq %s, %s", index, index);
+            EMIT("negq %s", index);
+            break;
+        default:
+            EMIT("%s %s, %s", NARROW_LOADS[array->element_width], generate_element_access(array, index), index);
+    }
+}
+
+/**
+ * Returns a string for accessing the quadword referenced by the ARRAY_INDEXING or POINTER_INDEXING node.
+ * Code for evaluating the index of the element into the given scratch register will be emitted.
+ */
+static const char *generate_array_access(node_t *node, const char *address) {
+    if (node->type == ARRAY_INDEXING) {
+        symbol_t *symbol = get_indexed_array(node);
+        generate_expression_into(node->children[1], address);
+        return generate_element_access(symbol, address);
+    }
 
-    // Calculate the index of the array into %rax
-    node_t *index = node->children[1];
-    generate_expression(index);
+    assert(node->type == POINTER_INDEXING);
+    static char result[100];
+    generate_expression_into(node->children[1], address);
+    const char *pointer = generate_variable_access(node->children[0]);
+    if (pointer[0] == '%') {
+        snprintf(result, sizeof(result), "(%s, %s, 8)", pointer, address);
+    } else {
+        EMIT("shlq $3, %s", address);
+        ADDQ(pointer, address);
+        snprintf(result, sizeof(result), "(%s)", address);
+    }
+    return result;
+}
 
-    // Place the base of the array into %r10
-    EMIT("leaq .%s(%s), %s", symbol->name, RIP, R10);
+/* Returns a string for a variable, or an element at a constant index, used directly as an operand */
+static const char *generate_operand_access(node_t *node) {
+    if (node->type == IDENTIFIER_DATA)
+        return generate_variable_access(node);
 
-    // Place the exact position of the element we wish to access, into %r10
-    EMIT("leaq (%s, %s, 8), %s", R10, RAX, R10);
+    static char result[100];
+    assert(node->children[1]->type == NUMBER_DATA);
+    int64_t index = *(int64_t *)node->children[1]->data;
+    if (node->type == POINTER_INDEXING) {
+        const char *pointer = generate_variable_access(node->children[0]);
+        if (index == 0)
+            snprintf(result, sizeof(result), "(%s)", pointer);
+        else
+            snprintf(result, sizeof(result), "%ld(%s)", index * 8, pointer);
+        return result;
+    }
 
-    // Now, the element we wish to access is stored at %r10 exactly, so just use that to reference it
-    return MEM(R10);
+    assert(node->type == ARRAY_INDEXING);
+    symbol_t *symbol = get_indexed_array(node);
+    snprintf(result, sizeof(result), ".%s%+ld(%s)", symbol->name, index * 8, RIP);
+    return result;
 }
 
-/* Generates code to evaluate the expression, and place the result in %rax */
-static void generate_expression(node_t *expression) {
-    switch (expression->type) {
-        case NUMBER_DATA: {
-            // Simply place the number into RAX
-            EMIT("movq $%ld, %s", *(int64_t *)expression->data, RAX);
-            break;
-        }
-        case IDENTIFIER_DATA: {
-            // Load the variable, and put the result in RAX
-            MOVQ(generate_variable_access(expression), RAX);
-            break;
-        }
+/**
+ * Sethi-Ullman numbering. Returns how many scratch registers are needed to evaluate the
+ * expression without storing temporaries on the stack.
+ * Calls clobber every scratch register, so they are considered the most expensive to evaluate.
+ */
+static int register_need(node_t *node) {
+    switch (node->type) {
+        case NUMBER_DATA:
+        case IDENTIFIER_DATA:
+            return 1;
         case ARRAY_INDEXING: {
-            // Load the value pointed to by array[idx], and put the result in RAX
-            MOVQ(generate_array_access(expression), RAX);
-            break;
+            // The base of the array needs a register next to the index
+            int index_need = register_need(node->children[1]);
+            return index_need > 2 ? index_need : 2;
         }
+        case POINTER_INDEXING:
+            return register_need(node->children[1]);
         case EXPRESSION: {
-            char *data = expression->data;
-            node_t *left = expression->children[0];
-            node_t *right = expression->children[1];
-
-            bool is_function_call = strcmp(data, "call") == 0;
-            bool is_plus = strcmp(data, "+") == 0;
-            bool is_minus = strcmp(data, "-") == 0;
-            bool is_multiplication = strcmp(data, "*") == 0;
-            bool is_division = strcmp(data, "/") == 0;
-
-            if (is_function_call) {
-                generate_function_call(expression);
-            } else if (is_plus) {
-                generate_expression(left);
-                PUSHQ(RAX);
-                generate_expression(right);
-                POPQ(R10);
-                ADDQ(R10, RAX);
-            } else if (is_minus) {
-                if (expression->n_children == 1) {
-                    // Unary minus
-                    generate_expression(left);
-                    NEGQ(RAX);
-                } else {
-                    // Binary minus. Evaluate RHS first, to get the result in RAX easier
-                    generate_expression(right);
-                    PUSHQ(RAX);
-                    generate_expression(left);
-                    POPQ(R10);
-                    SUBQ(R10, RAX);
-                }
-            } else if (is_multiplication) {
-                // Multiplication does not need to do sign extend
-                generate_expression(left);
-                PUSHQ(RAX);
-                generate_expression(right);
-                POPQ(R10);
-                IMULQ(R10, RAX);
-            } else if (is_division) {
-                generate_expression(right);
-                PUSHQ(RAX);
-                generate_expression(left);
-                CQO;  // Sign extend RAX -> RDX:RAX
-                POPQ(R10);
-                IDIVQ(R10);  // Didivde RDX:RAX by R10, placing the result in RAX
-            } else {
-                assert(false && "Unknown expression operation");
-            }
-            break;
+            if (strcmp(node->data, "call") == 0)
+                return CALL_REGISTER_NEED;
+            if (node->n_children == 1)
+                return register_need(node->children[0]);
+
+            int left = register_need(node->children[0]);
+            int right = register_need(node->children[1]);
+            if (left == right)
+                return left + 1;
+            return left > right ? left : right;
         }
         default:
             assert(false && "Unknown expression type");
+            return 1;
     }
 }
 
+/* Returns true if the expression reads global variables or arrays, which calls can modify */
+static bool reads_global_memory(node_t *node) {
+    if (node->type == ARRAY_INDEXING || node->type == POINTER_INDEXING)
+        return true;
+    if (node->type == IDENTIFIER_DATA)
+        return node->symbol->type == SYMBOL_GLOBAL_VAR;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (reads_global_memory(node->children[i]))
+            return true;
+    return false;
+}
+
+/**
+ * Decides which operand of a binary operation to evaluate first.
+ * The operand needing the most registers goes first, so that it can use all of them.
+ * When the order could be observed, because one operand makes a call and the other makes a call
+ * too or reads memory the call could change, the original order is kept. That is left-to-right
+ * for +, * and relations, and right-to-left for - and /.
+ */
+static bool evaluate_right_first(node_t *left, node_t *right, const char *operator) {
+    bool left_call = contains_call(left), right_call = contains_call(right);
+    if ((left_call && (right_call || reads_global_memory(right))) || (right_call && reads_global_memory(left)))
+        return strcmp(operator, "-") == 0 || strcmp(operator, "/") == 0;
+    return register_need(right) > register_need(left);
+}
+
+/**
+ * Divides the value in dest by the divisor, placing the result in dest.
+ * idivq divides RDX:RAX, so the dividend is moved into RAX, and both RAX and RDX are saved
+ * if they hold temporaries of the surrounding expression.
+ * The divisor can be neither RAX nor RDX. If it lives on the stack, it is given as (%rsp).
+ */
+static void generate_division(const char *dest, const char *divisor) {
+    bool dest_is_rax = is_same_register(dest, RAX);
+    bool save_rax = !dest_is_rax && is_scratch_register_in_use(RAX);
+    bool save_rdx = !is_same_register(dest, RDX) && is_scratch_register_in_use(RDX);
+
+    char divisor_operand[32];
+    snprintf(divisor_operand, sizeof(divisor_operand), "%s", divisor);
+    if (strcmp(divisor, MEM(RSP)) == 0 && (save_rax || save_rdx))
+        snprintf(divisor_operand, sizeof(divisor_operand), "%d(%s)", 8 * (save_rax + save_rdx), RSP);
+
+    if (save_rax)
+        push_quadword(RAX);
+    if (save_rdx)
+        push_quadword(RDX);
+
+    if (!dest_is_rax)
+        MOVQ(dest, RAX);
+    CQO;  // Sign extend RAX -> RDX:RAX
+    IDIVQ(divisor_operand);  // Divide RDX:RAX by the divisor, placing the result in RAX
+    if (!dest_is_rax)
+        MOVQ(RAX, dest);
+
+    if (save_rdx)
+        pop_quadword(RDX);
+    if (save_rax)
+        pop_quadword(RAX);
+}
+
+/* Multiplies dest by a constant, using the leaq and shifts found by split_factor */
+static void generate_multiplication(const char *dest, int64_t factor) {
+    factor_t steps;
+    bool split = split_factor(factor, &steps);
+    assert(split);
+    (void)split;
+
+    for (size_t i = 0; i < steps.n_lea_factors; i++)
+        EMIT("leaq (%s, %s, %d), %s", dest, dest, steps.lea_factors[i] - 1, dest);
+    if (steps.shift > 0)
+        EMIT("shlq $%d, %s", steps.shift, dest);
+    if (steps.negate)
+        NEGQ(dest);
+}
+
+/**
+ * Finds the magic number and shift of a signed division by a constant that is not a power of two,
+ * so the high half of the dividend times the magic, shifted right, is the quotient rounded down.
+ * This is the algorithm of Hacker's Delight, section 10-4, for 64 bits
+ */
+static void find_division_magic(int64_t divisor, int64_t *magic, int *shift) {
+    const uint64_t two63 = 1UL << 63;
+    uint64_t magnitude = divisor < 0 ? -(uint64_t)divisor : (uint64_t)divisor;
+    uint64_t t = two63 + ((uint64_t)divisor >> 63);
+    uint64_t limit = t - 1 - t % magnitude;  // The magnitude of the largest dividend not rounded right
+
+    int p = 63;
+    uint64_t q1 = two63 / limit, r1 = two63 - q1 * limit;
+    uint64_t q2 = two63 / magnitude, r2 = two63 - q2 * magnitude;
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= limit) {
+            q1++;
+            r1 -= limit;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= magnitude) {
+            q2++;
+            r2 -= magnitude;
+        }
+        delta = magnitude - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    *magic = (int64_t)(divisor < 0 ? -(q2 + 1) : q2 + 1);
+    *shift = p - 64;
+}
+
+/**
+ * Divides dest by a constant other than 0 and -1, rounding towards zero like idivq.
+ * Powers of two are shifted, after adding one less than the divisor to negative dividends.
+ * Other divisors multiply by a magic number, using RAX and RDX, which are saved if in use
+ */
+static void generate_constant_division(const char *dest, int64_t divisor) {
+    uint64_t magnitude = divisor < 0 ? -(uint64_t)divisor : (uint64_t)divisor;
+    bool power_of_two = (magnitude & (magnitude - 1)) == 0;
+    if (magnitude == 1)
+        return;
+
+    bool uses_rax = !is_same_register(dest, RAX);
+    bool uses_rdx = !is_same_register(dest, RDX) && (!power_of_two || !uses_rax);
+    bool save_rax = uses_rax && is_scratch_register_in_use(RAX);
+    bool save_rdx = uses_rdx && is_scratch_register_in_use(RDX);
+    if (save_rax)
+        push_quadword(RAX);
+    if (save_rdx)
+        push_quadword(RDX);
+
+    if (power_of_two) {
+        int exponent = 0;
+        while ((1UL << exponent) != magnitude)
+            exponent++;
+
+        const char *rounding = uses_rax ? RAX : RDX;
+        MOVQ(dest, rounding);
+        if (exponent > 1)
+            EMIT("sarq $63, %s", rounding);
+        EMIT("shrq $%d, %s", 64 - exponent, rounding);
+        ADDQ(rounding, dest);
+        EMIT("sarq $%d, %s", exponent, dest);
+        if (divisor < 0)
+            NEGQ(dest);
+    } else {
+        int64_t magic;
+        int shift;
+        find_division_magic(divisor, &magic, &shift);
+        bool adds_dividend = divisor > 0 && magic < 0;
+        bool subtracts_dividend = divisor < 0 && magic > 0;
+        bool reads_dividend = adds_dividend || subtracts_dividend;
+
+        // The dividend must be somewhere other than RAX, and also RDX if it is needed after the multiplication
+        const char *dividend = dest;
+        const char *temporary = NULL;
+        bool on_stack = false;
+        if (!uses_rax && !reads_dividend) {
+            MOVQ(RAX, RDX);
+            dividend = RDX;
+        } else if (!uses_rax || (!uses_rdx && reads_dividend)) {
+            temporary = allocate_scratch_register(true);
+            if (temporary != NULL) {
+                MOVQ(dest, temporary);
+                dividend = temporary;
+            } else {
+                push_quadword(dest);
+                dividend = MEM(RSP);
+                on_stack = true;
+            }
+        }
+
+        EMIT("movq $%ld, %s", magic, RAX);
+        EMIT("imulq %s", dividend);  // Multiply RAX by the dividend, placing the high half in RDX
+        if (adds_dividend)
+            ADDQ(dividend, RDX);
+        if (subtracts_dividend)
+            SUBQ(dividend, RDX);
+        if (shift > 0)
+            EMIT("sarq $%d, %s", shift, RDX);
+
+        if (on_stack)
+            drop_quadwords(1);
+        if (temporary != NULL)
+            release_scratch_register(temporary);
+
+        // Adding the sign bit rounds negative quotients towards zero instead of down
+        if (is_same_register(dest, RDX)) {
+            MOVQ(RDX, RAX);
+            EMIT("shrq $63, %s", RAX);
+            ADDQ(RAX, RDX);
+        } else {
+            MOVQ(RDX, dest);
+            EMIT("shrq $63, %s", dest);
+            ADDQ(RDX, dest);
+        }
+    }
+
+    if (save_rdx)
+        pop_quadword(RDX);
+    if (save_rax)
+        pop_quadword(RAX);
+}
+
+/* Returns the name of the lower 32 bits of a 64-bit register */
+static const char *get_lower_half(const char *reg) {
+    static char result[8];
+    if (reg[2] >= '0' && reg[2] <= '9')
+        snprintf(result, sizeof(result), "%sd", reg);  // %r8 - %r15
+    else
+        snprintf(result, sizeof(result), "%%e%s", reg + 2);
+    return result;
+}
+
+/* Expands the template of a rule, emitting one line for each of its instructions */
+static void generate_template(const char *template, const char *dest, char operands[][100]) {
+    char line[BUFFER_SIZE_IN_BYTES];
+    size_t length = 0;
+    for (const char *c = template;; c++) {
+        if (*c == ';' || *c == '\0') {
+            line[length] = '\0';
+            EMIT("%s", line);
+            if (*c == '\0')
+                break;
+            length = 0;
+            while (c[1] == ' ')
+                c++;
+            continue;
+        }
+
+        const char *insert = NULL;
+        char single[2] = {*c, '\0'};
+        if (*c != '%') {
+            insert = single;
+        } else {
+            c++;
+            if (*c == 'd')
+                insert = dest;
+            else if (*c == 'D')
+                insert = get_lower_half(dest);
+            else if (*c == '%')
+                insert = "%";
+            else if (*c >= '0' && *c < '0' + MAX_PATTERN_LEAVES)
+                insert = operands[*c - '0'];
+            else
+                assert(false && "Unknown template placeholder");
+        }
+        length += snprintf(line + length, sizeof(line) - length, "%s", insert);
+    }
+}
+
+/**
+ * Emits the code of a rule matched against the node, placing the result, if any, in dest.
+ * The leaves that are expressions are evaluated first: the first into dest, and the second into a temporary
+ */
+static void generate_match(const match_t *match, node_t *node, const char *dest) {
+    const rule_t *rule = match->rule;
+
+    char operands[MAX_PATTERN_LEAVES][100];
+    size_t registers[2];
+    size_t n_registers = 0;
+    for (size_t i = 0; i < match->n_leaves; i++) {
+        node_t *leaf = match->leaves[i];
+        switch (match->classes[i]) {
+            case OPERAND_REG:
+                assert(n_registers < 2);
+                registers[n_registers++] = i;
+                break;
+            case OPERAND_RVAR:
+            case OPERAND_MEM:
+            case OPERAND_VAR:
+            case OPERAND_SAME:
+                snprintf(operands[i], sizeof(operands[i]), "%s", generate_operand_access(leaf));
+                break;
+            case OPERAND_LEA_FACTOR:
+                snprintf(operands[i], sizeof(operands[i]), "%ld", *(int64_t *)leaf->data - 1);
+                break;
+            case OPERAND_SHIFT: {
+                int exponent = 0;
+                while ((1L << exponent) != *(int64_t *)leaf->data)
+                    exponent++;
+                snprintf(operands[i], sizeof(operands[i]), "%d", exponent);
+                break;
+            }
+            case OPERAND_ARRAY:
+                snprintf(operands[i], sizeof(operands[i]), "%s", (char *)leaf->data);
+                break;
+            default:
+                snprintf(operands[i], sizeof(operands[i]), "%ld", *(int64_t *)leaf->data);
+                break;
+        }
+    }
+
+    bool needs_stack = false;
+    if (n_registers == 1) {
+        generate_expression_into(match->leaves[registers[0]], dest);
+        snprintf(operands[registers[0]], sizeof(operands[0]), "%s", dest);
+    } else if (n_registers == 2) {
+        node_t *first = match->leaves[registers[0]];
+        node_t *second = match->leaves[registers[1]];
+        const char *operator = node->data;
+        bool is_division = rule->action == ACTION_DIVIDE;
+
+        // The divisor can not be placed in RAX or RDX, as idivq uses those
+        const char *temporary = allocate_scratch_register(is_division);
+        if (temporary != NULL) {
+            if (evaluate_right_first(first, second, operator)) {
+                generate_expression_into(second, temporary);
+                generate_expression_into(first, dest);
+            } else {
+                generate_expression_into(first, dest);
+                generate_expression_into(second, temporary);
+            }
+            snprintf(operands[registers[1]], sizeof(operands[0]), "%s", temporary);
+            release_scratch_register(temporary);
+        } else {
+            // Out of registers, so the operand evaluated first waits on the stack.
+            // Like before, the right hand side is evaluated first for - and /, and the left for + and *
+            // Relations always have a temporary, as they are evaluated with only RAX in use
+            assert(node->type == EXPRESSION);
+            if (strcmp(operator, "-") == 0 || is_division) {
+                generate_expression_into(second, dest);
+                push_quadword(dest);
+                generate_expression_into(first, dest);
+            } else {
+                generate_expression_into(first, dest);
+                push_quadword(dest);
+                generate_expression_into(second, dest);
+            }
+            snprintf(operands[registers[1]], sizeof(operands[0]), "%s", MEM(RSP));
+            needs_stack = true;
+        }
+    }
+
+    switch (rule->action) {
+        case ACTION_TEMPLATE:
+            generate_template(rule->template, dest, operands);
+            break;
+        case ACTION_CALL:
+            generate_function_call(node, dest);
+            break;
+        case ACTION_ELEMENT:
+            generate_element_load(get_indexed_array(node), dest);
+            break;
+        case ACTION_DIVIDE:
+            generate_division(dest, operands[1]);
+            break;
+        case ACTION_MULTIPLY:
+            generate_multiplication(dest, *(int64_t *)match->leaves[1]->data);
+            break;
+        case ACTION_DIVIDE_CONSTANT:
+            generate_constant_division(dest, *(int64_t *)match->leaves[1]->data);
+            break;
+    }
+
+    if (needs_stack)
+        drop_quadwords(1);
+}
+
+/* Generates code to evaluate the expression, and place the result in %rax */
+static void generate_expression(node_t *expression) {
+    reserve_scratch_register(RAX);
+    generate_expression_into(expression, RAX);
+    release_scratch_register(RAX);
+}
+
+/* Generates code to evaluate the expression, and place the result in the dest register */
+static void generate_expression_into(node_t *expression, const char *dest) {
+    match_t match = select_expression(expression);
+    generate_match(&match, expression, dest);
+}
+
+/* Returns true if the expression reads a variable kept in the given register */
+static bool reads_register(node_t *node, const char *reg) {
+    if (node->type == IDENTIFIER_DATA) {
+        symbol_t *symbol = node->symbol;
+        if (symbol->type != SYMBOL_PARAMETER && symbol->type != SYMBOL_LOCAL_VAR)
+            return false;
+        const char *variable_reg = current_allocation->locations[symbol->sequence_number].reg;
+        return variable_reg != NULL && is_same_register(variable_reg, reg);
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (reads_register(node->children[i], reg))
+            return true;
+    return false;
+}
+
 static void generate_assignment_statement(node_t *statement) {
     node_t *destination = statement->children[0];
     node_t *expression = statement->children[1];
-    generate_expression(expression);
 
-    if (destination->type == IDENTIFIER_DATA)
+    // Some assignments can be done by a single instruction updating the destination
+    match_t match;
+    if (select_assignment(statement, &match)) {
+        reserve_scratch_register(RAX);
+        generate_match(&match, statement, RAX);
+        release_scratch_register(RAX);
+        return;
+    }
+
+    if (destination->type == IDENTIFIER_DATA) {
+        const char *variable = generate_variable_access(destination);
+
+        // A variable in a register can be computed in place, as long as the expression does not
+        // read the register, which may also hold a variable whose life ends in this expression,
+        // or make a call that could clobber it
+        bool in_register = variable[0] == '%';
+        if (in_register && !reads_register(expression, variable) && !contains_call(expression)) {
+            generate_expression_into(expression, variable);
+            return;
+        }
+
+        generate_expression(expression);
         MOVQ(RAX, generate_variable_access(destination));
-    else {
-        // Store rax until the final address of the array element is found,
-        // since array index calculation can change registers
-        PUSHQ(RAX);
-        const char *destination_memory = generate_array_access(destination);
-        POPQ(RAX);
-        MOVQ(RAX, destination_memory);
+        return;
     }
+
+    // Elements of bitsets are only assigned the numbers 0 and 1, which set or clear their bit
+    if (destination->type == ARRAY_INDEXING && get_indexed_array(destination)->element_width == ELEMENT_BIT) {
+        assert(expression->type == NUMBER_DATA);
+        generate_expression(destination->children[1]);
+        EMIT("%s %s, .%s(%s)", *(int64_t *)expression->data != 0 ? "btsq" : "btrq", RAX,
+             get_indexed_array(destination)->name, RIP);
+        return;
+    }
+
+    // Keep the value in RAX while the address of the array element is found
+    reserve_scratch_register(RAX);
+    generate_expression_into(expression, RAX);
+
+    if (is_memory_operand(destination)) {
+        MOVQ(RAX, generate_operand_access(destination));
+        release_scratch_register(RAX);
+        return;
+    }
+
+    // Only RAX is in use at this point, and R10 is never given to variables
+    const char *address = allocate_scratch_register(false);
+    assert(address != NULL);
+    static const char *NARROW_STORES[] = {
+        [ELEMENT_DOUBLEWORD] = "movl %eax", [ELEMENT_WORD] = "movw %ax", [ELEMENT_BYTE] = "movb %al"};
+    if (destination->type == ARRAY_INDEXING && get_indexed_array(destination)->element_width != ELEMENT_QUADWORD)
+        EMIT("%s, %s", NARROW_STORES[get_indexed_array(destination)->element_width],
+             generate_array_access(destination, address));
+    else
+        MOVQ(RAX, generate_array_access(destination, address));
+    release_scratch_register(address);
+    release_scratch_register(RAX);
 }
 
 static void generate_print_statement(node_t *statement) {
@@ -375,39 +1612,517 @@ static void generate_print_statement(node_t *statement) {
             MOVQ(RAX, RSI);
             EMIT("leaq intout(%s), %s", RIP, RDI);
         }
-        EMIT("call safe_printf");
+        // Statements start with the stack 16-byte aligned, as printf wants it.
+        // %al holds the number of vector registers with arguments, which is none
+        EMIT("xorl %%eax, %%eax");
+        EMIT("call printf");
     }
 
     MOVQ("$'\\n'", RDI);
     EMIT("call putchar");
+    current_clobbers |= register_mask(SYSTEM_V_CALLER_SAVED);
 }
 
 static void generate_return_statement(node_t *statement) {
     node_t *expression = statement->children[0];
+    if (is_tail_call(expression)) {
+        generate_tail_call(expression);
+        return;
+    }
     generate_expression(expression);
-    MOVQ(RBP, RSP);
-    POPQ(RBP);
-    RET;
+    generate_epilogue();
+}
+
+/**
+ * Returns true if the returned expression is a call that can reuse the frame of the current function.
+ * The arguments passed on the stack must fit where the current function got its own, unless it calls itself.
+ */
+static bool is_tail_call(node_t *expression) {
+    if (!tail_calls || expression->type != EXPRESSION || strcmp(expression->data, "call") != 0)
+        return false;
+
+    symbol_t *symbol = expression->children[0]->symbol;
+    if (symbol->type != SYMBOL_FUNCTION || FUNC_PARAM_COUNT(symbol) != expression->children[1]->n_children)
+        return false;  // Left to generate_function_call, which reports the error
+    if (symbol == current_function)
+        return true;
+
+    long stack_arguments = (long)FUNC_PARAM_COUNT(symbol) - get_register_params(symbol);
+    long incoming_stack_arguments = (long)FUNC_PARAM_COUNT(current_function) - current_allocation->n_register_params;
+    return stack_arguments <= incoming_stack_arguments;
+}
+
+/* Returns true if any of the statements returns a call to the current function */
+static bool has_self_tail_call(node_t *node) {
+    if (node->type == RETURN_STATEMENT)
+        return is_tail_call(node->children[0]) && node->children[0]->children[0]->symbol == current_function;
+
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i] != NULL && has_self_tail_call(node->children[i]))
+            return true;
+    return false;
+}
+
+/**
+ * Generates the call returned from as a jump, so the callee returns directly to our caller.
+ * A call to the current function becomes a loop: the arguments are placed in the parameters,
+ * and it jumps back to the first statement. Other functions get the arguments where a call
+ * would have put them, once the frame of the current function has been torn down.
+ */
+static void generate_tail_call(node_t *call) {
+    symbol_t *symbol = call->children[0]->symbol;
+    node_t *argument_list = call->children[1];
+    int parameter_count = FUNC_PARAM_COUNT(symbol);
+
+    // When the stack arguments are our own parameters, passed on in the same place, only the registers are set
+    int register_arguments = get_register_params(symbol);
+    bool stack_in_place = symbol != current_function;
+    for (int i = register_arguments; i < parameter_count && stack_in_place; i++)
+        stack_in_place = is_argument_in_place(argument_list->children[i], i - register_arguments);
+    if (stack_in_place && can_place_arguments(argument_list, register_arguments)) {
+        generate_argument_placement(argument_list, register_arguments);
+        generate_frame_teardown();
+        EMIT("jmp .%s", symbol->name);
+        current_clobbers |= function_clobbers[symbol->sequence_number];
+        return;
+    }
+
+    // Every argument is evaluated before any parameter is overwritten, as the arguments may read them
+    for (int i = parameter_count - 1; i >= 0; i--) {
+        const char *argument = allocate_scratch_register(false);
+        generate_expression_into(argument_list->children[i], argument);
+        push_quadword(argument);
+        release_scratch_register(argument);
+    }
+
+    if (symbol == current_function) {
+        for (int i = 0; i < parameter_count; i++) {
+            // Parameters that are never used have nowhere to go
+            if (current_allocation->locations[i].referenced)
+                pop_quadword(generate_symbol_access(symbol->function_symtable->symbols[i]));
+            else
+                pop_quadword(RAX);
+        }
+
+        // The local variables start over, as if the function was entered again
+        for (size_t i = parameter_count; i < current_allocation->n_locations; i++) {
+            if (current_allocation->locations[i].referenced && current_allocation->locations[i].needs_zero)
+                MOVQ("$0", generate_symbol_access(symbol->function_symtable->symbols[i]));
+        }
+
+        EMIT("jmp tail_%s", symbol->name);
+        return;
+    }
+
+    for (int i = 0; i < register_arguments; i++) {
+        pop_quadword(REGISTER_PARAMS[i]);
+    }
+    // The stack arguments replace our own, at the bottom of the frame of our caller
+    for (int i = register_arguments; i < parameter_count; i++) {
+        char stack_argument[32];
+        snprintf(stack_argument, sizeof(stack_argument), "%d(%s)", stack_argument_offset(i - register_arguments),
+                 frame_pointer());
+        pop_quadword(stack_argument);
+    }
+
+    generate_frame_teardown();
+    EMIT("jmp .%s", symbol->name);
+    current_clobbers |= function_clobbers[symbol->sequence_number];
+}
+
+/* Returns true if the argument is the parameter of the current function passed at the same place on the stack */
+static bool is_argument_in_place(node_t *argument, int stack_index) {
+    if (argument->type != IDENTIFIER_DATA || argument->symbol->type != SYMBOL_PARAMETER)
+        return false;
+    variable_location_t *location = &current_allocation->locations[argument->symbol->sequence_number];
+    int own_index = (int)argument->symbol->sequence_number - (int)current_allocation->n_register_params;
+    return location->reg == NULL && location->stack_slot < 0 && own_index == stack_index;
 }
 
 static void generate_relation(node_t *relation) {
     assert(relation->n_children == 2);
 
+    // Set the flags according to left compared to right, using RAX for evaluating expressions
+    match_t match = select_relation(relation);
+    reserve_scratch_register(RAX);
+    generate_match(&match, relation, RAX);
+    release_scratch_register(RAX);
+}
+
+/* Emits a jump to the label, taken when the relation that was just compared holds, or when it does not */
+static void generate_conditional_jump(node_t *relation, const char *label, bool jump_if_true) {
+    char *data = relation->data;
+    if (is_equal_relation(data)) {
+        if (jump_if_true)
+            JE(label);
+        else
+            JNE(label);
+    } else if (is_not_equal_relation(data)) {
+        if (jump_if_true)
+            JNE(label);
+        else
+            JE(label);
+    } else if (is_less_than_relation(data)) {
+        if (jump_if_true)
+            JL(label);
+        else
+            JGE(label);
+    } else if (is_greater_than_relation(data)) {
+        if (jump_if_true)
+            JG(label);
+        else
+            JLE(label);
+    } else {
+        assert(false && "Unknown relation");
+    }
+}
+
+/**
+ * Both arms of an if-statement turned into a conditional move are evaluated, so they must be unable to fault,
+ * and cheap enough that it pays to avoid a branch that may be mispredicted, roughly 15 cycles every other time.
+ * The cost is roughly in cycles, see speculation_cost.
+ */
+#define MAX_CONDITIONAL_MOVE_COST 6
+
+/* Returns the assignment the statement consists of, also inside a block of its own, or NULL if it is not one */
+static node_t *get_single_assignment(node_t *statement) {
+    if (statement->type == BLOCK && statement->n_children == 1 && statement->children[0]->n_children == 1)
+        statement = statement->children[0]->children[0];
+    return statement->type == ASSIGNMENT_STATEMENT ? statement : NULL;
+}
+
+/**
+ * Returns the cost of evaluating the expression when its value may not be needed, or -1 if it can not be done,
+ * because it makes a call, which can have side effects, or could fault, by reading memory or dividing.
+ * Dividing by constants other than 0 and -1 can not fault, and is done by multiplying.
+ */
+static int speculation_cost(node_t *node) {
+    switch (node->type) {
+        case NUMBER_DATA:
+            return 0;
+        case IDENTIFIER_DATA: {
+            symtype_t type = node->symbol->type;
+            bool variable = type == SYMBOL_GLOBAL_VAR || type == SYMBOL_PARAMETER || type == SYMBOL_LOCAL_VAR;
+            return variable ? 0 : -1;
+        }
+        case EXPRESSION: {
+            int cost = 1;
+            if (strcmp(node->data, "call") == 0)
+                return -1;
+            if (strcmp(node->data, "*") == 0)
+                cost = 3;
+            if (strcmp(node->data, "/") == 0) {
+                node_t *divisor = node->children[1];
+                if (divisor->type != NUMBER_DATA || *(int64_t *)divisor->data == 0 || *(int64_t *)divisor->data == -1)
+                    return -1;
+                cost = 4;
+            }
+            for (size_t i = 0; i < node->n_children; i++) {
+                int child_cost = speculation_cost(node->children[i]);
+                if (child_cost < 0)
+                    return -1;
+                cost += child_cost;
+            }
+            return cost;
+        }
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Generates if-statements assigning to the same variable in both arms, or only assigning in the then-arm,
+ * with a conditional move instead of branches. The value of the then-arm is moved over the value of the
+ * else-arm, or the old value of the variable, when the relation holds.
+ * Returns false if the statement is better off branching, see MAX_CONDITIONAL_MOVE_COST.
+ */
+static bool generate_conditional_move(node_t *statement) {
+    node_t *relation = statement->children[0];
+    node_t *then_assignment = get_single_assignment(statement->children[1]);
+    node_t *else_assignment = statement->n_children == 3 ? get_single_assignment(statement->children[2]) : NULL;
+    if (then_assignment == NULL || (statement->n_children == 3 && else_assignment == NULL))
+        return false;
+
+    node_t *destination = then_assignment->children[0];
+    if (destination->type != IDENTIFIER_DATA || speculation_cost(destination) < 0)
+        return false;
+    if (else_assignment != NULL && else_assignment->children[0]->symbol != destination->symbol)
+        return false;
+    if (contains_call(relation))
+        return false;
+
+    node_t *then_expression = then_assignment->children[1];
+    node_t *else_expression = else_assignment != NULL ? else_assignment->children[1] : NULL;
+    int cost = speculation_cost(then_expression);
+    int else_cost = else_expression != NULL ? speculation_cost(else_expression) : 0;
+    if (cost < 0 || else_cost < 0 || cost + else_cost > MAX_CONDITIONAL_MOVE_COST)
+        return false;
+
+    char variable[100];
+    snprintf(variable, sizeof(variable), "%s", generate_variable_access(destination));
+    bool in_register = variable[0] == '%';
+
+    // Variables are moved from where they are, while other values are evaluated into a register of their own.
+    // RAX is left for the relation. Both registers are taken before any code is emitted, so that the
+    // statement can still be left to branch when the variables occupy them
+    const char *then_register = NULL;
+    const char *result = variable;
+    bool needs_result = else_expression != NULL || !in_register;
+    if (then_expression->type != IDENTIFIER_DATA) {
+        then_register = allocate_scratch_register(true);
+        if (then_register == NULL)
+            return false;
+    }
+    if (needs_result) {
+        result = allocate_scratch_register(true);
+        if (result == NULL) {
+            if (then_register != NULL)
+                release_scratch_register(then_register);
+            return false;
+        }
+    }
+
+    char then_source[100];
+    if (then_register == NULL) {
+        snprintf(then_source, sizeof(then_source), "%s", generate_variable_access(then_expression));
+    } else {
+        generate_expression_into(then_expression, then_register);
+        snprintf(then_source, sizeof(then_source), "%s", then_register);
+    }
+
+    // The value the variable gets if the relation does not hold. The variable is left as it is without an else-arm
+    if (needs_result) {
+        if (else_expression != NULL)
+            generate_expression_into(else_expression, result);
+        else
+            MOVQ(variable, result);
+    }
+
+    generate_relation(relation);
+    EMIT("cmov%s %s, %s", relation_condition(relation->data), then_source, result);
+
+    if (result != variable) {
+        MOVQ(result, variable);
+        release_scratch_register(result);
+    }
+    if (then_register != NULL)
+        release_scratch_register(then_register);
+    return true;
+}
+
+// Else-if chains with fewer cases are left comparing one case at a time
+#define MIN_DISPATCH_CASES 4
+// Jump tables are used when at least a third of their entries are cases, and they are not too large
+#define MAX_JUMP_TABLE_SPREAD 3
+#define MAX_JUMP_TABLE_SIZE 4096
+// Ranges of cases small enough to be compared one at a time, ending the binary search
+#define MAX_LINEAR_SEARCH 3
+
+/**
+ * Returns the constant the variable is compared to for equality by the relation, with the variable in
+ * the other operand. Returns false if the relation is not of that form.
+ */
+static bool get_case_relation(node_t *relation, symbol_t **variable, int64_t *value) {
+    if (!is_equal_relation(relation->data))
+        return false;
     node_t *left = relation->children[0];
     node_t *right = relation->children[1];
+    if (left->type == NUMBER_DATA) {
+        node_t *swap = left;
+        left = right;
+        right = swap;
+    }
+    if (left->type != IDENTIFIER_DATA || right->type != NUMBER_DATA || speculation_cost(left) < 0)
+        return false;
+    *variable = left->symbol;
+    *value = *(int64_t *)right->data;
+    return true;
+}
 
-    generate_expression(left);
-    // Push left onto the stack
-    PUSHQ(RAX);
-    // Evaluate right and move it into RAX
-    generate_expression(right);
-    // Pop left into R10
-    POPQ(R10);
-    // Compare left and right
-    CMPQ(RAX, R10);
+/* Orders cases by value, for searching them */
+static int compare_dispatch_cases(const void *a, const void *b) {
+    int64_t left = ((const dispatch_case_t *)a)->value;
+    int64_t right = ((const dispatch_case_t *)b)->value;
+    return (left > right) - (left < right);
+}
+
+/* Orders cases by their place in the chain */
+static int compare_dispatch_labels(const void *a, const void *b) {
+    size_t left = ((const dispatch_case_t *)a)->label;
+    size_t right = ((const dispatch_case_t *)b)->label;
+    return (left > right) - (left < right);
+}
+
+/**
+ * Generates a chain of if-statements comparing the same variable against distinct constants, with an
+ * else-arm continuing the chain, by jumping straight to the arm of the value. VSL has no switch-statement,
+ * so this is how programs dispatch on a value.
+ * Dense cases index a table of the offsets of their arms from the table, in .rodata, while sparse cases
+ * are found by a binary search, comparing against the middle case first.
+ * The chain ends at the first if-statement comparing to something else, or to a constant already seen,
+ * which is the arm for every other value. Returns false if the chain is too short to be worth it.
+ */
+static bool generate_dispatch(node_t *statement) {
+    symbol_t *variable = NULL;
+    size_t capacity = 0;
+    n_dispatch_cases = 0;
+
+    node_t *rest = statement;
+    while (rest != NULL && rest->type == IF_STATEMENT) {
+        symbol_t *compared;
+        int64_t value;
+        if (!get_case_relation(rest->children[0], &compared, &value) || (variable != NULL && compared != variable))
+            break;
+        bool seen = false;
+        for (size_t i = 0; i < n_dispatch_cases; i++)
+            seen |= dispatch_cases[i].value == value;
+        if (seen)
+            break;
+
+        if (n_dispatch_cases == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            dispatch_cases = realloc(dispatch_cases, capacity * sizeof(dispatch_case_t));
+        }
+        dispatch_cases[n_dispatch_cases] = (dispatch_case_t){value, rest->children[1], n_dispatch_cases};
+        n_dispatch_cases++;
+        variable = compared;
+
+        // An else-arm holding nothing but the next if-statement continues the chain as well
+        rest = rest->n_children == 3 ? rest->children[2] : NULL;
+        if (rest != NULL && rest->type == BLOCK && rest->n_children == 1 && rest->children[0]->n_children == 1)
+            rest = rest->children[0]->children[0];
+    }
+
+    if (n_dispatch_cases < MIN_DISPATCH_CASES) {
+        free(dispatch_cases);
+        dispatch_cases = NULL;
+        return false;
+    }
+
+    int dispatch = dispatch_counter++;
+    size_t n_cases = n_dispatch_cases;
+    qsort(dispatch_cases, n_cases, sizeof(dispatch_case_t), compare_dispatch_cases);
+    int64_t min = dispatch_cases[0].value;
+    int64_t max = dispatch_cases[n_cases - 1].value;
+    uint64_t size = (uint64_t)max - (uint64_t)min + 1;
+
+    // The jump table changes the value, so it gets a register of its own, while the search compares the variable
+    char value[100];
+    snprintf(value, sizeof(value), "%s", generate_symbol_access(variable));
+    if (size <= MAX_JUMP_TABLE_SIZE && size <= MAX_JUMP_TABLE_SPREAD * n_cases && min >= INT32_MIN && min <= INT32_MAX) {
+        const char *value_register = allocate_scratch_register(false);
+        assert(value_register != NULL && "Dispatching is done between statements, where scratch registers are free");
+        MOVQ(value, value_register);
+        generate_jump_table(dispatch, value_register, min, max);
+        release_scratch_register(value_register);
+    } else {
+        generate_binary_search(dispatch, value, 0, n_cases);
+    }
+
+    // The arms in the order of the chain, so they fall through to each other as before
+    dispatch_case_t *cases = dispatch_cases;
+    dispatch_cases = NULL;
+    qsort(cases, n_cases, sizeof(dispatch_case_t), compare_dispatch_labels);
+    char end_label[BUFFER_SIZE_IN_BYTES];
+    snprintf(end_label, sizeof(end_label), "enddispatch%d", dispatch);
+    for (size_t i = 0; i < n_cases; i++) {
+        LABEL("dispatch%d_case%zu", dispatch, cases[i].label);
+        generate_statement(cases[i].statement);
+        JMP(end_label);
+    }
+    LABEL("dispatch%d_default", dispatch);
+    if (rest != NULL)
+        generate_statement(rest);
+    LABEL("enddispatch%d", dispatch);
+
+    free(cases);
+    return true;
+}
+
+/**
+ * Jumps to the arm of the value in the register through a table with an entry for every value from min to max.
+ * Subtracting min makes smaller values wrap around to large unsigned ones, so one compare checks both bounds
+ */
+static void generate_jump_table(int dispatch, const char *value, int64_t min, int64_t max) {
+    char default_label[BUFFER_SIZE_IN_BYTES];
+    snprintf(default_label, sizeof(default_label), "dispatch%d_default", dispatch);
+
+    if (min != 0)
+        EMIT("subq $%ld, %s", min, value);
+    EMIT("cmpq $%lu, %s", (uint64_t)max - (uint64_t)min, value);
+    JA(default_label);
+
+    const char *table = allocate_scratch_register(false);
+    assert(table != NULL);
+    EMIT("leaq dispatch%d_table(%%rip), %s", dispatch, table);
+    EMIT("movslq (%s, %s, 4), %s", table, value, value);
+    ADDQ(table, value);
+    EMIT("jmp *%s", value);
+    release_scratch_register(table);
+
+    // The entries are offsets from the table, which do not need relocating in position independent code
+    DIRECTIVE(".section %s", ASM_RODATA_SECTION);
+    DIRECTIVE(".align 4");
+    LABEL("dispatch%d_table", dispatch);
+    size_t next_case = 0;
+    for (uint64_t offset = 0; offset <= (uint64_t)max - (uint64_t)min; offset++) {
+        int64_t entry = (int64_t)((uint64_t)min + offset);
+        if (dispatch_cases[next_case].value == entry)
+            DIRECTIVE("\t.long dispatch%d_case%zu - dispatch%d_table", dispatch, dispatch_cases[next_case++].label, dispatch);
+        else
+            DIRECTIVE("\t.long dispatch%d_default - dispatch%d_table", dispatch, dispatch);
+    }
+    DIRECTIVE(".text");
+}
+
+/* Compares the value in the register to the constant. Constants beyond 32 bits can not be immediates of cmpq */
+static void generate_case_compare(const char *value, int64_t constant) {
+    char operand[100];
+    snprintf(operand, sizeof(operand), "$%ld", constant);
+    if (constant >= INT32_MIN && constant <= INT32_MAX) {
+        CMPQ(operand, value);
+        return;
+    }
+    const char *constant_register = allocate_scratch_register(false);
+    assert(constant_register != NULL);
+    MOVQ(operand, constant_register);
+    CMPQ(constant_register, value);
+    release_scratch_register(constant_register);
+}
+
+/* Finds the arm of the value in the register among the sorted cases from first up to end, or jumps to the default */
+static void generate_binary_search(int dispatch, const char *value, size_t first, size_t end) {
+    char label[BUFFER_SIZE_IN_BYTES];
+
+    if (end - first > MAX_LINEAR_SEARCH) {
+        size_t middle = first + (end - first) / 2;
+        dispatch_case_t *pivot = &dispatch_cases[middle];
+        generate_case_compare(value, pivot->value);
+        snprintf(label, sizeof(label), "dispatch%d_case%zu", dispatch, pivot->label);
+        JE(label);
+        snprintf(label, sizeof(label), "dispatch%d_below%zu", dispatch, middle);
+        JL(label);
+        generate_binary_search(dispatch, value, middle + 1, end);
+        LABEL("dispatch%d_below%zu", dispatch, middle);
+        generate_binary_search(dispatch, value, first, middle);
+        return;
+    }
+
+    for (size_t i = first; i < end; i++) {
+        generate_case_compare(value, dispatch_cases[i].value);
+        snprintf(label, sizeof(label), "dispatch%d_case%zu", dispatch, dispatch_cases[i].label);
+        JE(label);
+    }
+    snprintf(label, sizeof(label), "dispatch%d_default", dispatch);
+    JMP(label);
 }
 
 static void generate_if_statement(node_t *statement) {
+    if (conditional_moves && generate_conditional_move(statement))
+        return;
+    if (jump_tables && generate_dispatch(statement))
+        return;
+
     int local_counter = if_counter;
     if_counter++;
 
@@ -419,23 +2134,10 @@ static void generate_if_statement(node_t *statement) {
 
     generate_relation(relation);
 
-    char *data = relation->data;
-
     char else_label[BUFFER_SIZE_IN_BYTES];
     memset(else_label, 0, BUFFER_SIZE_IN_BYTES);
     snprintf(else_label, BUFFER_SIZE_IN_BYTES, "else%d", local_counter);
-
-    if (is_equal_relation(data)) {
-        JNE(else_label);
-    } else if (is_not_equal_relation(data)) {
-        JE(else_label);
-    } else if (is_less_than_relation(data)) {
-        JGE(else_label);
-    } else if (is_greater_than_relation(data)) {
-        JLE(else_label);
-    } else {
-        assert(false && "Unknown relation");
-    }
+    generate_conditional_jump(relation, else_label, false);
 
     generate_statement(then_statement);
 
@@ -456,59 +2158,568 @@ static void generate_if_statement(node_t *statement) {
     LABEL("endif%d", local_counter);
 }
 
+/**
+ * While loops are tested at the bottom, so each iteration only takes one branch.
+ * A copy of the test guards the entry, skipping the loop if the condition does not hold to begin with
+ */
 static void generate_while_statement(node_t *statement) {
     int local_counter = while_counter;
     while_counter++;
 
-    LABEL("while%d", local_counter);
-
-    assert(statement->n_children == 2);
+    // The optimizer can give the loop a preheader, run only when the loop is entered
+    assert(statement->n_children == 2 || statement->n_children == 3);
     node_t *relation = statement->children[0];
-    node_t *block = statement->children[1];
-
-    generate_relation(relation);
-
-    char *data = relation->data;
+    node_t *body = statement->children[1];
 
     char end_label[BUFFER_SIZE_IN_BYTES];
     memset(end_label, 0, BUFFER_SIZE_IN_BYTES);
     snprintf(end_label, BUFFER_SIZE_IN_BYTES, "endwhile%d", local_counter);
 
-    if (is_equal_relation(data)) {
-        JNE(end_label);
-    } else if (is_not_equal_relation(data)) {
-        JE(end_label);
-    } else if (is_less_than_relation(data)) {
-        JGE(end_label);
-    } else if (is_greater_than_relation(data)) {
-        JLE(end_label);
-    } else {
-        assert(false && "Unknown relation");
-    }
-
-    generate_block_statement(block);
-
-    // jump back to the beginning of the while loop
     char while_label[BUFFER_SIZE_IN_BYTES];
     memset(while_label, 0, BUFFER_SIZE_IN_BYTES);
     snprintf(while_label, BUFFER_SIZE_IN_BYTES, "while%d", local_counter);
-    JMP(while_label);
+
+    generate_relation(relation);
+    generate_conditional_jump(relation, end_label, false);
+    if (statement->n_children == 3)
+        generate_statement(statement->children[2]);
+
+    LABEL("while%d", local_counter);
+
+    int outer_while = innermost_while;
+    innermost_while = local_counter;
+    generate_statement(body);
+    innermost_while = outer_while;
+
+    // Go back to the beginning of the loop for as long as the condition holds
+    generate_relation(relation);
+    generate_conditional_jump(relation, while_label, true);
 
     // End of while loop, and continuation of program flow
     LABEL("endwhile%d", local_counter);
 }
 
 static void generate_break_statement() {
-    // When hitting a break, we can merely decrement the innermost while counter, and
-    // jump to the label with the corresponding number of the current value of `while_counter`.
-    while_counter--;
+    // Jump past the end of the innermost while loop
+    if (innermost_while < 0) {
+        fprintf(stderr, "error: break statement outside of a while loop\n");
+        exit(EXIT_FAILURE);
+    }
 
     char end_label[BUFFER_SIZE_IN_BYTES];
     memset(end_label, 0, BUFFER_SIZE_IN_BYTES);
-    snprintf(end_label, BUFFER_SIZE_IN_BYTES, "endwhile%d", while_counter);
+    snprintf(end_label, BUFFER_SIZE_IN_BYTES, "endwhile%d", innermost_while);
     JMP(end_label);
 }
 
+/* Returns the vector register, as wide as the registers of the instruction set being generated for */
+static const char *vector_register(int index) {
+    return vector_isa->avx ? YMM_REGISTERS[index] : XMM_REGISTERS[index];
+}
+
+static int allocate_vector_register(void) {
+    for (int i = 0; i < NUM_VECTOR_REGISTERS; i++) {
+        if (!vector_in_use[i]) {
+            vector_in_use[i] = vector_temporary[i] = true;
+            return i;
+        }
+    }
+    assert(false && "Out of vector registers");
+    return -1;
+}
+
+/* Frees the register, unless it holds a broadcast operand, a sum or the loop variable */
+static void release_vector_register(int index) {
+    if (vector_temporary[index])
+        vector_in_use[index] = vector_temporary[index] = false;
+}
+
+/**
+ * Emits destination := left <operation> source, where the source is a register or an immediate.
+ * SSE2 instructions update their destination, so left is copied there first, unless it is the same.
+ */
+static void generate_vector_operation(const char *operation, const char *source, int left, int destination) {
+    if (vector_isa->avx) {
+        EMIT("v%s %s, %s, %s", operation, source, vector_register(left), vector_register(destination));
+        return;
+    }
+    if (left != destination)
+        EMIT("movdqa %s, %s", vector_register(left), vector_register(destination));
+    EMIT("%s %s, %s", operation, source, vector_register(destination));
+}
+
+/* Fills every lane of the vector register with the operand. Immediates are moved through the scratch register */
+static void generate_broadcast(const char *operand, int destination, const char *scratch) {
+    if (operand[0] == '$') {
+        MOVQ(operand, scratch);
+        operand = scratch;
+    }
+    if (vector_isa->avx) {
+        EMIT("vmovq %s, %s", operand, XMM_REGISTERS[destination]);
+        EMIT("vpbroadcastq %s, %s", XMM_REGISTERS[destination], YMM_REGISTERS[destination]);
+    } else {
+        EMIT("movq %s, %s", operand, XMM_REGISTERS[destination]);
+        EMIT("punpcklqdq %s, %s", XMM_REGISTERS[destination], XMM_REGISTERS[destination]);
+    }
+}
+
+/**
+ * Returns n when the expression is a multiplication by 2^n, which is a shift of the other side, placed in other.
+ * Returns -1 for every other expression
+ */
+static int get_shift_amount(node_t *node, size_t *other) {
+    if (node->type != EXPRESSION || node->n_children != 2 || strcmp(node->data, "*") != 0)
+        return -1;
+    for (size_t side = 0; side < 2; side++) {
+        node_t *factor = node->children[side];
+        if (factor->type != NUMBER_DATA)
+            continue;
+        int64_t value = *(int64_t *)factor->data;
+        if (value <= 0 || (value & (value - 1)) != 0)
+            continue;
+        int amount = 0;
+        while (((int64_t)1 << amount) != value)
+            amount++;
+        *other = 1 - side;
+        return amount;
+    }
+    return -1;
+}
+
+/* Returns true for numbers that fit in the lower 32 bits of a quadword, the part pmuludq multiplies */
+static bool is_low_half_number(node_t *node) {
+    return node->type == NUMBER_DATA && *(int64_t *)node->data >= 0 && *(int64_t *)node->data <= UINT32_MAX;
+}
+
+/* Returns the number added to the loop variable in the index of the element, see get_element_offset in optimizer.c */
+static int64_t get_vector_element_offset(node_t *element) {
+    node_t *index = element->children[1];
+    if (index->type == IDENTIFIER_DATA)
+        return 0;
+    assert(index->type == EXPRESSION && index->n_children == 2);
+    bool number_first = index->children[0]->type == NUMBER_DATA;
+    int64_t value = *(int64_t *)index->children[number_first ? 0 : 1]->data;
+    return strcmp(index->data, "-") == 0 ? -value : value;
+}
+
+/* Returns the expression added to or subtracted from the sum assigned by the statement */
+static node_t *get_vector_sum_operand(node_t *statement) {
+    node_t *expression = statement->children[1];
+    node_t *first = expression->children[0];
+    if (first->type == IDENTIFIER_DATA && first->symbol == statement->children[0]->symbol)
+        return expression->children[1];
+    return first;
+}
+
+static bool is_same_vector_operand(node_t *a, node_t *b) {
+    if (a->type == NUMBER_DATA && b->type == NUMBER_DATA)
+        return *(int64_t *)a->data == *(int64_t *)b->data;
+    return a->type == IDENTIFIER_DATA && b->type == IDENTIFIER_DATA && a->symbol == b->symbol;
+}
+
+static void add_vector_array(symbol_t *array) {
+    for (size_t i = 0; i < n_vector_arrays; i++)
+        if (vector_arrays[i] == array)
+            return;
+    vector_arrays = realloc(vector_arrays, (n_vector_arrays + 1) * sizeof(symbol_t *));
+    vector_arrays[n_vector_arrays++] = array;
+}
+
+/* Finds the arrays, numbers and variables the expression needs to have in registers before the loop starts */
+static void collect_vector_operands(node_t *node) {
+    switch (node->type) {
+        case ARRAY_INDEXING:
+            add_vector_array(node->children[0]->symbol);
+            break;
+        case NUMBER_DATA:
+        case IDENTIFIER_DATA: {
+            if (node->type == IDENTIFIER_DATA && node->symbol == vector_variable) {
+                vector_uses_variable = true;
+                break;
+            }
+            for (size_t i = 0; i < n_vector_operands; i++)
+                if (is_same_vector_operand(vector_operands[i], node))
+                    return;
+            vector_operands = realloc(vector_operands, (n_vector_operands + 1) * sizeof(node_t *));
+            vector_operands[n_vector_operands++] = node;
+            break;
+        }
+        case EXPRESSION: {
+            size_t other;
+            if (get_shift_amount(node, &other) >= 0) {
+                collect_vector_operands(node->children[other]);
+                break;
+            }
+            for (size_t i = 0; i < node->n_children; i++)
+                collect_vector_operands(node->children[i]);
+            break;
+        }
+        default:
+            assert(false && "Expression can not be vectorized");
+    }
+}
+
+/* Returns how many temporary vector registers evaluating the expression can take, erring on the high side */
+static int vector_register_need(node_t *node) {
+    if (node->type == ARRAY_INDEXING)
+        return 1;
+    if (node->type != EXPRESSION)
+        return 0;
+
+    size_t other;
+    if (node->n_children == 1)
+        return vector_register_need(node->children[0]) + 1;
+    if (get_shift_amount(node, &other) >= 0)
+        return vector_register_need(node->children[other]) + 1;
+
+    int left = vector_register_need(node->children[0]);
+    int right = vector_register_need(node->children[1]) + 1;
+    int need = (left > right ? left : right) + 1;
+    // Multiplications need two more registers for the partial products
+    return strcmp(node->data, "*") == 0 ? need + 2 : need;
+}
+
+/* Returns the vector register holding the value of the expression for every lane */
+static int generate_vector_expression(node_t *node) {
+    switch (node->type) {
+        case IDENTIFIER_DATA:
+        case NUMBER_DATA: {
+            if (node->type == IDENTIFIER_DATA && node->symbol == vector_variable)
+                return vector_variable_register;
+            for (size_t i = 0; i < n_vector_operands; i++)
+                if (is_same_vector_operand(vector_operands[i], node))
+                    return vector_operand_registers[i];
+            assert(false && "Operand has not been broadcast");
+            return -1;
+        }
+        case ARRAY_INDEXING: {
+            const char *base = NULL;
+            for (size_t i = 0; i < n_vector_arrays; i++)
+                if (vector_arrays[i] == node->children[0]->symbol)
+                    base = vector_bases[i];
+            int destination = allocate_vector_register();
+            EMIT("%smovdqu %ld(%s, %s, 8), %s", vector_isa->avx ? "v" : "", get_vector_element_offset(node) * 8, base,
+                 vector_index, vector_register(destination));
+            return destination;
+        }
+        case EXPRESSION:
+            break;
+        default:
+            assert(false && "Expression can not be vectorized");
+    }
+
+    if (node->n_children == 1) {
+        // Subtract from zero
+        int operand = generate_vector_expression(node->children[0]);
+        int destination = allocate_vector_register();
+        generate_vector_operation("pxor", vector_register(destination), destination, destination);
+        generate_vector_operation("psubq", vector_register(operand), destination, destination);
+        release_vector_register(operand);
+        return destination;
+    }
+
+    size_t other;
+    int shift = get_shift_amount(node, &other);
+    if (shift >= 0) {
+        int operand = generate_vector_expression(node->children[other]);
+        int destination = vector_temporary[operand] ? operand : allocate_vector_register();
+        char amount[16];
+        snprintf(amount, sizeof(amount), "$%d", shift);
+        generate_vector_operation("psllq", amount, operand, destination);
+        return destination;
+    }
+
+    int left = generate_vector_expression(node->children[0]);
+    int right = generate_vector_expression(node->children[1]);
+    int destination;
+    if (strcmp(node->data, "*") != 0) {
+        // SSE2 overwrites the left operand, which has to be a temporary
+        destination = vector_temporary[left]                        ? left
+                      : vector_isa->avx && vector_temporary[right] ? right
+                                                                    : allocate_vector_register();
+        generate_vector_operation(strcmp(node->data, "+") == 0 ? "paddq" : "psubq", vector_register(right), left,
+                                  destination);
+    } else {
+        // There is no 64-bit multiplication before AVX-512, so it is put together from 32-bit ones:
+        // the low halves multiplied, plus the products of each low half with the other high half, shifted up.
+        // Numbers with an empty high half only need one of the cross products, so they are placed on the right
+        if (is_low_half_number(node->children[0]) && !is_low_half_number(node->children[1])) {
+            int swap = left;
+            left = right;
+            right = swap;
+        }
+        int cross = allocate_vector_register();
+        generate_vector_operation("psrlq", "$32", left, cross);
+        generate_vector_operation("pmuludq", vector_register(right), cross, cross);
+        int other_cross = -1;
+        if (!is_low_half_number(node->children[0]) && !is_low_half_number(node->children[1])) {
+            other_cross = allocate_vector_register();
+            generate_vector_operation("psrlq", "$32", right, other_cross);
+            generate_vector_operation("pmuludq", vector_register(left), other_cross, other_cross);
+            generate_vector_operation("paddq", vector_register(other_cross), cross, cross);
+        }
+        generate_vector_operation("psllq", "$32", cross, cross);
+
+        destination = vector_temporary[left]                        ? left
+                      : vector_isa->avx && vector_temporary[right] ? right
+                      : other_cross >= 0                           ? other_cross
+                                                                    : allocate_vector_register();
+        generate_vector_operation("pmuludq", vector_register(right), left, destination);
+        generate_vector_operation("paddq", vector_register(cross), destination, destination);
+        release_vector_register(cross);
+        if (other_cross >= 0 && other_cross != destination)
+            release_vector_register(other_cross);
+    }
+
+    if (left != destination)
+        release_vector_register(left);
+    if (right != destination)
+        release_vector_register(right);
+    return destination;
+}
+
+/**
+ * Generates the vectorized loop for one instruction set, with the loop variable in vector_index. The end
+ * register is also used for moving numbers into vector registers, before it is loaded with the end, and for
+ * adding up the sums once the loop is done.
+ */
+static void generate_vector_variant(const vector_isa_t *isa, node_t *statement_list, node_t *bound, const char *end,
+                                    int counter) {
+    vector_isa = isa;
+    const char *v = isa->avx ? "v" : "";
+    for (int i = 0; i < NUM_VECTOR_REGISTERS; i++)
+        vector_in_use[i] = vector_temporary[i] = false;
+
+    char loop_label[BUFFER_SIZE_IN_BYTES];
+    snprintf(loop_label, BUFFER_SIZE_IN_BYTES, "%sloop%d", isa->name, counter);
+    char done_label[BUFFER_SIZE_IN_BYTES];
+    snprintf(done_label, BUFFER_SIZE_IN_BYTES, "%sdone%d", isa->name, counter);
+
+    for (size_t i = 0; i < n_vector_arrays; i++)
+        EMIT("leaq .%s(%s), %s", vector_arrays[i]->name, RIP, vector_bases[i]);
+
+    for (size_t i = 0; i < n_vector_operands; i++) {
+        node_t *operand = vector_operands[i];
+        int reg = allocate_vector_register();
+        vector_temporary[reg] = false;
+        vector_operand_registers[i] = reg;
+        if (operand->type == NUMBER_DATA) {
+            char immediate[32];
+            snprintf(immediate, sizeof(immediate), "$%ld", *(int64_t *)operand->data);
+            generate_broadcast(immediate, reg, end);
+        } else {
+            generate_broadcast(generate_variable_access(operand), reg, end);
+        }
+    }
+
+    if (vector_uses_variable) {
+        // Each lane holds the loop variable plus the number of the lane, and they are all increased by the lanes
+        vector_variable_register = allocate_vector_register();
+        vector_step_register = allocate_vector_register();
+        vector_temporary[vector_variable_register] = vector_temporary[vector_step_register] = false;
+        for (int lane = isa->lanes - 1; lane >= 0; lane--) {
+            char immediate[16];
+            snprintf(immediate, sizeof(immediate), "$%d", lane);
+            push_quadword(immediate);
+        }
+        EMIT("%smovdqu (%s), %s", v, RSP, vector_register(vector_variable_register));
+        drop_quadwords(isa->lanes);
+        generate_broadcast(vector_index, vector_step_register, end);
+        generate_vector_operation("paddq", vector_register(vector_step_register), vector_variable_register,
+                                  vector_variable_register);
+        char lanes[16];
+        snprintf(lanes, sizeof(lanes), "$%d", isa->lanes);
+        generate_broadcast(lanes, vector_step_register, end);
+    }
+
+    // Every sum is added up lane by lane in a register of its own, starting from 0
+    int *sums = malloc(statement_list->n_children * sizeof(int));
+    for (size_t i = 0; i < statement_list->n_children; i++) {
+        sums[i] = -1;
+        if (statement_list->children[i]->children[0]->type != IDENTIFIER_DATA)
+            continue;
+        sums[i] = allocate_vector_register();
+        vector_temporary[sums[i]] = false;
+        generate_vector_operation("pxor", vector_register(sums[i]), sums[i], sums[i]);
+    }
+
+    // Only run whole vectors of iterations, up to the end rounded down
+    if (bound->type == NUMBER_DATA)
+        EMIT("movq $%ld, %s", *(int64_t *)bound->data, end);
+    else
+        MOVQ(generate_variable_access(bound), end);
+    SUBQ(vector_index, end);
+    EMIT("andq $%d, %s", -isa->lanes, end);
+    JLE(done_label);
+    ADDQ(vector_index, end);
+
+    LABEL("%s", loop_label);
+    for (size_t i = 0; i < statement_list->n_children; i++) {
+        node_t *statement = statement_list->children[i];
+        node_t *destination = statement->children[0];
+        if (sums[i] < 0) {
+            int value = generate_vector_expression(statement->children[1]);
+            const char *base = NULL;
+            for (size_t j = 0; j < n_vector_arrays; j++)
+                if (vector_arrays[j] == destination->children[0]->symbol)
+                    base = vector_bases[j];
+            EMIT("%smovdqu %s, (%s, %s, 8)", v, vector_register(value), base, vector_index);
+            release_vector_register(value);
+        } else {
+            int value = generate_vector_expression(get_vector_sum_operand(statement));
+            bool is_sum = strcmp(statement->children[1]->data, "+") == 0;
+            generate_vector_operation(is_sum ? "paddq" : "psubq", vector_register(value), sums[i], sums[i]);
+            release_vector_register(value);
+        }
+    }
+
+    EMIT("addq $%d, %s", isa->lanes, vector_index);
+    if (vector_uses_variable)
+        generate_vector_operation("paddq", vector_register(vector_step_register), vector_variable_register,
+                                  vector_variable_register);
+    CMPQ(end, vector_index);
+    JL(loop_label);
+
+    // Add the lanes of each sum together, and then to the variable
+    for (size_t i = 0; i < statement_list->n_children; i++) {
+        if (sums[i] < 0)
+            continue;
+        int sum = sums[i];
+        int temporary = allocate_vector_register();
+        if (isa->avx) {
+            EMIT("vextracti128 $1, %s, %s", YMM_REGISTERS[sum], XMM_REGISTERS[temporary]);
+            EMIT("vpaddq %s, %s, %s", XMM_REGISTERS[temporary], XMM_REGISTERS[sum], XMM_REGISTERS[sum]);
+            EMIT("vpshufd $78, %s, %s", XMM_REGISTERS[sum], XMM_REGISTERS[temporary]);
+            EMIT("vpaddq %s, %s, %s", XMM_REGISTERS[temporary], XMM_REGISTERS[sum], XMM_REGISTERS[sum]);
+        } else {
+            EMIT("pshufd $78, %s, %s", XMM_REGISTERS[sum], XMM_REGISTERS[temporary]);
+            EMIT("paddq %s, %s", XMM_REGISTERS[temporary], XMM_REGISTERS[sum]);
+        }
+        EMIT("%smovq %s, %s", v, XMM_REGISTERS[sum], end);
+        ADDQ(end, generate_variable_access(statement_list->children[i]->children[0]));
+        release_vector_register(temporary);
+    }
+    free(sums);
+
+    LABEL("%s", done_label);
+    // Leaving the upper halves of the ymm registers dirty slows down the SSE instructions used by printf
+    if (isa->avx)
+        EMIT("vzeroupper");
+}
+
+/**
+ * Generates a vectorized loop, see VECTOR_LOOP in tree.h, once for AVX2 and once for SSE2, picking one when
+ * the loop is reached, depending on what the processor supports. If the loop needs more registers than
+ * there are free, no code is generated, and the for-loop following it runs every iteration instead.
+ */
+static void generate_vector_loop(node_t *statement) {
+    node_t *relation = statement->children[0];
+    node_t *statement_list = statement->children[1]->children[0];
+    vector_variable = relation->children[0]->symbol;
+    vector_uses_variable = false;
+    n_vector_operands = n_vector_arrays = 0;
+
+    int need = 0, n_sums = 0;
+    for (size_t i = 0; i < statement_list->n_children; i++) {
+        node_t *assignment = statement_list->children[i];
+        node_t *expression = assignment->children[1];
+        if (assignment->children[0]->type == ARRAY_INDEXING) {
+            add_vector_array(assignment->children[0]->children[0]->symbol);
+        } else {
+            expression = get_vector_sum_operand(assignment);
+            n_sums++;
+        }
+        collect_vector_operands(expression);
+        int statement_need = vector_register_need(expression);
+        if (statement_need > need)
+            need = statement_need;
+    }
+    // Adding up the sums in the end takes a temporary register as well
+    int kept = (int)n_vector_operands + n_sums + (vector_uses_variable ? 2 : 0);
+    bool fits = kept + need + 1 <= NUM_VECTOR_REGISTERS;
+
+    // The end, the address of each array, and the loop variable, unless it has a register of its own already
+    const char *variable = generate_variable_access(relation->children[0]);
+    bool variable_in_register = variable[0] == '%';
+    size_t n_registers = 1 + n_vector_arrays + !variable_in_register;
+    const char **registers = calloc(n_registers, sizeof(const char *));
+    for (size_t i = 0; i < n_registers && fits; i++) {
+        registers[i] = allocate_scratch_register(false);
+        fits = registers[i] != NULL;
+    }
+
+    if (fits) {
+        uses_vector_dispatch = true;
+        int local_counter = vector_counter++;
+        const char *end = registers[0];
+        vector_bases = &registers[1];
+        vector_index = variable_in_register ? current_allocation->locations[vector_variable->sequence_number].reg
+                                            : registers[n_registers - 1];
+        vector_operand_registers = malloc(n_vector_operands * sizeof(int));
+        if (!variable_in_register)
+            MOVQ(generate_variable_access(relation->children[0]), vector_index);
+
+        char sse_label[BUFFER_SIZE_IN_BYTES];
+        snprintf(sse_label, BUFFER_SIZE_IN_BYTES, "ssevector%d", local_counter);
+        char end_label[BUFFER_SIZE_IN_BYTES];
+        snprintf(end_label, BUFFER_SIZE_IN_BYTES, "endvector%d", local_counter);
+
+        EMIT("cmpb $0, has_avx2(%s)", RIP);
+        JE(sse_label);
+        generate_vector_variant(&AVX2, statement_list, relation->children[1], end, local_counter);
+        JMP(end_label);
+        LABEL("%s", sse_label);
+        generate_vector_variant(&SSE2, statement_list, relation->children[1], end, local_counter);
+        LABEL("%s", end_label);
+
+        // The for-loop continues from the first iteration that was not run
+        if (!variable_in_register)
+            MOVQ(vector_index, generate_variable_access(relation->children[0]));
+        free(vector_operand_registers);
+        vector_operand_registers = NULL;
+    }
+
+    for (size_t i = 0; i < n_registers; i++)
+        if (registers[i] != NULL)
+            release_scratch_register(registers[i]);
+    free(registers);
+    free(vector_operands);
+    vector_operands = NULL;
+    free(vector_arrays);
+    vector_arrays = NULL;
+    vector_bases = NULL;
+}
+
+/**
+ * Sets has_avx2 if both the processor and the operating system support AVX2, which takes the AVX and OSXSAVE
+ * bits of cpuid leaf 1, the ymm registers being enabled in XCR0, and the AVX2 bit of cpuid leaf 7
+ */
+static void generate_cpu_dispatch(void) {
+    // cpuid writes to rbx, which is callee-saved
+    PUSHQ(RBX);
+    MOVQ("$0", RAX);
+    EMIT("cpuid");
+    EMIT("cmpl $7, %%eax");
+    JL("no_avx2");
+    MOVQ("$1", RAX);
+    EMIT("cpuid");
+    EMIT("andl $0x18000000, %%ecx");
+    EMIT("cmpl $0x18000000, %%ecx");
+    JNE("no_avx2");
+    EMIT("xorl %%ecx, %%ecx");
+    EMIT("xgetbv");
+    EMIT("andl $6, %%eax");
+    EMIT("cmpl $6, %%eax");
+    JNE("no_avx2");
+    MOVQ("$7", RAX);
+    EMIT("xorl %%ecx, %%ecx");
+    EMIT("cpuid");
+    EMIT("testl $32, %%ebx");
+    EMIT("setne has_avx2(%s)", RIP);
+    LABEL("no_avx2");
+    POPQ(RBX);
+}
+
 static void generate_block_statement(node_t *node) {
     // All handling of pushing and popping scores has already been done
     // Just generate the statements that make up the statement body, one by one
@@ -538,6 +2749,9 @@ static void generate_statement(node_t *node) {
         case WHILE_STATEMENT:
             generate_while_statement(node);
             break;
+        case VECTOR_LOOP:
+            generate_vector_loop(node);
+            break;
         case BREAK_STATEMENT:
             generate_break_statement();
             break;
@@ -546,21 +2760,6 @@ static void generate_statement(node_t *node) {
     }
 }
 
-static void generate_safe_printf(void) {
-    LABEL("safe_printf");
-
-    PUSHQ(RBP);
-    MOVQ(RSP, RBP);
-    // This is a bitmask that abuses how negative numbers work, to clear the last 4 bits
-    // A stack pointer that is not 16-byte aligned, will be moved down to a 16-byte boundary
-    ANDQ("$-16", RSP);
-    EMIT("call printf");
-    // Cleanup the stack back to how it was
-    MOVQ(RBP, RSP);
-    POPQ(RBP);
-    RET;
-}
-
 static void generate_main(symbol_t *first) {
     // Make the globally available main function
     LABEL("main");
@@ -569,11 +2768,15 @@ static void generate_main(symbol_t *first) {
     PUSHQ(RBP);
     MOVQ(RSP, RBP);
 
+    if (uses_vector_dispatch)
+        generate_cpu_dispatch();
+
     // Which registers argc and argv are passed in
     const char *argc = RDI;
     const char *argv = RSI;
 
     const size_t expected_args = FUNC_PARAM_COUNT(first);
+    const size_t register_args = get_register_params(first);
 
     SUBQ("$1", argc);  // argc counts the name of the binary, so subtract that
     EMIT("cmpq $%ld, %s", expected_args, argc);
@@ -582,6 +2785,10 @@ static void generate_main(symbol_t *first) {
     if (expected_args == 0)
         goto skip_args;  // No need to parse argv
 
+    // The arguments left on the stack are placed above padding that keeps the call 16-byte aligned
+    if ((expected_args - register_args) % 2 == 1)
+        SUBQ("$8", RSP);
+
     // Now we emit a loop to parse all parameters, and push them to the stack,
     // in right-to-left order
 
@@ -608,8 +2815,8 @@ static void generate_main(symbol_t *first) {
     SUBQ("$8", argv);         // Point to the previous char*
     EMIT("loop PARSE_ARGV");  // Loop uses RCX as a counter automatically
 
-    // Now, pop up to 6 arguments into registers instead of stack
-    for (size_t i = 0; i < expected_args && i < NUM_REGISTER_PARAMS; i++)
+    // Now, pop up to 8 arguments into registers instead of stack
+    for (size_t i = 0; i < register_args; i++)
         POPQ(REGISTER_PARAMS[i]);
 
 skip_args:
@@ -624,7 +2831,11 @@ skip_args:
     MOVQ("$1", RDI);
     EMIT("call exit");  // Exit with return code 1
 
-    generate_safe_printf();
+    if (uses_vector_dispatch) {
+        DIRECTIVE(".section %s", ASM_BSS_SECTION);
+        DIRECTIVE("has_avx2: \t.zero 1");
+        DIRECTIVE(".text");
+    }
 
     // Declares global symbols we use or emit, such as main, printf and putchar
     DIRECTIVE("%s", ASM_DECLARE_SYMBOLS);
@@ -0,0 +1,431 @@
+#include <vslc.h>
+
+#include "instruction_selection.h"
+
+/**
+ * A node of a tree pattern. Leaves match operands of the given class, while inner nodes match
+ * nodes of the same type and operator. An inner node without children matches any children.
+ */
+struct pattern {
+    bool is_leaf;
+    operand_class_t operand;
+    node_type_t type;
+    const char *operator;  // Matched against the data of EXPRESSION and RELATION nodes, if not NULL
+    size_t n_children;
+    const pattern_t *children[2];
+};
+
+// Helper macros for writing patterns as nested compound literals
+#define LEAF(class) (&(const pattern_t){.is_leaf = true, .operand = (class)})
+#define UNARY(op, child) (&(const pattern_t){.type = EXPRESSION, .operator = (op), .n_children = 1, .children = {(child)}})
+#define BINARY(op, left, right) \
+    (&(const pattern_t){.type = EXPRESSION, .operator = (op), .n_children = 2, .children = {(left), (right)}})
+#define CALL (&(const pattern_t){.type = EXPRESSION, .operator = "call"})
+#define ELEMENT(array, index) \
+    (&(const pattern_t){.type = ARRAY_INDEXING, .n_children = 2, .children = {(array), (index)}})
+#define POINTER(pointer, index) \
+    (&(const pattern_t){.type = POINTER_INDEXING, .n_children = 2, .children = {(pointer), (index)}})
+#define COMPARE(left, right) (&(const pattern_t){.type = RELATION, .n_children = 2, .children = {(left), (right)}})
+#define ASSIGN(variable, value) \
+    (&(const pattern_t){.type = ASSIGNMENT_STATEMENT, .n_children = 2, .children = {(variable), (value)}})
+
+#define REG LEAF(OPERAND_REG)
+#define RVAR LEAF(OPERAND_RVAR)
+#define MEM LEAF(OPERAND_MEM)
+#define VAR LEAF(OPERAND_VAR)
+#define SAME LEAF(OPERAND_SAME)
+#define NUMBER LEAF(OPERAND_NUMBER)
+#define IMM LEAF(OPERAND_IMM)
+#define ZERO LEAF(OPERAND_ZERO)
+#define SCALE LEAF(OPERAND_SCALE)
+#define LEA_FACTOR LEAF(OPERAND_LEA_FACTOR)
+#define ARRAY LEAF(OPERAND_ARRAY)
+#define SHIFT LEAF(OPERAND_SHIFT)
+#define FACTOR LEAF(OPERAND_FACTOR)
+#define DIVISOR LEAF(OPERAND_DIVISOR)
+
+/**
+ * Rules for evaluating an expression into the destination register.
+ * When two leaves are evaluated into registers, they must be the two children of the root, and the
+ * template must accept a memory operand as the second, as it is kept on the stack when registers run out.
+ * Of the rules with equal cost, the first one listed is picked.
+ */
+static const rule_t EXPRESSION_RULES[] = {
+    {ZERO, 1, false, ACTION_TEMPLATE, "xorl %D, %D"},
+    {NUMBER, 1, false, ACTION_TEMPLATE, "movq $%0, %d"},
+    {VAR, 1, false, ACTION_TEMPLATE, "movq %0, %d"},
+    {ELEMENT(ARRAY, REG), 2, false, ACTION_ELEMENT, NULL},
+    {POINTER(RVAR, RVAR), 1, false, ACTION_TEMPLATE, "movq (%0, %1, 8), %d"},
+    {POINTER(RVAR, REG), 1, false, ACTION_TEMPLATE, "movq (%0, %d, 8), %d"},
+    {POINTER(MEM, REG), 3, false, ACTION_TEMPLATE, "shlq $3, %d; addq %0, %d; movq (%d), %d"},
+    {UNARY("&", ARRAY), 1, false, ACTION_TEMPLATE, "leaq .%0(%%rip), %d"},
+    {CALL, 1, false, ACTION_CALL, NULL},
+    {UNARY("-", REG), 1, false, ACTION_TEMPLATE, "negq %d"},
+
+    // Additions of registers and small constants, with the result in another register, fit in one leaq
+    {BINARY("+", RVAR, RVAR), 1, false, ACTION_TEMPLATE, "leaq (%0, %1), %d"},
+    {BINARY("+", RVAR, IMM), 1, true, ACTION_TEMPLATE, "leaq %1(%0), %d"},
+    {BINARY("+", BINARY("+", RVAR, RVAR), IMM), 1, true, ACTION_TEMPLATE, "leaq %2(%0, %1), %d"},
+    {BINARY("+", RVAR, BINARY("*", RVAR, SCALE)), 1, true, ACTION_TEMPLATE, "leaq (%0, %1, %2), %d"},
+    {BINARY("+", REG, BINARY("*", RVAR, SCALE)), 1, true, ACTION_TEMPLATE, "leaq (%d, %1, %2), %d"},
+    {BINARY("*", RVAR, LEA_FACTOR), 1, true, ACTION_TEMPLATE, "leaq (%0, %0, %1), %d"},
+    {BINARY("*", REG, LEA_FACTOR), 1, true, ACTION_TEMPLATE, "leaq (%d, %d, %1), %d"},
+    {BINARY("*", RVAR, SCALE), 1, true, ACTION_TEMPLATE, "leaq (, %0, %1), %d"},
+
+    {BINARY("+", REG, IMM), 1, true, ACTION_TEMPLATE, "addq $%1, %d"},
+    {BINARY("+", REG, VAR), 1, true, ACTION_TEMPLATE, "addq %1, %d"},
+    {BINARY("+", REG, REG), 1, false, ACTION_TEMPLATE, "addq %1, %d"},
+    {BINARY("-", REG, IMM), 1, false, ACTION_TEMPLATE, "subq $%1, %d"},
+    {BINARY("-", REG, VAR), 1, false, ACTION_TEMPLATE, "subq %1, %d"},
+    {BINARY("-", REG, REG), 1, false, ACTION_TEMPLATE, "subq %1, %d"},
+    // imulq takes three cycles, where a shift or leaq takes one
+    {BINARY("*", REG, SHIFT), 1, true, ACTION_TEMPLATE, "shlq $%1, %d"},
+    {BINARY("*", REG, FACTOR), 2, true, ACTION_MULTIPLY, NULL},
+    {BINARY("*", VAR, IMM), 3, true, ACTION_TEMPLATE, "imulq $%1, %0, %d"},
+    {BINARY("*", REG, IMM), 3, true, ACTION_TEMPLATE, "imulq $%1, %d, %d"},
+    {BINARY("*", REG, VAR), 3, true, ACTION_TEMPLATE, "imulq %1, %d"},
+    {BINARY("*", REG, REG), 3, false, ACTION_TEMPLATE, "imulq %1, %d"},
+    // idivq takes its divisor from a register or memory, never an immediate, and tens of cycles.
+    // Dividing by a constant is done by multiplying with its reciprocal instead
+    {BINARY("/", REG, DIVISOR), 6, false, ACTION_DIVIDE_CONSTANT, NULL},
+    {BINARY("/", REG, VAR), 20, false, ACTION_DIVIDE, NULL},
+    {BINARY("/", REG, REG), 20, false, ACTION_DIVIDE, NULL},
+};
+
+// Rules for comparing the left side of a relation to the right, using cmpq right, left
+static const rule_t RELATION_RULES[] = {
+    {COMPARE(RVAR, ZERO), 1, false, ACTION_TEMPLATE, "testq %0, %0"},
+    {COMPARE(VAR, IMM), 1, false, ACTION_TEMPLATE, "cmpq $%1, %0"},
+    {COMPARE(RVAR, VAR), 1, false, ACTION_TEMPLATE, "cmpq %1, %0"},
+    {COMPARE(MEM, RVAR), 1, false, ACTION_TEMPLATE, "cmpq %1, %0"},
+    {COMPARE(REG, ZERO), 1, false, ACTION_TEMPLATE, "testq %d, %d"},
+    {COMPARE(REG, IMM), 1, false, ACTION_TEMPLATE, "cmpq $%1, %d"},
+    {COMPARE(REG, VAR), 1, false, ACTION_TEMPLATE, "cmpq %1, %d"},
+    {COMPARE(VAR, REG), 1, false, ACTION_TEMPLATE, "cmpq %d, %0"},
+    {COMPARE(REG, REG), 1, false, ACTION_TEMPLATE, "cmpq %1, %d"},
+};
+
+// Rules for assignments that can update their destination directly
+static const rule_t ASSIGNMENT_RULES[] = {
+    {ASSIGN(VAR, BINARY("+", SAME, IMM)), 1, false, ACTION_TEMPLATE, "addq $%2, %0"},
+    {ASSIGN(VAR, BINARY("+", IMM, SAME)), 1, false, ACTION_TEMPLATE, "addq $%1, %0"},
+    {ASSIGN(VAR, BINARY("-", SAME, IMM)), 1, false, ACTION_TEMPLATE, "subq $%2, %0"},
+    {ASSIGN(VAR, UNARY("-", SAME)), 1, false, ACTION_TEMPLATE, "negq %0"},
+    {ASSIGN(RVAR, BINARY("+", SAME, VAR)), 1, false, ACTION_TEMPLATE, "addq %2, %0"},
+    {ASSIGN(RVAR, BINARY("+", VAR, SAME)), 1, false, ACTION_TEMPLATE, "addq %1, %0"},
+    {ASSIGN(RVAR, BINARY("+", SAME, BINARY("*", RVAR, SCALE))), 1, false, ACTION_TEMPLATE, "leaq (%0, %2, %3), %0"},
+    {ASSIGN(RVAR, BINARY("-", SAME, VAR)), 1, false, ACTION_TEMPLATE, "subq %2, %0"},
+    {ASSIGN(VAR, BINARY("*", SAME, SHIFT)), 1, false, ACTION_TEMPLATE, "shlq $%2, %0"},
+    {ASSIGN(RVAR, BINARY("*", SAME, IMM)), 3, false, ACTION_TEMPLATE, "imulq $%2, %0, %0"},
+    {ASSIGN(RVAR, BINARY("*", SAME, VAR)), 3, false, ACTION_TEMPLATE, "imulq %2, %0"},
+    {ASSIGN(RVAR, BINARY("*", VAR, SAME)), 3, false, ACTION_TEMPLATE, "imulq %1, %0"},
+    {ASSIGN(MEM, BINARY("+", SAME, RVAR)), 1, false, ACTION_TEMPLATE, "addq %2, %0"},
+    {ASSIGN(MEM, BINARY("+", RVAR, SAME)), 1, false, ACTION_TEMPLATE, "addq %1, %0"},
+    {ASSIGN(MEM, BINARY("-", SAME, RVAR)), 1, false, ACTION_TEMPLATE, "subq %2, %0"},
+    {ASSIGN(VAR, BINARY("+", SAME, REG)), 1, false, ACTION_TEMPLATE, "addq %d, %0"},
+    {ASSIGN(VAR, BINARY("+", REG, SAME)), 1, false, ACTION_TEMPLATE, "addq %d, %0"},
+    {ASSIGN(VAR, BINARY("-", SAME, REG)), 1, false, ACTION_TEMPLATE, "subq %d, %0"},
+    {ASSIGN(MEM, IMM), 1, false, ACTION_TEMPLATE, "movq $%1, %0"},
+    {ASSIGN(MEM, RVAR), 1, false, ACTION_TEMPLATE, "movq %1, %0"},
+    {ASSIGN(POINTER(RVAR, RVAR), IMM), 1, false, ACTION_TEMPLATE, "movq $%2, (%0, %1, 8)"},
+    {ASSIGN(POINTER(RVAR, RVAR), RVAR), 1, false, ACTION_TEMPLATE, "movq %2, (%0, %1, 8)"},
+    {ASSIGN(POINTER(RVAR, RVAR), REG), 1, false, ACTION_TEMPLATE, "movq %d, (%0, %1, 8)"},
+};
+
+#define NUM_RULES(rules) (sizeof(rules) / sizeof(*(rules)))
+
+// Array elements at constant indices are addressed relative to the array, with a 32-bit displacement
+#define MAX_CONSTANT_INDEX (1L << 28)
+
+/* The cheapest way found to evaluate an expression node into a register */
+typedef struct {
+    node_t *node;
+    const rule_t *rule;
+    bool swapped;
+    int cost;
+} label_t;
+
+/* State for the function currently being generated */
+static register_allocation_t *current_allocation;
+
+// Open addressing hash table of the labeled expression nodes, so each is only labeled once
+static label_t *labels;
+static size_t labels_capacity, n_labels;
+
+static const label_t *label_expression(node_t *node);
+static bool match_rule(const rule_t *rule, node_t *node, bool swapped, match_t *match);
+static bool match_pattern(const pattern_t *pattern, node_t *node, bool swapped, match_t *match);
+static bool matches_operand(operand_class_t class, node_t *node, match_t *match);
+static bool find_cheapest_match(const rule_t *rules, size_t n_rules, node_t *node, match_t *match);
+
+/* External interface */
+
+void instruction_selection_begin(register_allocation_t *allocation) {
+    current_allocation = allocation;
+    labels_capacity = 64;
+    n_labels = 0;
+    labels = calloc(labels_capacity, sizeof(label_t));
+}
+
+void instruction_selection_end(void) {
+    free(labels);
+    labels = NULL;
+    current_allocation = NULL;
+}
+
+match_t select_expression(node_t *expression) {
+    const label_t *label = label_expression(expression);
+    match_t match;
+    bool matched = match_rule(label->rule, expression, label->swapped, &match);
+    assert(matched);
+    return match;
+}
+
+match_t select_relation(node_t *relation) {
+    assert(relation->type == RELATION);
+    match_t match;
+    bool matched = find_cheapest_match(RELATION_RULES, NUM_RULES(RELATION_RULES), relation, &match);
+    assert(matched && "The generic relation rule matches any relation");
+    return match;
+}
+
+bool select_assignment(node_t *statement, match_t *match) {
+    assert(statement->type == ASSIGNMENT_STATEMENT);
+    return find_cheapest_match(ASSIGNMENT_RULES, NUM_RULES(ASSIGNMENT_RULES), statement, match);
+}
+
+bool split_factor(int64_t factor, factor_t *steps) {
+    *steps = (factor_t){0};
+    if (factor == 0 || factor == INT64_MIN)
+        return false;
+
+    steps->negate = factor < 0;
+    uint64_t rest = factor < 0 ? -(uint64_t)factor : (uint64_t)factor;
+    while ((rest & 1) == 0) {
+        rest >>= 1;
+        steps->shift++;
+    }
+
+    static const int LEA_FACTORS[] = {9, 5, 3};
+    for (size_t i = 0; i < 3 && steps->n_lea_factors < 2; i++) {
+        while (rest % LEA_FACTORS[i] == 0 && steps->n_lea_factors < 2) {
+            rest /= LEA_FACTORS[i];
+            steps->lea_factors[steps->n_lea_factors++] = LEA_FACTORS[i];
+        }
+    }
+    return rest == 1 && steps->n_lea_factors + (steps->shift > 0) + steps->negate <= 2;
+}
+
+bool contains_call(node_t *node) {
+    if (node->type == EXPRESSION && strcmp(node->data, "call") == 0)
+        return true;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (contains_call(node->children[i]))
+            return true;
+    return false;
+}
+
+/* Inner workings */
+
+static size_t hash_node(node_t *node) {
+    return ((uintptr_t)node >> 4) * 2654435761u;
+}
+
+/* Returns the label of the node, computing it the first time the node is seen */
+static const label_t *label_expression(node_t *node) {
+    size_t index = hash_node(node) & (labels_capacity - 1);
+    while (labels[index].node != NULL) {
+        if (labels[index].node == node)
+            return &labels[index];
+        index = (index + 1) & (labels_capacity - 1);
+    }
+
+    match_t match;
+    bool matched = find_cheapest_match(EXPRESSION_RULES, NUM_RULES(EXPRESSION_RULES), node, &match);
+    assert(matched && "Every expression can be evaluated into a register");
+
+    // The table was possibly grown while labeling the children, so find the free spot again
+    if (2 * (n_labels + 1) > labels_capacity) {
+        label_t *old_labels = labels;
+        size_t old_capacity = labels_capacity;
+        labels_capacity *= 2;
+        labels = calloc(labels_capacity, sizeof(label_t));
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_labels[i].node == NULL)
+                continue;
+            size_t j = hash_node(old_labels[i].node) & (labels_capacity - 1);
+            while (labels[j].node != NULL)
+                j = (j + 1) & (labels_capacity - 1);
+            labels[j] = old_labels[i];
+        }
+        free(old_labels);
+    }
+    index = hash_node(node) & (labels_capacity - 1);
+    while (labels[index].node != NULL)
+        index = (index + 1) & (labels_capacity - 1);
+
+    labels[index] = (label_t){.node = node, .rule = match.rule, .swapped = match.swapped, .cost = match.cost};
+    n_labels++;
+    return &labels[index];
+}
+
+/* Returns true if the variable or array element node reads memory that a call can change */
+static bool is_global_memory(node_t *node) {
+    if (node->type == ARRAY_INDEXING || node->type == POINTER_INDEXING)
+        return true;
+    return node->type == IDENTIFIER_DATA && node->symbol->type == SYMBOL_GLOBAL_VAR;
+}
+
+/**
+ * Tries every rule, with and without swapping commutative ones, and places the cheapest match in match.
+ * Returns false if none of the rules match the node.
+ */
+static bool find_cheapest_match(const rule_t *rules, size_t n_rules, node_t *node, match_t *match) {
+    bool found = false;
+    for (size_t i = 0; i < n_rules; i++) {
+        for (int swapped = 0; swapped <= rules[i].commutative; swapped++) {
+            match_t candidate;
+            if (!match_rule(&rules[i], node, swapped, &candidate))
+                continue;
+            if (!found || candidate.cost < match->cost) {
+                *match = candidate;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+/* Matches a single rule against the node, filling in the leaves and the total cost */
+static bool match_rule(const rule_t *rule, node_t *node, bool swapped, match_t *match) {
+    match->rule = rule;
+    match->swapped = swapped;
+    match->n_leaves = 0;
+    match->cost = rule->cost;
+    if (!match_pattern(rule->pattern, node, swapped, match))
+        return false;
+
+    // Leaves that are not evaluated into registers are read when the instruction runs, after
+    // every register leaf. Calls could have changed global memory by then, so do not reorder them
+    bool reads_global_memory = false, makes_call = false;
+    for (size_t i = 0; i < match->n_leaves; i++) {
+        if (match->classes[i] == OPERAND_REG)
+            makes_call |= contains_call(match->leaves[i]);
+        else
+            reads_global_memory |= is_global_memory(match->leaves[i]);
+    }
+    if (reads_global_memory && makes_call)
+        return false;
+
+    if (!swapped)
+        return true;
+
+    // Only patterns with at most one register leaf may be swapped,
+    // as evaluating two registers in the swapped order could be observable
+    size_t n_registers = 0;
+    for (size_t i = 0; i < match->n_leaves; i++)
+        n_registers += match->classes[i] == OPERAND_REG;
+    return n_registers <= 1;
+}
+
+static bool match_pattern(const pattern_t *pattern, node_t *node, bool swapped, match_t *match) {
+    if (pattern->is_leaf) {
+        if (!matches_operand(pattern->operand, node, match))
+            return false;
+        assert(match->n_leaves < MAX_PATTERN_LEAVES);
+        match->leaves[match->n_leaves] = node;
+        match->classes[match->n_leaves] = pattern->operand;
+        match->n_leaves++;
+        if (pattern->operand == OPERAND_REG)
+            match->cost += label_expression(node)->cost;
+        return true;
+    }
+
+    if (node->type != pattern->type)
+        return false;
+    if (pattern->operator != NULL && (node->data == NULL || strcmp(pattern->operator, node->data) != 0))
+        return false;
+    if (pattern->n_children == 0)
+        return true;
+    if (node->n_children != pattern->n_children)
+        return false;
+
+    for (size_t i = 0; i < pattern->n_children; i++) {
+        // Only the children of the root are swapped
+        size_t child = swapped && pattern->n_children == 2 ? 1 - i : i;
+        if (!match_pattern(pattern->children[i], node->children[child], false, match))
+            return false;
+    }
+    return true;
+}
+
+static bool is_register_variable(node_t *node) {
+    if (node->type != IDENTIFIER_DATA)
+        return false;
+    symbol_t *symbol = node->symbol;
+    if (symbol->type != SYMBOL_LOCAL_VAR && symbol->type != SYMBOL_PARAMETER)
+        return false;
+    return current_allocation->locations[symbol->sequence_number].reg != NULL;
+}
+
+bool is_memory_operand(node_t *node) {
+    if (node->type == IDENTIFIER_DATA)
+        return !is_register_variable(node);
+
+    if (node->type != ARRAY_INDEXING && node->type != POINTER_INDEXING)
+        return false;
+
+    // Elements found through a pointer are only addressed directly when the pointer is in a register
+    node_t *index = node->children[1];
+    if (node->type == ARRAY_INDEXING && node->children[0]->symbol->type != SYMBOL_GLOBAL_ARRAY)
+        return false;
+    // Narrowed elements are loaded with sign extension, and stored from the lower part of a register
+    if (node->type == ARRAY_INDEXING && node->children[0]->symbol->element_width != ELEMENT_QUADWORD)
+        return false;
+    if (node->type == POINTER_INDEXING && !is_register_variable(node->children[0]))
+        return false;
+    if (index->type != NUMBER_DATA)
+        return false;
+    int64_t value = *(int64_t *)index->data;
+    return value > -MAX_CONSTANT_INDEX && value < MAX_CONSTANT_INDEX;
+}
+
+static bool matches_operand(operand_class_t class, node_t *node, match_t *match) {
+    int64_t value = node->type == NUMBER_DATA ? *(int64_t *)node->data : 0;
+    switch (class) {
+        case OPERAND_REG:
+            return true;
+        case OPERAND_RVAR:
+            return is_register_variable(node);
+        case OPERAND_MEM:
+            return is_memory_operand(node);
+        case OPERAND_VAR:
+            return is_register_variable(node) || is_memory_operand(node);
+        case OPERAND_SAME:
+            return node->type == IDENTIFIER_DATA && match->n_leaves > 0 &&
+                   match->leaves[0]->type == IDENTIFIER_DATA && match->leaves[0]->symbol == node->symbol;
+        case OPERAND_NUMBER:
+            return node->type == NUMBER_DATA;
+        case OPERAND_IMM:
+            return node->type == NUMBER_DATA && value >= INT32_MIN && value <= INT32_MAX;
+        case OPERAND_ZERO:
+            return node->type == NUMBER_DATA && value == 0;
+        case OPERAND_SCALE:
+            return node->type == NUMBER_DATA && (value == 2 || value == 4 || value == 8);
+        case OPERAND_LEA_FACTOR:
+            return node->type == NUMBER_DATA && (value == 3 || value == 5 || value == 9);
+        case OPERAND_SHIFT:
+            return node->type == NUMBER_DATA && value >= 2 && value <= (1L << 62) && (value & (value - 1)) == 0;
+        case OPERAND_FACTOR: {
+            factor_t steps;
+            return node->type == NUMBER_DATA && split_factor(value, &steps);
+        }
+        case OPERAND_DIVISOR:
+            return node->type == NUMBER_DATA && value != 0 && value != -1;
+        case OPERAND_ARRAY:
+            return node->type == IDENTIFIER_DATA;
+        default:
+            assert(false && "Unknown operand class");
+            return false;
+    }
+}
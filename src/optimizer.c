@@ -0,0 +1,3654 @@
+#include <vslc.h>
+
+#include "instruction_selection.h"
+
+// What evaluating a part of the program can do, besides computing a value and assigning local variables
+typedef struct {
+    bool prints;
+    bool reads_memory;  // Global variables and arrays
+    bool writes_memory;
+    bool makes_call;
+} effects_t;
+
+/**
+ * A function, and the numbers some calls to it pass for some of its parameters, see specialize_functions.
+ * Only parameters the function never assigns to are specialized
+ */
+typedef struct {
+    symbol_t *function;
+    bool *specialized;  // For each parameter
+    int64_t *values;
+    size_t n_specialized;
+    size_t n_calls;
+    size_t order;  // Where the first of the calls was found
+    symbol_t *clone;
+} specialization_t;
+
+// The numbers a variable or array element can hold, or a function return, see narrow_arrays
+typedef struct {
+    int64_t low, high;
+    bool empty;  // Nothing has been found to be assigned yet
+    int growths;
+} value_range_t;
+
+// How running a statement at compile time ended, see evaluate_statement
+typedef enum { EVALUATION_NEXT, EVALUATION_BREAK, EVALUATION_RETURN, EVALUATION_FAILED } evaluation_t;
+
+static void optimize_node(node_t *node);
+static void evaluate_pure_calls(void);
+static void find_pure_functions(void);
+static bool calls_only_pure_functions(node_t *node);
+static bool is_evaluable_call(node_t *node);
+static void evaluate_calls_in(node_t **slot);
+static bool evaluate_call(symbol_t *function, int64_t *arguments, int64_t *result);
+static evaluation_t evaluate_statement(node_t *node, int64_t *frame, int64_t *result);
+static bool evaluate_relation(node_t *relation, int64_t *frame, bool *holds);
+static bool evaluate_expression(node_t *node, int64_t *frame, int64_t *value);
+static bool is_frame_variable(symbol_t *symbol);
+static void memoize_functions(void);
+static bool reaches_function(node_t *node, symbol_t *target, bool *visited);
+static bool recurses_before_returning(node_t *node, symbol_t *function);
+static void memoize_function(symbol_t *function);
+static symbol_t *create_table(const char *function, const char *part);
+static void store_returns(node_t **slot, node_t **stores, size_t n_stores, symbol_t *result);
+static void specialize_functions(void);
+static void find_specializations(node_t *node);
+static void count_specialization(node_t *call, bool *specialized);
+static specialization_t *find_specialization(node_t *call);
+static bool matches_specialization(node_t *call, specialization_t *specialization);
+static int compare_specializations(const void *a, const void *b);
+static symbol_t *clone_function(specialization_t *specialization);
+static void redirect_specialized_calls(node_t *node);
+static void fold_constant_branches(node_t **slot);
+static void narrow_arrays(void);
+static void find_ranges(node_t *node, symbol_t *function);
+static value_range_t get_range(node_t *node, symbol_t *function);
+static value_range_t *get_variable_range(symbol_t *symbol, symbol_t *function);
+static void join_range(value_range_t *range, value_range_t values);
+static bool is_remainder(node_t *node, int64_t *divisor);
+static bool fits_range(value_range_t range, int64_t low, int64_t high);
+static bool is_quadword_array(symbol_t *symbol);
+static void inline_functions(void);
+static void count_calls(node_t *node);
+static bool is_call(node_t *node);
+static void inline_calls_in(symbol_t *function);
+static void visit_callees(node_t *node);
+static void inline_statements(node_t **slot);
+static node_t **find_inlinable_call(node_t *statement, node_t *node);
+static bool can_inline(node_t *statement, node_t *call);
+static void find_effects(node_t *node, node_t *excluded, effects_t *effects);
+static bool references_node(node_t *node, node_t *target);
+static void inline_call(node_t **slot, node_t **call_slot);
+static node_t *get_returned_expression(node_t *body);
+static bool returns_only_last(node_t *node, bool last);
+static bool always_returns(node_t *node);
+static void move_returns_last(node_t *node);
+static void replace_returns(node_t *node, symbol_t *variable);
+static bool is_assigned_first(node_t *node, symbol_t *variable);
+static bool is_inlined_variable(symbol_t *symbol);
+static void fold_constant_loop_bound(node_t *block);
+static bool references_symbol(node_t *node, symbol_t *symbol);
+static void unroll_for_loops(node_t *node);
+static void unroll_for_loop(node_t *block);
+static bool breaks_out(node_t *node);
+static size_t count_nodes(node_t *node);
+static node_t *copy_body(node_t *body, symbol_t *variable, int64_t offset, bool replace_with_number);
+static node_t *copy_subtree(node_t *node);
+static void fold_constants(node_t **slot);
+static bool apply_operator(const char *operator, size_t n_operands, int64_t left, int64_t right, int64_t *result);
+static bool holds_for(const char *relation, int64_t left, int64_t right);
+static void vectorize_for_loops(node_t *node);
+static void vectorize_for_loop(node_t *block);
+static bool is_vectorizable_statement(node_t *statement, symbol_t *variable, node_t *body);
+static bool is_vectorizable_expression(node_t *node, symbol_t *variable, node_t *body);
+static bool get_element_offset(node_t *element, symbol_t *variable, int64_t *offset);
+static bool has_loop_carried_dependence(node_t *node, node_t *body);
+static size_t count_references(node_t *node, symbol_t *symbol);
+static void find_memory_summaries(void);
+static void find_direct_accesses(node_t *node, symbol_t *function);
+static bool add_callee_accesses(node_t *node, symbol_t *function);
+static bool calls_access(node_t *node, symbol_t *global, bool **accesses);
+static bool calls_use(node_t *node, symbol_t *global);
+static void optimize_loops(node_t **slot, size_t loop_depth);
+static void optimize_loop(node_t **slot, size_t loop_depth);
+static bool find_invariants(node_t *loop, node_t **slot, bool unconditional);
+static void hoist_invariant(node_t **slot);
+static bool is_invariant_element(node_t *loop, node_t *element, bool unconditional);
+static bool writes_array(node_t *node, symbol_t *array);
+static bool contains_variable_element(node_t *node);
+static bool is_same_expression(node_t *a, node_t *b);
+static void reduce_products(node_t *loop, node_t **slot);
+static void hoist_array_bases(node_t **slot);
+static void promote_globals(node_t *loop);
+static void find_promotable_globals(node_t *node);
+static bool has_call_in_condition(node_t *node);
+static void replace_promoted_globals(node_t *node, node_t *statement);
+static symbol_t *get_promoted_variable(symbol_t *global);
+static bool match_reducible_product(node_t *loop, node_t *node, node_t **variable, node_t **factor, node_t **step);
+static node_t *get_induction_step(node_t *loop, symbol_t *symbol);
+static bool is_loop_invariant(node_t *loop, node_t *node);
+static size_t count_assignments(node_t *node, symbol_t *symbol);
+static node_t *find_assignment(node_t *node, symbol_t *symbol);
+static bool find_indexed_array(node_t *node, symbol_t *variable, node_t *factor, symbol_t **array);
+static symbol_t *get_reduction(node_t *loop, node_t *variable, node_t *factor, node_t *step, symbol_t *array);
+static symbol_t *find_reduction(symbol_t *variable, node_t *factor, symbol_t *array);
+static void eliminate_common_subexpressions(symbol_t *function);
+static void number_values_in_statement(node_t *statement);
+static void number_values_in_expression(node_t **slot, node_t *anchor, bool movable);
+static bool is_worth_numbering(node_t *node);
+static void reuse_value(size_t index, node_t **slot);
+static void kill_values(node_t *node);
+static void kill_values_changed_by(node_t *destination);
+static void kill_values_written_by_calls(node_t *calls);
+static bool is_written_by_calls(node_t *node, node_t *calls);
+static bool reads_memory(node_t *node);
+static bool reads_elements(node_t *node, symbol_t *array);
+static bool can_trap(node_t *node);
+static symbol_t *create_loop_variable(const char *prefix);
+static symbol_t *create_variable(const char *prefix);
+static bool insert_after(node_t *node, node_t *statement, node_t *new_statement);
+static node_t *insert_before(node_t *node, node_t *statement, node_t *new_statement);
+static node_t *new_identifier(symbol_t *symbol);
+static node_t *new_number(int64_t value);
+static node_t *new_expression(const char *operator, node_t *left, node_t *right);
+static node_t *new_assignment(symbol_t *variable, node_t *expression);
+static node_t *new_element(symbol_t *array, node_t *index);
+static node_t *new_relation(const char *operator, node_t *left, node_t *right);
+static node_t *new_statement(node_type_t type, node_t *first, node_t *second);
+static node_t *new_block(node_t **statements, size_t n_statements, node_t **declared, size_t n_declared);
+static void declare_in_block(node_t *block, node_t *identifier);
+static node_t *copy_operand(node_t *node);
+static bool is_same_operand(node_t *a, node_t *b);
+
+// An expression hoisted out of the loop, and the variable it is computed into
+typedef struct {
+    node_t *expression;
+    symbol_t *variable;
+} invariant_t;
+
+/**
+ * An induction variable of a loop multiplied by a factor that is invariant in the loop, kept in a
+ * variable of its own that is increased along with the induction variable. When every product is
+ * the index of an element of the same array, the variable holds the address of the element instead.
+ */
+typedef struct {
+    symbol_t *variable;
+    node_t *factor;  // A copy of the factor
+    symbol_t *array;  // NULL, unless the variable holds an address
+    symbol_t *reduced;
+} reduction_t;
+
+// A statement increasing a reduced variable, placed right after the induction variable is increased
+typedef struct {
+    node_t *after;
+    node_t *statement;
+} update_t;
+
+/**
+ * A value computed by an expression, which identical expressions evaluated while it is still available can reuse.
+ * The first time it is reused, the expression is moved into an assignment to a variable of its own, in front
+ * of the statement it was found in.
+ */
+typedef struct {
+    node_t *expression;
+    node_t **slot;       // Where the expression was found, until it is moved
+    node_t *anchor;      // The statement the assignment is placed in front of
+    symbol_t *variable;  // NULL until the value is reused
+    bool killed;         // Something the expression reads may have changed since
+} value_t;
+
+// The most syntax tree nodes a loop body may have after unrolling it
+#define MAX_UNROLLED_SIZE 160
+
+// Loops running at most this many times are unrolled completely, unless they can break out early
+#define MAX_FULL_UNROLL_TRIPS 8
+
+// The most syntax tree nodes the body of a vectorized loop may have, keeping it within the vector registers
+#define MAX_VECTORIZED_SIZE 48
+
+// Loops known to run fewer times than this are left to the scalar code
+#define MIN_VECTORIZED_TRIPS 8
+
+// Elements can be read this far away from the loop variable, keeping the displacement of the address small
+#define MAX_ELEMENT_OFFSET 4096
+
+// The fewest calls passing the same numbers that a function is specialized for
+#define MIN_SPECIALIZED_CALLS 2
+
+// The most syntax tree nodes the body of a specialized function may have, as it is copied for every specialization
+#define MAX_SPECIALIZED_SIZE 400
+
+// The deepest calls can be nested when evaluated at compile time, keeping the evaluator off the end of the stack
+#define MAX_EVALUATION_DEPTH 256
+
+/* State for the evaluation of calls at compile time, see evaluate_pure_calls */
+static bool *pure_functions;  // By sequence number
+static size_t evaluation_steps;  // Left for the call being evaluated
+static size_t evaluation_depth;
+static size_t n_evaluated_calls;
+
+// The entries of the table a memoized function keeps its results in, and how many entries after the one
+// its arguments hash to it looks through. The tables have room for the last ones to be looked through as well
+#define MEMO_TABLE_SIZE 1024
+#define MEMO_PROBES 8
+
+// Multiplies the hash of the arguments before the next one is added
+#define MEMO_HASH_FACTOR 1000003
+
+/* State for the specialization of functions on the numbers they are called with */
+static specialization_t *specializations;
+static size_t n_specializations;
+static node_t **specializable_calls;  // The calls passing numbers, and if a specialization has been chosen for them
+static bool *claimed_calls;
+static size_t n_specializable_calls;
+
+// How many times the numbers a variable, array, or function can hold grow, before they are taken to be any number
+#define MAX_RANGE_GROWTHS 4
+
+/* State for the analysis of the numbers stored in arrays, see narrow_arrays */
+static value_range_t *global_ranges;  // Of global variables, arrays, and what functions return, by sequence number
+static value_range_t **local_ranges;  // Of the parameters and local variables of each function
+static bool *stores_bits;  // For each array, if it is only assigned the numbers 0 and 1
+static bool ranges_changed;
+
+/* State for the inliner. Functions are visited once, after the functions they call */
+static enum { INLINE_NOT_VISITED, INLINE_VISITING, INLINE_DONE } *inline_states;
+static size_t *call_counts;
+
+/* State for the function whose body is copied in place of a call, see inline_call, or into a clone of it */
+static symbol_t *inlined_function;
+static node_t **inlined_values;  // What each parameter and local variable is replaced by, by sequence number
+static bool copies_declarations;  // The copy keeps the blocks declaring the local variables, see clone_function
+
+/* State for the loop body being copied by the unroller */
+static symbol_t *copied_variable;
+static int64_t copied_offset;
+static bool copied_as_number;
+
+/**
+ * The global variables and arrays each function may read and write, including through the functions it calls,
+ * indexed by the sequence numbers of the function and then the global, see find_memory_summaries
+ */
+static bool **function_reads;
+static bool **function_writes;
+
+/* State for the loop being optimized */
+static symbol_t *current_function;
+static size_t n_created_variables;
+
+static invariant_t *invariants;
+static size_t n_invariants;
+static bool in_loop_condition;
+
+static reduction_t *reductions;
+static size_t n_reductions;
+static update_t *updates;
+static size_t n_updates;
+// The array bases hoisted out of the loop, as pairs of an array and the variable holding its address
+static symbol_t *(*array_bases)[2];
+static size_t n_array_bases;
+// The global variables kept in local variables through the loop, as pairs of a global and its local, and the
+// statements that need the globals in memory, as they make calls or return, see promote_globals
+static symbol_t *(*promotions)[2];
+static size_t n_promotions;
+static node_t **escapes;
+static size_t n_escapes;
+
+/* State for the common subexpression elimination, see eliminate_common_subexpressions */
+static value_t *values;
+static size_t n_values, values_capacity;
+static size_t n_reused_values;
+
+// Statements placed in front of the loop, and the identifiers declaring the variables they assign.
+// The statements of the preheader only run if the loop is entered, as the third child of the loop
+static node_t **prologue;
+static size_t n_prologue;
+static node_t **preheader;
+static size_t n_preheader;
+static node_t **declarations;
+static size_t n_declarations;
+// Statements placed after the loop
+static node_t **epilogue;
+static size_t n_epilogue;
+
+/* External interface */
+
+void optimize_syntax_tree(void) {
+    if (evaluate_calls)
+        evaluate_pure_calls();
+    if (specialize_calls)
+        specialize_functions();
+    if (memoize_calls)
+        memoize_functions();
+    optimize_node(root);
+    if (inline_calls)
+        inline_functions();
+    if (array_narrowing)
+        narrow_arrays();
+    find_memory_summaries();
+
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+        current_function = global_symbols->symbols[i];
+        if (current_function->type != SYMBOL_FUNCTION)
+            continue;
+        if (vectorize_loops)
+            vectorize_for_loops(current_function->node->children[2]);
+        if (unroll_loops)
+            unroll_for_loops(current_function->node->children[2]);
+        optimize_loops(&current_function->node->children[2], 0);
+        if (common_subexpressions)
+            eliminate_common_subexpressions(current_function);
+    }
+    current_function = NULL;
+
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+        free(function_reads[i]);
+        free(function_writes[i]);
+    }
+    free(function_reads);
+    function_reads = NULL;
+    free(function_writes);
+    function_writes = NULL;
+}
+
+/* Inner workings */
+
+/* Applies the optimizations to every node of the tree, children first */
+static void optimize_node(node_t *node) {
+    if (node == NULL)
+        return;
+    for (size_t i = 0; i < node->n_children; i++)
+        optimize_node(node->children[i]);
+
+    if (node->type == BLOCK)
+        fold_constant_loop_bound(node);
+}
+
+/**
+ * A for-loop is lowered into the block
+ *     var <variable>, __FOR_END__
+ *     <variable> := <start>
+ *     __FOR_END__ := <end>
+ *     while <variable> < __FOR_END__ ...
+ * When the end is a number, the loop compares against it directly, and __FOR_END__ is never assigned
+ */
+static void fold_constant_loop_bound(node_t *block) {
+    if (block->n_children != 2)
+        return;
+    node_t *statement_list = block->children[1];
+    if (statement_list->n_children != 3)
+        return;
+
+    node_t *end_assignment = statement_list->children[1];
+    node_t *while_statement = statement_list->children[2];
+    if (end_assignment->type != ASSIGNMENT_STATEMENT || while_statement->type != WHILE_STATEMENT)
+        return;
+
+    node_t *end_variable = end_assignment->children[0];
+    node_t *end_value = end_assignment->children[1];
+    if (end_variable->type != IDENTIFIER_DATA || strcmp(end_variable->data, FOR_END_VARIABLE) != 0)
+        return;
+    if (end_value->type != NUMBER_DATA)
+        return;
+
+    node_t *relation = while_statement->children[0];
+    node_t *bound = relation->children[1];
+    if (bound->type != IDENTIFIER_DATA || bound->symbol != end_variable->symbol)
+        return;
+    // The variable can be named in the loop body as well, in which case it must keep its value
+    if (references_symbol(while_statement->children[1], end_variable->symbol))
+        return;
+
+    node_t *number = malloc(sizeof(node_t));
+    int64_t *value = malloc(sizeof(int64_t));
+    *value = *(int64_t *)end_value->data;
+    node_init(number, NUMBER_DATA, value, 0);
+    relation->children[1] = number;
+    destroy_subtree(bound);
+
+    destroy_subtree(end_assignment);
+    statement_list->children[1] = while_statement;
+    statement_list->n_children = 2;
+}
+
+static bool references_symbol(node_t *node, symbol_t *symbol) {
+    if (node->type == IDENTIFIER_DATA && node->symbol == symbol)
+        return true;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (references_symbol(node->children[i], symbol))
+            return true;
+    return false;
+}
+
+/**
+ * Replaces the calls passing only numbers to pure functions by the number they return, found by running
+ * the function at compile time. A function is pure when it prints nothing, uses no global variables or arrays,
+ * and only calls pure functions, so what it returns depends on its arguments alone. Calls are left for
+ * the program to make when running them takes more than evaluate_limit statements, nests calls too deep,
+ * or divides by zero. The arithmetic around a replaced call is folded, so calls passing the result can be
+ * replaced as well, and functions that are no longer called are removed afterwards.
+ */
+static void evaluate_pure_calls(void) {
+    find_pure_functions();
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION)
+            evaluate_calls_in(&symbol->node->children[2]);
+    }
+    free(pure_functions);
+    pure_functions = NULL;
+
+    if (n_evaluated_calls > 0)
+        remove_unused_globals();
+}
+
+/**
+ * Starts out with the functions printing nothing and using no global variables or arrays, and leaves out
+ * the ones calling anything but them, until the functions that are left only call each other
+ */
+static void find_pure_functions(void) {
+    size_t n_globals = global_symbols->n_symbols;
+    pure_functions = calloc(n_globals, sizeof(bool));
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type != SYMBOL_FUNCTION)
+            continue;
+        effects_t effects = {0};
+        find_effects(symbol->node->children[2], NULL, &effects);
+        pure_functions[symbol->sequence_number] = !effects.prints && !effects.reads_memory && !effects.writes_memory;
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < n_globals; i++) {
+            symbol_t *symbol = global_symbols->symbols[i];
+            if (pure_functions[symbol->sequence_number] && !calls_only_pure_functions(symbol->node->children[2])) {
+                pure_functions[symbol->sequence_number] = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool calls_only_pure_functions(node_t *node) {
+    if (is_call(node)) {
+        symbol_t *function = node->children[0]->symbol;
+        if (function->type != SYMBOL_FUNCTION || !pure_functions[function->sequence_number] ||
+            node->children[1]->n_children != function->node->children[1]->n_children)
+            return false;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (!calls_only_pure_functions(node->children[i]))
+            return false;
+    return true;
+}
+
+static bool is_evaluable_call(node_t *node) {
+    if (!is_call(node))
+        return false;
+    symbol_t *function = node->children[0]->symbol;
+    node_t *arguments = node->children[1];
+    if (function->type != SYMBOL_FUNCTION || !pure_functions[function->sequence_number] ||
+        arguments->n_children != function->node->children[1]->n_children)
+        return false;
+    for (size_t i = 0; i < arguments->n_children; i++)
+        if (arguments->children[i]->type != NUMBER_DATA)
+            return false;
+    return true;
+}
+
+/* Replaces the evaluable calls in the subtree held by the slot, innermost first */
+static void evaluate_calls_in(node_t **slot) {
+    node_t *node = *slot;
+    for (size_t i = 0; i < node->n_children; i++)
+        evaluate_calls_in(&node->children[i]);
+    if (node->type != EXPRESSION || node->data == NULL)
+        return;
+    if (!is_call(node)) {
+        fold_constants(slot);
+        return;
+    }
+    if (!is_evaluable_call(node))
+        return;
+
+    symbol_t *function = node->children[0]->symbol;
+    node_t *arguments = node->children[1];
+    int64_t *values = calloc(arguments->n_children + 1, sizeof(int64_t));
+    for (size_t i = 0; i < arguments->n_children; i++)
+        values[i] = *(int64_t *)arguments->children[i]->data;
+    int64_t result;
+    evaluation_steps = evaluate_limit;
+    bool evaluated = evaluate_call(function, values, &result);
+    free(values);
+    if (!evaluated)
+        return;
+
+    if (report_optimizations)
+        fprintf(stderr, "evaluate: call to '%s' replaced by %ld\n", function->name, result);
+    *slot = new_number(result);
+    destroy_subtree(node);
+    n_evaluated_calls++;
+}
+
+/* Runs the pure function with the arguments, returning false if it could not be run to the end */
+static bool evaluate_call(symbol_t *function, int64_t *arguments, int64_t *result) {
+    if (evaluation_depth == MAX_EVALUATION_DEPTH)
+        return false;
+    // The values of the parameters and local variables, by sequence number. Local variables start out as 0
+    size_t n_parameters = function->node->children[1]->n_children;
+    int64_t *frame = calloc(function->function_symtable->n_symbols + 1, sizeof(int64_t));
+    memcpy(frame, arguments, n_parameters * sizeof(int64_t));
+
+    // Functions return 0 when they reach their end
+    *result = 0;
+    evaluation_depth++;
+    evaluation_t evaluation = evaluate_statement(function->node->children[2], frame, result);
+    evaluation_depth--;
+    free(frame);
+    return evaluation == EVALUATION_NEXT || evaluation == EVALUATION_RETURN;
+}
+
+/* Runs the statement of a pure function, counting it against the steps left */
+static evaluation_t evaluate_statement(node_t *node, int64_t *frame, int64_t *result) {
+    if (evaluation_steps == 0)
+        return EVALUATION_FAILED;
+    evaluation_steps--;
+
+    switch (node->type) {
+        case BLOCK:
+            return evaluate_statement(node->children[node->n_children - 1], frame, result);
+        case STATEMENT_LIST:
+            for (size_t i = 0; i < node->n_children; i++) {
+                evaluation_t evaluation = evaluate_statement(node->children[i], frame, result);
+                if (evaluation != EVALUATION_NEXT)
+                    return evaluation;
+            }
+            return EVALUATION_NEXT;
+        case ASSIGNMENT_STATEMENT: {
+            // Pure functions only assign their own variables
+            symbol_t *variable = node->children[0]->symbol;
+            int64_t value;
+            if (!is_frame_variable(variable) || !evaluate_expression(node->children[1], frame, &value))
+                return EVALUATION_FAILED;
+            frame[variable->sequence_number] = value;
+            return EVALUATION_NEXT;
+        }
+        case RETURN_STATEMENT:
+            return evaluate_expression(node->children[0], frame, result) ? EVALUATION_RETURN : EVALUATION_FAILED;
+        case BREAK_STATEMENT:
+            return EVALUATION_BREAK;
+        case IF_STATEMENT: {
+            bool holds;
+            if (!evaluate_relation(node->children[0], frame, &holds))
+                return EVALUATION_FAILED;
+            if (holds)
+                return evaluate_statement(node->children[1], frame, result);
+            if (node->n_children == 3)
+                return evaluate_statement(node->children[2], frame, result);
+            return EVALUATION_NEXT;
+        }
+        case WHILE_STATEMENT:
+            for (;;) {
+                bool holds;
+                if (!evaluate_relation(node->children[0], frame, &holds))
+                    return EVALUATION_FAILED;
+                if (!holds)
+                    return EVALUATION_NEXT;
+                evaluation_t evaluation = evaluate_statement(node->children[1], frame, result);
+                if (evaluation == EVALUATION_BREAK)
+                    return EVALUATION_NEXT;
+                if (evaluation != EVALUATION_NEXT)
+                    return evaluation;
+            }
+        default:
+            return EVALUATION_FAILED;
+    }
+}
+
+static bool evaluate_relation(node_t *relation, int64_t *frame, bool *holds) {
+    int64_t left, right;
+    if (!evaluate_expression(relation->children[0], frame, &left) ||
+        !evaluate_expression(relation->children[1], frame, &right))
+        return false;
+    *holds = holds_for(relation->data, left, right);
+    return true;
+}
+
+/* Computes the value of an expression in a pure function, returning false if it traps or runs too long */
+static bool evaluate_expression(node_t *node, int64_t *frame, int64_t *value) {
+    switch (node->type) {
+        case NUMBER_DATA:
+            *value = *(int64_t *)node->data;
+            return true;
+        case IDENTIFIER_DATA:
+            if (!is_frame_variable(node->symbol))
+                return false;
+            *value = frame[node->symbol->sequence_number];
+            return true;
+        case EXPRESSION:
+            break;
+        default:
+            return false;
+    }
+    if (node->data == NULL)
+        return false;
+
+    int64_t operands[2] = {0, 0};
+    if (!is_call(node)) {
+        for (size_t i = 0; i < node->n_children; i++)
+            if (!evaluate_expression(node->children[i], frame, &operands[i]))
+                return false;
+        return apply_operator(node->data, node->n_children, operands[0], operands[1], value);
+    }
+
+    node_t *arguments = node->children[1];
+    int64_t *values = calloc(arguments->n_children + 1, sizeof(int64_t));
+    bool evaluated = true;
+    for (size_t i = 0; i < arguments->n_children && evaluated; i++)
+        evaluated = evaluate_expression(arguments->children[i], frame, &values[i]);
+    if (evaluated)
+        evaluated = evaluate_call(node->children[0]->symbol, values, value);
+    free(values);
+    return evaluated;
+}
+
+static bool is_frame_variable(symbol_t *symbol) {
+    return symbol->type == SYMBOL_PARAMETER || symbol->type == SYMBOL_LOCAL_VAR;
+}
+
+/**
+ * Makes pure functions that call themselves, directly or through other functions, and use what the calls
+ * return, keep what they return for the arguments they were called with. The results are kept in tables
+ * of global arrays, one for each parameter, one for the results and one marking the entries in use.
+ * The body becomes
+ *     var __memo_slot, __memo_probes, __memo_result
+ *     __memo_slot := <the hash of the arguments, from 0 to MEMO_TABLE_SIZE - 1>
+ *     while __memo_probes < MEMO_PROBES do begin
+ *         if used[__memo_slot] = 0 then break
+ *         if key0[__memo_slot] = <parameter 0> then if key1[__memo_slot] = ... then return results[__memo_slot]
+ *         __memo_slot := __memo_slot + 1
+ *         __memo_probes := __memo_probes + 1
+ *     end
+ *     if __memo_probes = MEMO_PROBES then __memo_slot := __memo_slot - MEMO_PROBES
+ *     <the body, where every return stores the result and arguments at __memo_slot first>
+ * so calls find the result of an earlier call in the first entry that is not in use, or replace the entry
+ * their arguments hash to when all of them are. Only functions that never assign their parameters are
+ * memoized, so the arguments are still there when the result is stored.
+ */
+static void memoize_functions(void) {
+    find_pure_functions();
+    size_t n_globals = global_symbols->n_symbols;
+    bool *memoized = calloc(n_globals, sizeof(bool));
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *function = global_symbols->symbols[i];
+        if (function->type != SYMBOL_FUNCTION || !pure_functions[function->sequence_number])
+            continue;
+        node_t *body = function->node->children[2];
+        if (!recurses_before_returning(body, function))
+            continue;
+        bool assigns_parameters = false;
+        for (size_t j = 0; j < function->node->children[1]->n_children; j++)
+            assigns_parameters |= count_assignments(body, function->function_symtable->symbols[j]) > 0;
+        memoized[i] = !assigns_parameters;
+    }
+    free(pure_functions);
+    pure_functions = NULL;
+
+    // The tables are added to the global symbols, after the functions
+    for (size_t i = 0; i < n_globals; i++) {
+        if (!memoized[i])
+            continue;
+        current_function = global_symbols->symbols[i];
+        memoize_function(current_function);
+        if (report_optimizations)
+            fprintf(stderr, "memoize: '%s' keeps its results in a table of %d entries\n", current_function->name,
+                    MEMO_TABLE_SIZE);
+    }
+    current_function = NULL;
+    free(memoized);
+}
+
+/* Returns true if the subtree calls the target, or a function that does. Visited functions are not looked at again */
+static bool reaches_function(node_t *node, symbol_t *target, bool *visited) {
+    if (is_call(node)) {
+        symbol_t *function = node->children[0]->symbol;
+        if (function == target)
+            return true;
+        if (function->type == SYMBOL_FUNCTION && !visited[function->sequence_number]) {
+            visited[function->sequence_number] = true;
+            if (reaches_function(function->node->children[2], target, visited))
+                return true;
+        }
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (reaches_function(node->children[i], target, visited))
+            return true;
+    return false;
+}
+
+/**
+ * Returns true if the subtree makes a call leading back to the function that is not returned right away.
+ * Functions only recursing by tail calls are loops, computing one result for every chain of calls,
+ * which gain nothing from being memoized, and would have to keep a stack frame for every call
+ */
+static bool recurses_before_returning(node_t *node, symbol_t *function) {
+    if (node->type == RETURN_STATEMENT && is_call(node->children[0]))
+        return recurses_before_returning(node->children[0]->children[1], function);
+    if (is_call(node)) {
+        symbol_t *callee = node->children[0]->symbol;
+        bool *visited = calloc(global_symbols->n_symbols, sizeof(bool));
+        bool recursive = callee == function ||
+                         (callee->type == SYMBOL_FUNCTION && reaches_function(callee->node->children[2], function, visited));
+        free(visited);
+        if (recursive)
+            return true;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (recurses_before_returning(node->children[i], function))
+            return true;
+    return false;
+}
+
+/* Places the lookup in front of the body of the current function, and the stores at its returns */
+static void memoize_function(symbol_t *function) {
+    node_t *parameters = function->node->children[1];
+    size_t n_parameters = parameters->n_children;
+    symbol_t **keys = malloc((n_parameters + 1) * sizeof(symbol_t *));
+    for (size_t i = 0; i < n_parameters; i++) {
+        char part[32];
+        snprintf(part, sizeof(part), "key%zu", i);
+        keys[i] = create_table(function->name, part);
+    }
+    symbol_t *results = create_table(function->name, "results");
+    symbol_t *used = create_table(function->name, "used");
+
+    symbol_t *slot = create_variable("memo_slot");
+    symbol_t *probes = create_variable("memo_probes");
+    symbol_t *result = create_variable("memo_result");
+    symbol_t **parameter_symbols = function->function_symtable->symbols;
+
+    // The hash is brought into the table with the remainder of dividing by its size, which is negative
+    // for negative hashes, like the division rounds towards zero
+    node_t *hash = n_parameters == 0 ? new_number(0) : new_identifier(parameter_symbols[0]);
+    for (size_t i = 1; i < n_parameters; i++)
+        hash = new_expression("+", new_expression("*", hash, new_number(MEMO_HASH_FACTOR)),
+                              new_identifier(parameter_symbols[i]));
+    node_t *hash_statements[3];
+    hash_statements[0] = new_assignment(slot, hash);
+    node_t *quotient = new_expression("/", new_identifier(slot), new_number(MEMO_TABLE_SIZE));
+    hash_statements[1] = new_assignment(slot, new_expression("-", new_identifier(slot),
+                                                             new_expression("*", quotient, new_number(MEMO_TABLE_SIZE))));
+    hash_statements[2] = new_statement(IF_STATEMENT, new_relation("<", new_identifier(slot), new_number(0)),
+                                       new_assignment(slot, new_expression("+", new_identifier(slot),
+                                                                           new_number(MEMO_TABLE_SIZE))));
+
+    // The keys are compared innermost first, ending in the return of the result
+    node_t *lookup = new_statement(RETURN_STATEMENT, new_element(results, new_identifier(slot)), NULL);
+    for (size_t i = n_parameters; i-- > 0;) {
+        node_t *relation = new_relation("=", new_element(keys[i], new_identifier(slot)),
+                                        new_identifier(parameter_symbols[i]));
+        lookup = new_statement(IF_STATEMENT, relation, lookup);
+    }
+    node_t *probe_statements[4] = {
+        new_statement(IF_STATEMENT, new_relation("=", new_element(used, new_identifier(slot)), new_number(0)),
+                      new_statement(BREAK_STATEMENT, NULL, NULL)),
+        lookup,
+        new_assignment(slot, new_expression("+", new_identifier(slot), new_number(1))),
+        new_assignment(probes, new_expression("+", new_identifier(probes), new_number(1))),
+    };
+    node_t *probe_condition = new_relation("<", new_identifier(probes), new_number(MEMO_PROBES));
+    node_t *evicted = new_statement(IF_STATEMENT, new_relation("=", new_identifier(probes), new_number(MEMO_PROBES)),
+                                    new_assignment(slot, new_expression("-", new_identifier(slot),
+                                                                        new_number(MEMO_PROBES))));
+
+    // Every return stores the result and the arguments, and the end of the function returns 0 like any return
+    node_t *body = function->node->children[2];
+    if (!always_returns(body)) {
+        node_t *return_zero = new_statement(RETURN_STATEMENT, new_number(0), NULL);
+        node_t *statements[2] = {body, return_zero};
+        body = new_block(statements, 2, NULL, 0);
+    }
+    node_t **stores = malloc((n_parameters + 2) * sizeof(node_t *));
+    for (size_t i = 0; i < n_parameters; i++) {
+        stores[i] = new_statement(ASSIGNMENT_STATEMENT, new_element(keys[i], new_identifier(slot)),
+                                  new_identifier(parameter_symbols[i]));
+    }
+    stores[n_parameters] = new_statement(ASSIGNMENT_STATEMENT, new_element(results, new_identifier(slot)),
+                                         new_identifier(result));
+    stores[n_parameters + 1] = new_statement(ASSIGNMENT_STATEMENT, new_element(used, new_identifier(slot)),
+                                             new_number(1));
+    store_returns(&body, stores, n_parameters + 2, result);
+    for (size_t i = 0; i < n_parameters + 2; i++)
+        destroy_subtree(stores[i]);
+    free(stores);
+
+    node_t *statements[6] = {
+        hash_statements[0],
+        hash_statements[1],
+        hash_statements[2],
+        new_statement(WHILE_STATEMENT, probe_condition, new_block(probe_statements, 4, NULL, 0)),
+        evicted,
+        body,
+    };
+    node_t *declared[3] = {slot->node, probes->node, result->node};
+    function->node->children[2] = new_block(statements, 6, declared, 3);
+    free(keys);
+}
+
+/* Creates a global array of the table a function is memoized in, named after the function */
+static symbol_t *create_table(const char *function, const char *part) {
+    node_t *identifier = malloc(sizeof(node_t));
+    node_t *declaration = malloc(sizeof(node_t));
+    node_init(declaration, ARRAY_DECLARATION, NULL, 2, identifier, new_number(MEMO_TABLE_SIZE + MEMO_PROBES));
+    symbol_t *table = malloc(sizeof(symbol_t));
+    table->type = SYMBOL_GLOBAL_ARRAY;
+    table->node = declaration;
+    table->element_width = ELEMENT_QUADWORD;
+    table->function_symtable = NULL;
+
+    // The name is numbered, skipping any that are taken
+    for (size_t number = 0;; number++) {
+        char name[256];
+        snprintf(name, sizeof(name), "__memo%zu_%s_%s", number, function, part);
+        node_init(identifier, IDENTIFIER_DATA, strdup(name), 0);
+        table->name = identifier->data;
+        if (symbol_table_insert(global_symbols, table) == INSERT_OK)
+            break;
+        free(identifier->data);
+        free(identifier->children);
+    }
+    identifier->symbol = table;
+
+    root->children = realloc(root->children, (root->n_children + 1) * sizeof(node_t *));
+    root->children[root->n_children++] = declaration;
+    return table;
+}
+
+/* Replaces every return <expression> in the subtree held by the slot by a block storing the result first */
+static void store_returns(node_t **slot, node_t **stores, size_t n_stores, symbol_t *result) {
+    node_t *node = *slot;
+    if (node->type != RETURN_STATEMENT) {
+        for (size_t i = 0; i < node->n_children; i++)
+            store_returns(&node->children[i], stores, n_stores, result);
+        return;
+    }
+
+    node_t **statements = malloc((n_stores + 2) * sizeof(node_t *));
+    statements[0] = new_assignment(result, node->children[0]);
+    for (size_t i = 0; i < n_stores; i++)
+        statements[i + 1] = copy_subtree(stores[i]);
+    node->children[0] = new_identifier(result);
+    statements[n_stores + 1] = node;
+    *slot = new_block(statements, n_stores + 2, NULL, 0);
+    free(statements);
+}
+
+/**
+ * Gives functions copies of their own for the numbers they are called with most often, with the numbers
+ * in place of the parameters, folded into the expressions using them, and the if-statements and loops
+ * they decide removed. The calls passing those numbers call the copy instead, without passing them.
+ * Combinations of numbers are chosen by the calls they match times the parameters they specialize, and each
+ * needs several calls no combination chosen before it matches. At most specialize_limit are chosen.
+ * Functions that are no longer called are removed afterwards.
+ */
+static void specialize_functions(void) {
+    size_t n_functions = global_symbols->n_symbols;
+    for (size_t i = 0; i < n_functions; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION)
+            find_specializations(symbol->node->children[2]);
+    }
+
+    qsort(specializations, n_specializations, sizeof(specialization_t), compare_specializations);
+    claimed_calls = calloc(n_specializable_calls, sizeof(bool));
+    size_t n_clones = 0;
+    for (size_t i = 0; i < n_specializations && n_clones < (size_t)specialize_limit; i++) {
+        specialization_t *specialization = &specializations[i];
+        size_t n_calls = 0;
+        for (size_t j = 0; j < n_specializable_calls; j++)
+            n_calls += !claimed_calls[j] && matches_specialization(specializable_calls[j], specialization);
+        if (n_calls < MIN_SPECIALIZED_CALLS)
+            continue;
+        for (size_t j = 0; j < n_specializable_calls; j++)
+            claimed_calls[j] |= matches_specialization(specializable_calls[j], specialization);
+
+        specialization->clone = clone_function(specialization);
+        n_clones++;
+        if (report_optimizations)
+            fprintf(stderr, "specialize: '%s' specialized as '%s' for %zu calls\n", specialization->function->name,
+                    specialization->clone->name, n_calls);
+    }
+
+    // The clones are redirected as well, which makes recursive calls passing the same numbers call themselves
+    for (size_t i = 0; i < global_symbols->n_symbols && n_clones > 0; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION)
+            redirect_specialized_calls(symbol->node->children[2]);
+    }
+
+    for (size_t i = 0; i < n_specializations; i++) {
+        free(specializations[i].specialized);
+        free(specializations[i].values);
+    }
+    free(specializations);
+    specializations = NULL;
+    n_specializations = 0;
+    free(specializable_calls);
+    specializable_calls = NULL;
+    free(claimed_calls);
+    claimed_calls = NULL;
+    n_specializable_calls = 0;
+
+    if (n_clones > 0)
+        remove_unused_globals();
+}
+
+/**
+ * Counts the calls in the subtree passing numbers to parameters that can be specialized. A call counts for
+ * the combination of all the numbers it passes, and for each of them alone, so calls passing the same number
+ * for one parameter, and different ones for another, can share a specialization
+ */
+static void find_specializations(node_t *node) {
+    for (size_t i = 0; i < node->n_children; i++)
+        find_specializations(node->children[i]);
+    if (!is_call(node))
+        return;
+    symbol_t *function = node->children[0]->symbol;
+    node_t *arguments = node->children[1];
+    if (function->type != SYMBOL_FUNCTION || arguments->n_children != function->node->children[1]->n_children)
+        return;
+    node_t *body = function->node->children[2];
+    if (count_nodes(body) > MAX_SPECIALIZED_SIZE)
+        return;
+
+    size_t n_parameters = arguments->n_children, n_numbers = 0;
+    bool *numbers = calloc(n_parameters, sizeof(bool));
+    for (size_t i = 0; i < n_parameters; i++) {
+        numbers[i] = arguments->children[i]->type == NUMBER_DATA &&
+                     count_assignments(body, function->function_symtable->symbols[i]) == 0;
+        n_numbers += numbers[i];
+    }
+    if (n_numbers > 0) {
+        specializable_calls = realloc(specializable_calls, (n_specializable_calls + 1) * sizeof(node_t *));
+        specializable_calls[n_specializable_calls++] = node;
+        count_specialization(node, numbers);
+    }
+    for (size_t i = 0; i < n_parameters && n_numbers > 1; i++) {
+        if (!numbers[i])
+            continue;
+        bool *single = calloc(n_parameters, sizeof(bool));
+        single[i] = true;
+        count_specialization(node, single);
+        free(single);
+    }
+    free(numbers);
+}
+
+/* Counts the call for the specialization of the parameters it passes numbers to, adding it if it is new */
+static void count_specialization(node_t *call, bool *specialized) {
+    symbol_t *function = call->children[0]->symbol;
+    node_t *arguments = call->children[1];
+    for (size_t i = 0; i < n_specializations; i++) {
+        specialization_t *specialization = &specializations[i];
+        if (specialization->function != function)
+            continue;
+        bool same = true;
+        for (size_t j = 0; j < arguments->n_children && same; j++)
+            same = specialized[j] == specialization->specialized[j] &&
+                   (!specialized[j] || *(int64_t *)arguments->children[j]->data == specialization->values[j]);
+        if (same) {
+            specialization->n_calls++;
+            return;
+        }
+    }
+
+    specializations = realloc(specializations, (n_specializations + 1) * sizeof(specialization_t));
+    specialization_t *specialization = &specializations[n_specializations];
+    *specialization = (specialization_t){.function = function, .n_calls = 1, .order = n_specializations};
+    specialization->specialized = malloc(arguments->n_children * sizeof(bool));
+    memcpy(specialization->specialized, specialized, arguments->n_children * sizeof(bool));
+    specialization->values = calloc(arguments->n_children, sizeof(int64_t));
+    for (size_t i = 0; i < arguments->n_children; i++) {
+        if (specialized[i])
+            specialization->values[i] = *(int64_t *)arguments->children[i]->data;
+        specialization->n_specialized += specialized[i];
+    }
+    n_specializations++;
+}
+
+/* Returns the cloned specialization matching the most numbers the call passes, or NULL if none matches */
+static specialization_t *find_specialization(node_t *call) {
+    specialization_t *best = NULL;
+    for (size_t i = 0; i < n_specializations; i++) {
+        specialization_t *specialization = &specializations[i];
+        if (specialization->clone != NULL && matches_specialization(call, specialization) &&
+            (best == NULL || specialization->n_specialized > best->n_specialized))
+            best = specialization;
+    }
+    return best;
+}
+
+/* Returns true if the call passes the numbers of the specialization, and maybe others */
+static bool matches_specialization(node_t *call, specialization_t *specialization) {
+    symbol_t *function = call->children[0]->symbol;
+    node_t *arguments = call->children[1];
+    if (function != specialization->function || arguments->n_children != function->node->children[1]->n_children)
+        return false;
+    for (size_t i = 0; i < arguments->n_children; i++) {
+        node_t *argument = arguments->children[i];
+        if (specialization->specialized[i] &&
+            (argument->type != NUMBER_DATA || *(int64_t *)argument->data != specialization->values[i]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Orders the specializations by their calls times the parameters they specialize, then by the parameters,
+ * keeping the order they were found in otherwise
+ */
+static int compare_specializations(const void *a, const void *b) {
+    const specialization_t *x = a, *y = b;
+    size_t x_score = x->n_calls * x->n_specialized, y_score = y->n_calls * y->n_specialized;
+    if (x_score != y_score)
+        return x_score > y_score ? -1 : 1;
+    if (x->n_specialized != y->n_specialized)
+        return x->n_specialized > y->n_specialized ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Creates a new function with the body of the specialized one, where the specialized parameters are replaced by
+ * their numbers, and the others and the local variables by symbols of its own
+ */
+static symbol_t *clone_function(specialization_t *specialization) {
+    symbol_t *function = specialization->function;
+    symbol_table_t *symbols = function->function_symtable;
+    size_t n_parameters = function->node->children[1]->n_children;
+
+    symbol_table_t *clone_symbols = symbol_table_init();
+    clone_symbols->hashmap->backup = global_symbols->hashmap;
+    node_t *parameter_list = malloc(sizeof(node_t));
+    node_init(parameter_list, PARAMETER_LIST, NULL, 0);
+
+    inlined_function = function;
+    inlined_values = calloc(symbols->n_symbols, sizeof(node_t *));
+    for (size_t i = 0; i < symbols->n_symbols; i++) {
+        if (i < n_parameters && specialization->specialized[i]) {
+            inlined_values[i] = new_number(specialization->values[i]);
+            continue;
+        }
+
+        node_t *identifier = malloc(sizeof(node_t));
+        node_init(identifier, IDENTIFIER_DATA, strdup(symbols->symbols[i]->name), 0);
+        symbol_t *symbol = malloc(sizeof(symbol_t));
+        symbol->name = identifier->data;
+        symbol->type = symbols->symbols[i]->type;
+        symbol->node = identifier;
+        symbol->function_symtable = clone_symbols;
+        if (symbol->type == SYMBOL_PARAMETER) {
+            symbol_table_insert(clone_symbols, symbol);
+            parameter_list->children = realloc(parameter_list->children, (parameter_list->n_children + 1) * sizeof(node_t *));
+            parameter_list->children[parameter_list->n_children++] = identifier;
+        } else {
+            // Local variables of different blocks can have the same name, so each gets a scope of its own
+            symbol_hashmap_t *scope = symbol_hashmap_init();
+            scope->backup = clone_symbols->hashmap;
+            clone_symbols->hashmap = scope;
+            symbol_table_insert(clone_symbols, symbol);
+            clone_symbols->hashmap = scope->backup;
+            symbol_hashmap_destroy(scope);
+        }
+        inlined_values[i] = new_identifier(symbol);
+    }
+
+    copies_declarations = true;
+    node_t *body = copy_subtree(function->node->children[2]);
+    copies_declarations = false;
+    for (size_t i = 0; i < symbols->n_symbols; i++)
+        destroy_subtree(inlined_values[i]);
+    free(inlined_values);
+    inlined_values = NULL;
+    inlined_function = NULL;
+    fold_constants(&body);
+    fold_constant_branches(&body);
+
+    // The name is numbered, skipping any that are taken
+    node_t *name = malloc(sizeof(node_t));
+    node_t *node = malloc(sizeof(node_t));
+    node_init(node, FUNCTION, NULL, 3, name, parameter_list, body);
+    symbol_t *clone = malloc(sizeof(symbol_t));
+    clone->type = SYMBOL_FUNCTION;
+    clone->node = node;
+    clone->function_symtable = clone_symbols;
+    for (size_t number = 0;; number++) {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "%s__%zu", function->name, number);
+        node_init(name, IDENTIFIER_DATA, strdup(buffer), 0);
+        clone->name = name->data;
+        if (symbol_table_insert(global_symbols, clone) == INSERT_OK)
+            break;
+        free(name->data);
+        free(name->children);
+    }
+    name->symbol = clone;
+
+    root->children = realloc(root->children, (root->n_children + 1) * sizeof(node_t *));
+    root->children[root->n_children++] = node;
+    return clone;
+}
+
+/* Makes the calls passing the numbers of a specialization call its clone, without passing them */
+static void redirect_specialized_calls(node_t *node) {
+    for (size_t i = 0; i < node->n_children; i++)
+        redirect_specialized_calls(node->children[i]);
+    if (!is_call(node))
+        return;
+    specialization_t *specialization = find_specialization(node);
+    if (specialization == NULL)
+        return;
+
+    node_t *identifier = node->children[0];
+    free(identifier->data);
+    identifier->data = strdup(specialization->clone->name);
+    identifier->symbol = specialization->clone;
+
+    node_t *arguments = node->children[1];
+    size_t n_kept = 0;
+    for (size_t i = 0; i < arguments->n_children; i++) {
+        if (specialization->specialized[i])
+            destroy_subtree(arguments->children[i]);
+        else
+            arguments->children[n_kept++] = arguments->children[i];
+    }
+    arguments->n_children = n_kept;
+}
+
+/* Replaces the if-statements and while-loops in the subtree that compare two numbers by what they run */
+static void fold_constant_branches(node_t **slot) {
+    node_t *node = *slot;
+    for (size_t i = 0; i < node->n_children; i++)
+        fold_constant_branches(&node->children[i]);
+    if (node->type != IF_STATEMENT && node->type != WHILE_STATEMENT)
+        return;
+    node_t *relation = node->children[0];
+    if (relation->children[0]->type != NUMBER_DATA || relation->children[1]->type != NUMBER_DATA)
+        return;
+
+    bool holds = holds_for(relation->data, *(int64_t *)relation->children[0]->data,
+                           *(int64_t *)relation->children[1]->data);
+
+    // A loop whose condition always holds can only be left by breaking out of it, and is kept
+    if (node->type == WHILE_STATEMENT && holds)
+        return;
+
+    node_t *kept = new_block(NULL, 0, NULL, 0);
+    size_t branch = holds ? 1 : 2;
+    if (node->type == IF_STATEMENT && branch < node->n_children) {
+        node_t *taken = node->children[branch];
+        node->children[branch] = kept;
+        kept = taken;
+    }
+    destroy_subtree(node);
+    *slot = kept;
+}
+
+/**
+ * Finds the numbers each global array can hold, and stores its elements in as few bits as fit them all:
+ * bytes, 16-bit words or 32-bit doublewords, loaded with sign extension, or single bits for arrays only
+ * assigned the numbers 0 and 1. The ranges of numbers are found for the whole program at once, starting
+ * with 0 for the globals and local variables, and nothing for parameters and what functions return.
+ * Every assignment, return and argument adds the numbers the expression can have to what it is assigned
+ * to, found from the numbers of its operands, until no range grows any more. Ranges that keep growing
+ * are taken to be every number, see MAX_RANGE_GROWTHS.
+ */
+static void narrow_arrays(void) {
+    size_t n_globals = global_symbols->n_symbols;
+    global_ranges = calloc(n_globals, sizeof(value_range_t));
+    local_ranges = calloc(n_globals, sizeof(value_range_t *));
+    stores_bits = calloc(n_globals, sizeof(bool));
+    symbol_t *first = NULL;
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        stores_bits[i] = true;
+        if (symbol->type != SYMBOL_FUNCTION)
+            continue;
+        global_ranges[i].empty = true;
+        symbol_table_t *symbols = symbol->function_symtable;
+        local_ranges[i] = calloc(symbols->n_symbols, sizeof(value_range_t));
+        for (size_t j = 0; j < symbols->n_symbols; j++)
+            local_ranges[i][j].empty = symbols->symbols[j]->type == SYMBOL_PARAMETER;
+
+        // The first function gets its arguments from the command line
+        if (first == NULL) {
+            first = symbol;
+            for (size_t j = 0; j < symbol->node->children[1]->n_children; j++)
+                local_ranges[i][j] = (value_range_t){.low = INT64_MIN, .high = INT64_MAX};
+        }
+        if (!always_returns(symbol->node->children[2]))
+            join_range(&global_ranges[i], (value_range_t){0});
+    }
+
+    do {
+        ranges_changed = false;
+        for (size_t i = 0; i < n_globals; i++) {
+            symbol_t *symbol = global_symbols->symbols[i];
+            if (symbol->type == SYMBOL_FUNCTION)
+                find_ranges(symbol->node->children[2], symbol);
+        }
+    } while (ranges_changed);
+
+    static const char *WIDTH_NAMES[] = {
+        [ELEMENT_DOUBLEWORD] = "doublewords", [ELEMENT_WORD] = "words", [ELEMENT_BYTE] = "bytes", [ELEMENT_BIT] = "bits"};
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type != SYMBOL_GLOBAL_ARRAY)
+            continue;
+        value_range_t range = global_ranges[i];
+        if (stores_bits[i] && fits_range(range, 0, 1))
+            symbol->element_width = ELEMENT_BIT;
+        else if (fits_range(range, INT8_MIN, INT8_MAX))
+            symbol->element_width = ELEMENT_BYTE;
+        else if (fits_range(range, INT16_MIN, INT16_MAX))
+            symbol->element_width = ELEMENT_WORD;
+        else if (fits_range(range, INT32_MIN, INT32_MAX))
+            symbol->element_width = ELEMENT_DOUBLEWORD;
+        else
+            continue;
+        if (report_optimizations)
+            fprintf(stderr, "narrow: array '%s' holds numbers from %ld to %ld, stored as %s\n", symbol->name,
+                    range.low, range.high, WIDTH_NAMES[symbol->element_width]);
+    }
+
+    for (size_t i = 0; i < n_globals; i++)
+        free(local_ranges[i]);
+    free(local_ranges);
+    local_ranges = NULL;
+    free(global_ranges);
+    global_ranges = NULL;
+    free(stores_bits);
+    stores_bits = NULL;
+}
+
+/* Adds the numbers assigned and returned in the subtree of the function to the ranges they go to */
+static void find_ranges(node_t *node, symbol_t *function) {
+    switch (node->type) {
+        case ASSIGNMENT_STATEMENT: {
+            node_t *destination = node->children[0];
+            node_t *expression = node->children[1];
+            value_range_t values = get_range(expression, function);
+            if (destination->type == ARRAY_INDEXING) {
+                symbol_t *array = destination->children[0]->symbol;
+                get_range(destination->children[1], function);
+                if (array->type != SYMBOL_GLOBAL_ARRAY)
+                    return;
+                join_range(&global_ranges[array->sequence_number], values);
+                if (expression->type != NUMBER_DATA || (*(int64_t *)expression->data != 0 && *(int64_t *)expression->data != 1))
+                    stores_bits[array->sequence_number] = false;
+                return;
+            }
+            value_range_t *range = get_variable_range(destination->symbol, function);
+            if (range != NULL)
+                join_range(range, values);
+            return;
+        }
+        case RETURN_STATEMENT:
+            join_range(&global_ranges[function->sequence_number], get_range(node->children[0], function));
+            return;
+        case DECLARATION_LIST:
+            return;
+        case EXPRESSION:
+        case IDENTIFIER_DATA:
+        case NUMBER_DATA:
+        case ARRAY_INDEXING:
+            get_range(node, function);
+            return;
+        default:
+            for (size_t i = 0; i < node->n_children; i++)
+                find_ranges(node->children[i], function);
+    }
+}
+
+/**
+ * Returns the numbers the expression can have, given the ranges found so far. The arguments of calls
+ * are added to the ranges of the parameters they are passed to
+ */
+static value_range_t get_range(node_t *node, symbol_t *function) {
+    static const value_range_t ANY = {.low = INT64_MIN, .high = INT64_MAX};
+    switch (node->type) {
+        case NUMBER_DATA: {
+            int64_t value = *(int64_t *)node->data;
+            return (value_range_t){.low = value, .high = value};
+        }
+        case IDENTIFIER_DATA: {
+            value_range_t *range = get_variable_range(node->symbol, function);
+            return range != NULL ? *range : ANY;
+        }
+        case ARRAY_INDEXING:
+            get_range(node->children[1], function);
+            if (node->children[0]->symbol->type != SYMBOL_GLOBAL_ARRAY)
+                return ANY;
+            return global_ranges[node->children[0]->symbol->sequence_number];
+        case EXPRESSION:
+            break;
+        default:
+            return ANY;
+    }
+
+    if (is_call(node)) {
+        symbol_t *callee = node->children[0]->symbol;
+        node_t *arguments = node->children[1];
+        bool known = callee->type == SYMBOL_FUNCTION && arguments->n_children == callee->node->children[1]->n_children;
+        for (size_t i = 0; i < arguments->n_children; i++) {
+            value_range_t values = get_range(arguments->children[i], function);
+            if (known)
+                join_range(&local_ranges[callee->sequence_number][i], values);
+        }
+        return known ? global_ranges[callee->sequence_number] : ANY;
+    }
+
+    value_range_t operands[2];
+    for (size_t i = 0; i < node->n_children; i++) {
+        operands[i] = get_range(node->children[i], function);
+        if (operands[i].empty)
+            return operands[i];
+    }
+    if (node->data == NULL || node->n_children == 0)
+        return ANY;
+
+    // The remainder a - a / c * c is smaller than c, and has the sign of a
+    int64_t divisor;
+    if (is_remainder(node, &divisor) && divisor != INT64_MIN) {
+        int64_t largest = (divisor < 0 ? -divisor : divisor) - 1;
+        value_range_t dividend = get_range(node->children[0], function);
+        return (value_range_t){.low = dividend.low >= 0 ? 0 : -largest, .high = dividend.high <= 0 ? 0 : largest};
+    }
+
+    // The ranges are computed in 128 bits, so the results that do not fit in 64 bits are known to wrap around
+    const char *operator = node->data;
+    __int128 low, high;
+    if (node->n_children == 1 && strcmp(operator, "-") == 0) {
+        low = -(__int128)operands[0].high;
+        high = -(__int128)operands[0].low;
+    } else if (node->n_children == 1) {
+        return ANY;
+    } else if (strcmp(operator, "+") == 0 || strcmp(operator, "-") == 0) {
+        bool add = operator[0] == '+';
+        low = (__int128)operands[0].low + (add ? (__int128)operands[1].low : -(__int128)operands[1].high);
+        high = (__int128)operands[0].high + (add ? (__int128)operands[1].high : -(__int128)operands[1].low);
+    } else if (strcmp(operator, "*") == 0) {
+        __int128 products[4] = {
+            (__int128)operands[0].low * operands[1].low, (__int128)operands[0].low * operands[1].high,
+            (__int128)operands[0].high * operands[1].low, (__int128)operands[0].high * operands[1].high};
+        low = high = products[0];
+        for (size_t i = 1; i < 4; i++) {
+            low = products[i] < low ? products[i] : low;
+            high = products[i] > high ? products[i] : high;
+        }
+    } else if (strcmp(operator, "/") == 0) {
+        // Dividing never makes a number larger, except for the one division that traps
+        __int128 largest = -(__int128)operands[0].low > operands[0].high ? -(__int128)operands[0].low : operands[0].high;
+        low = operands[0].low >= 0 && operands[1].low >= 0 ? 0 : -largest;
+        high = operands[0].low >= 0 && operands[1].low >= 0 ? operands[0].high : largest;
+    } else {
+        return ANY;
+    }
+    if (low < INT64_MIN || high > INT64_MAX)
+        return ANY;
+    return (value_range_t){.low = (int64_t)low, .high = (int64_t)high};
+}
+
+/* Returns the range of a variable the analysis follows, or NULL for the ones that can be any number */
+static value_range_t *get_variable_range(symbol_t *symbol, symbol_t *function) {
+    switch (symbol->type) {
+        case SYMBOL_GLOBAL_VAR:
+            return &global_ranges[symbol->sequence_number];
+        case SYMBOL_PARAMETER:
+        case SYMBOL_LOCAL_VAR:
+            return &local_ranges[function->sequence_number][symbol->sequence_number];
+        default:
+            return NULL;
+    }
+}
+
+/* Adds the numbers to the range, giving up on ranges that keep growing */
+static void join_range(value_range_t *range, value_range_t values) {
+    if (values.empty)
+        return;
+    if (!range->empty && values.low >= range->low && values.high <= range->high)
+        return;
+
+    int growths = range->growths + 1;
+    if (range->empty)
+        *range = values;
+    else if (growths > MAX_RANGE_GROWTHS)
+        *range = (value_range_t){.low = INT64_MIN, .high = INT64_MAX};
+    else
+        *range = (value_range_t){.low = values.low < range->low ? values.low : range->low,
+                                 .high = values.high > range->high ? values.high : range->high};
+    range->growths = growths;
+    ranges_changed = true;
+}
+
+/* Returns true if the node is a - a / c * c, or a - c * (a / c), for a number c, placed in divisor */
+static bool is_remainder(node_t *node, int64_t *divisor) {
+    if (node->n_children != 2 || strcmp(node->data, "-") != 0)
+        return false;
+    node_t *product = node->children[1];
+    if (product->type != EXPRESSION || product->n_children != 2 || strcmp(product->data, "*") != 0)
+        return false;
+    for (size_t side = 0; side < 2; side++) {
+        node_t *quotient = product->children[side];
+        node_t *factor = product->children[1 - side];
+        if (quotient->type != EXPRESSION || quotient->n_children != 2 || strcmp(quotient->data, "/") != 0 ||
+            factor->type != NUMBER_DATA)
+            continue;
+        node_t *quotient_divisor = quotient->children[1];
+        if (quotient_divisor->type == NUMBER_DATA && *(int64_t *)quotient_divisor->data == *(int64_t *)factor->data &&
+            *(int64_t *)factor->data != 0 && is_same_expression(quotient->children[0], node->children[0])) {
+            *divisor = *(int64_t *)factor->data;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool fits_range(value_range_t range, int64_t low, int64_t high) {
+    return range.low >= low && range.high <= high;
+}
+
+/* Returns true for global arrays of 64-bit elements, which vectors and pointers can be used to access */
+static bool is_quadword_array(symbol_t *symbol) {
+    return symbol->type == SYMBOL_GLOBAL_ARRAY && symbol->element_width == ELEMENT_QUADWORD;
+}
+
+/**
+ * Inlines calls in every function, visiting the functions called by a function before the function itself,
+ * so the bodies that are copied into it have had their own calls inlined already.
+ * Small functions making no calls are inlined at every call, and functions called from a single place
+ * are inlined there, whatever their size, as long as their body can be moved in front of the call, see can_inline.
+ */
+static void inline_functions(void) {
+    size_t n_globals = global_symbols->n_symbols;
+    inline_states = calloc(n_globals, sizeof(*inline_states));
+    call_counts = calloc(n_globals, sizeof(size_t));
+
+    // The first function is called when the program starts, besides any calls in the program
+    symbol_t *first = NULL;
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type != SYMBOL_FUNCTION)
+            continue;
+        if (first == NULL)
+            first = symbol;
+        count_calls(symbol->node->children[2]);
+    }
+    if (first != NULL)
+        call_counts[first->sequence_number]++;
+
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION && inline_states[symbol->sequence_number] == INLINE_NOT_VISITED)
+            inline_calls_in(symbol);
+    }
+
+    free(inline_states);
+    inline_states = NULL;
+    free(call_counts);
+    call_counts = NULL;
+}
+
+static void count_calls(node_t *node) {
+    if (is_call(node) && node->children[0]->symbol->type == SYMBOL_FUNCTION)
+        call_counts[node->children[0]->symbol->sequence_number]++;
+    for (size_t i = 0; i < node->n_children; i++)
+        count_calls(node->children[i]);
+}
+
+static bool is_call(node_t *node) {
+    return node->type == EXPRESSION && node->data != NULL && strcmp(node->data, "call") == 0;
+}
+
+static void inline_calls_in(symbol_t *function) {
+    inline_states[function->sequence_number] = INLINE_VISITING;
+    visit_callees(function->node->children[2]);
+
+    current_function = function;
+    inline_statements(&function->node->children[2]);
+    current_function = NULL;
+
+    move_returns_last(function->node->children[2]);
+    inline_states[function->sequence_number] = INLINE_DONE;
+}
+
+static void visit_callees(node_t *node) {
+    if (is_call(node)) {
+        symbol_t *callee = node->children[0]->symbol;
+        if (callee->type == SYMBOL_FUNCTION && inline_states[callee->sequence_number] == INLINE_NOT_VISITED)
+            inline_calls_in(callee);
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        visit_callees(node->children[i]);
+}
+
+/* Inlines the calls of the statements in the subtree held by the slot, until none of them can be inlined */
+static void inline_statements(node_t **slot) {
+    node_t *node = *slot;
+    switch (node->type) {
+        case ASSIGNMENT_STATEMENT:
+        case RETURN_STATEMENT:
+        case PRINT_STATEMENT:
+        case IF_STATEMENT: {
+            node_t **call = find_inlinable_call(node, node);
+            if (call != NULL) {
+                inline_call(slot, call);
+                // The statement is now last in a block, after the inlined body, which may hold calls of its own
+                inline_statements(slot);
+                return;
+            }
+            if (node->type == IF_STATEMENT)
+                for (size_t i = 1; i < node->n_children; i++)
+                    inline_statements(&node->children[i]);
+            return;
+        }
+        case WHILE_STATEMENT:
+            // The condition is evaluated again in every iteration, so nothing can be moved in front of it
+            inline_statements(&node->children[1]);
+            return;
+        default:
+            for (size_t i = 0; i < node->n_children; i++)
+                inline_statements(&node->children[i]);
+            return;
+    }
+}
+
+/**
+ * Returns the slot of the first call in the part of the statement evaluated before the statement does anything,
+ * that can be inlined, or NULL if there is none. Node is the part of the statement being searched
+ */
+static node_t **find_inlinable_call(node_t *statement, node_t *node) {
+    // Only the condition of an if statement is evaluated up front
+    size_t n_children = node->type == IF_STATEMENT ? 1 : node->n_children;
+    for (size_t i = 0; i < n_children; i++) {
+        node_t *child = node->children[i];
+        if (is_call(child) && can_inline(statement, child))
+            return &node->children[i];
+        node_t **call = find_inlinable_call(statement, child);
+        if (call != NULL)
+            return call;
+    }
+    return NULL;
+}
+
+/**
+ * Returns true if the call can be replaced by the body of the function it calls, placed in front of the statement.
+ * The body is placed in front of any other part of the statement, which must not make that observable
+ */
+static bool can_inline(node_t *statement, node_t *call) {
+    symbol_t *callee = call->children[0]->symbol;
+    if (callee->type != SYMBOL_FUNCTION || callee == current_function || inline_limit == 0)
+        return false;
+    if (inline_states[callee->sequence_number] != INLINE_DONE)
+        return false;
+    // Calls with the wrong number of arguments are reported by the generator
+    node_t *body = callee->node->children[2];
+    if (call->children[1]->n_children != callee->node->children[1]->n_children)
+        return false;
+
+    bool is_small = count_nodes(body) <= (size_t)inline_limit && !contains_call(body);
+    if (!is_small && call_counts[callee->sequence_number] != 1)
+        return false;
+    if (!returns_only_last(body, true) || breaks_out(body))
+        return false;
+
+    // Only the arguments are moved when the body is a single return, as its expression replaces the call
+    effects_t moved = {0}, others = {0};
+    find_effects(call->children[1], NULL, &moved);
+    if (get_returned_expression(body) == NULL)
+        find_effects(body, NULL, &moved);
+    find_effects(statement->type == IF_STATEMENT ? statement->children[0] : statement, call, &others);
+
+    if (others.makes_call && (moved.makes_call || moved.prints || moved.reads_memory || moved.writes_memory))
+        return false;
+    if ((moved.makes_call || moved.writes_memory) && others.reads_memory)
+        return false;
+    // The items of a print statement are printed one at a time
+    if ((moved.makes_call || moved.prints) && statement->type == PRINT_STATEMENT &&
+        !references_node(statement->children[0], call))
+        return false;
+    return true;
+}
+
+/* Finds what evaluating the subtree does, leaving out the excluded subtree */
+static void find_effects(node_t *node, node_t *excluded, effects_t *effects) {
+    if (node == excluded)
+        return;
+    switch (node->type) {
+        case PRINT_STATEMENT:
+            effects->prints = true;
+            break;
+        case ASSIGNMENT_STATEMENT: {
+            node_t *destination = node->children[0];
+            if (destination->type != IDENTIFIER_DATA || destination->symbol->type == SYMBOL_GLOBAL_VAR)
+                effects->writes_memory = true;
+            // The destination is only written, but the index of an element is read
+            for (size_t i = 0; i < destination->n_children; i++)
+                find_effects(destination->children[i], excluded, effects);
+            find_effects(node->children[1], excluded, effects);
+            return;
+        }
+        case ARRAY_INDEXING:
+            effects->reads_memory = true;
+            break;
+        case IDENTIFIER_DATA:
+            if (node->symbol != NULL && node->symbol->type == SYMBOL_GLOBAL_VAR)
+                effects->reads_memory = true;
+            break;
+        case EXPRESSION:
+            if (is_call(node))
+                effects->makes_call = true;
+            break;
+        default:
+            break;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        find_effects(node->children[i], excluded, effects);
+}
+
+static bool references_node(node_t *node, node_t *target) {
+    if (node == target)
+        return true;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (references_node(node->children[i], target))
+            return true;
+    return false;
+}
+
+/**
+ * Replaces the call in the slot by the body of the function it calls, turning the statement into the block
+ *     var <parameters>, <local variables>, <result>
+ *     <parameter> := <argument>, for each argument, from right to left like a call
+ *     <local variable> := 0, for those that could be read before they are assigned
+ *     <body, with every return <expression> replaced by <result> := <expression>>
+ *     <statement, with the call replaced by <result>>
+ * Arguments that are numbers or local variables are used directly, for parameters that are never assigned.
+ * When the body is a single return, its expression replaces the call instead. A statement returning the call
+ * is replaced by the body with its returns kept, so any calls they return are still tail calls.
+ */
+static void inline_call(node_t **slot, node_t **call_slot) {
+    node_t *call = *call_slot;
+    symbol_t *callee = call->children[0]->symbol;
+    node_t *arguments = call->children[1];
+    node_t *body = callee->node->children[2];
+    symbol_table_t *symbols = callee->function_symtable;
+
+    inlined_function = callee;
+    inlined_values = calloc(symbols->n_symbols, sizeof(node_t *));
+    node_t **statements = NULL;
+    size_t n_statements = 0;
+    n_declarations = 0;
+
+    for (size_t i = arguments->n_children; i-- > 0;) {
+        node_t *argument = arguments->children[i];
+        symbol_t *parameter = symbols->symbols[i];
+        bool is_local = argument->type == IDENTIFIER_DATA &&
+                        (argument->symbol->type == SYMBOL_LOCAL_VAR || argument->symbol->type == SYMBOL_PARAMETER);
+        if ((argument->type == NUMBER_DATA || is_local) && count_assignments(body, parameter) == 0) {
+            inlined_values[i] = copy_operand(argument);
+            continue;
+        }
+        symbol_t *variable = create_loop_variable("INLINED");
+        inlined_values[i] = new_identifier(variable);
+        statements = realloc(statements, (n_statements + 1) * sizeof(node_t *));
+        statements[n_statements++] = new_assignment(variable, argument);
+        arguments->children[i] = NULL;
+    }
+
+    for (size_t i = arguments->n_children; i < symbols->n_symbols; i++) {
+        symbol_t *local = symbols->symbols[i];
+        if (!references_symbol(body, local))
+            continue;
+        symbol_t *variable = create_loop_variable("INLINED");
+        inlined_values[i] = new_identifier(variable);
+        // The caller zeroes its own variables once, while the callee starts with new ones in every call
+        if (!is_assigned_first(body, local)) {
+            statements = realloc(statements, (n_statements + 1) * sizeof(node_t *));
+            statements[n_statements++] = new_assignment(variable, new_number(0));
+        }
+    }
+
+    node_t *returned = get_returned_expression(body);
+    bool keeps_returns = returned == NULL && (*slot)->type == RETURN_STATEMENT && (*slot)->children[0] == call;
+    node_t *result = NULL;
+    if (returned != NULL) {
+        result = copy_subtree(returned);
+        fold_constants(&result);
+    } else if (keeps_returns) {
+        statements = realloc(statements, (n_statements + 2) * sizeof(node_t *));
+        node_t *copy = copy_subtree(body);
+        fold_constants(&copy);
+        statements[n_statements++] = copy;
+        if (!always_returns(body)) {
+            node_t *return_zero = malloc(sizeof(node_t));
+            node_init(return_zero, RETURN_STATEMENT, NULL, 1, new_number(0));
+            statements[n_statements++] = return_zero;
+        }
+    } else {
+        symbol_t *variable = create_loop_variable("INLINED");
+        statements = realloc(statements, (n_statements + 2) * sizeof(node_t *));
+        // A function reaching its end without returning returns 0
+        if (!always_returns(body))
+            statements[n_statements++] = new_assignment(variable, new_number(0));
+        node_t *copy = copy_subtree(body);
+        replace_returns(copy, variable);
+        fold_constants(&copy);
+        statements[n_statements++] = copy;
+        result = new_identifier(variable);
+    }
+
+    if (report_optimizations)
+        fprintf(stderr, "inline: '%s' inlined into '%s'%s\n", callee->name, current_function->name,
+                call_counts[callee->sequence_number] == 1 ? ", its only call" : "");
+
+    if (keeps_returns) {
+        destroy_subtree(*slot);
+        *slot = new_block(statements, n_statements, declarations, n_declarations);
+    } else {
+        destroy_subtree(call);
+        *call_slot = result;
+        if (n_statements > 0) {
+            statements = realloc(statements, (n_statements + 1) * sizeof(node_t *));
+            statements[n_statements++] = *slot;
+            *slot = new_block(statements, n_statements, declarations, n_declarations);
+        }
+    }
+
+    for (size_t i = 0; i < symbols->n_symbols; i++)
+        if (inlined_values[i] != NULL)
+            destroy_subtree(inlined_values[i]);
+    free(inlined_values);
+    inlined_values = NULL;
+    inlined_function = NULL;
+    free(statements);
+    free(declarations);
+    declarations = NULL;
+    n_declarations = 0;
+}
+
+/* Returns the expression of a body that is nothing but a return statement, or NULL */
+static node_t *get_returned_expression(node_t *body) {
+    while (body->type == BLOCK || (body->type == STATEMENT_LIST && body->n_children == 1))
+        body = body->children[body->n_children - 1];
+    return body->type == RETURN_STATEMENT ? body->children[0] : NULL;
+}
+
+/* Returns true if every return in the statement is the last thing the function does, given last for the statement */
+static bool returns_only_last(node_t *node, bool last) {
+    switch (node->type) {
+        case RETURN_STATEMENT:
+            return last;
+        case BLOCK:
+            return returns_only_last(node->children[node->n_children - 1], last);
+        case STATEMENT_LIST:
+            for (size_t i = 0; i < node->n_children; i++)
+                if (!returns_only_last(node->children[i], last && i == node->n_children - 1))
+                    return false;
+            return true;
+        case IF_STATEMENT:
+            for (size_t i = 1; i < node->n_children; i++)
+                if (!returns_only_last(node->children[i], last))
+                    return false;
+            return true;
+        case WHILE_STATEMENT:
+            return returns_only_last(node->children[1], false);
+        default:
+            return true;
+    }
+}
+
+/* Returns true if every path through the statement ends in a return */
+static bool always_returns(node_t *node) {
+    switch (node->type) {
+        case RETURN_STATEMENT:
+            return true;
+        case BLOCK:
+            return always_returns(node->children[node->n_children - 1]);
+        case STATEMENT_LIST:
+            for (size_t i = 0; i < node->n_children; i++)
+                if (always_returns(node->children[i]))
+                    return true;
+            return false;
+        case IF_STATEMENT:
+            return node->n_children == 3 && always_returns(node->children[1]) && always_returns(node->children[2]);
+        default:
+            return false;
+    }
+}
+
+/**
+ * Moves the statements after an if statement whose then branch always returns into its else branch,
+ * and removes the statements after one that always returns, which can not be reached.
+ * This makes every return the last thing the function does, in the common ways of returning early
+ */
+static void move_returns_last(node_t *node) {
+    for (size_t i = 0; i < node->n_children; i++)
+        move_returns_last(node->children[i]);
+    if (node->type != STATEMENT_LIST)
+        return;
+
+    for (size_t i = 0; i + 1 < node->n_children; i++) {
+        node_t *statement = node->children[i];
+        if (always_returns(statement)) {
+            for (size_t j = i + 1; j < node->n_children; j++)
+                destroy_subtree(node->children[j]);
+            node->n_children = i + 1;
+            return;
+        }
+        if (statement->type == IF_STATEMENT && statement->n_children == 2 && always_returns(statement->children[1])) {
+            statement->children = realloc(statement->children, 3 * sizeof(node_t *));
+            statement->children[2] = new_block(&node->children[i + 1], node->n_children - i - 1, NULL, 0);
+            statement->n_children = 3;
+            node->n_children = i + 1;
+            move_returns_last(statement->children[2]);
+            return;
+        }
+    }
+}
+
+/* Returns true if the symbol is a parameter or local variable of the function being inlined */
+static bool is_inlined_variable(symbol_t *symbol) {
+    if (inlined_function == NULL || (symbol->type != SYMBOL_PARAMETER && symbol->type != SYMBOL_LOCAL_VAR))
+        return false;
+    // Parameters do not know their symbol table, so the symbol is looked for by its sequence number
+    symbol_table_t *symbols = inlined_function->function_symtable;
+    return symbol->sequence_number < symbols->n_symbols && symbols->symbols[symbol->sequence_number] == symbol;
+}
+
+/* Replaces every return <expression> in the subtree by <variable> := <expression> */
+static void replace_returns(node_t *node, symbol_t *variable) {
+    if (node->type == RETURN_STATEMENT) {
+        node->type = ASSIGNMENT_STATEMENT;
+        node->children = realloc(node->children, 2 * sizeof(node_t *));
+        node->children[1] = node->children[0];
+        node->children[0] = new_identifier(variable);
+        node->n_children = 2;
+        return;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        replace_returns(node->children[i], variable);
+}
+
+/* Returns true if the first statement of the body naming the variable assigns it, without reading it */
+static bool is_assigned_first(node_t *node, symbol_t *variable) {
+    if (node->type == BLOCK)
+        return is_assigned_first(node->children[node->n_children - 1], variable);
+    if (node->type == STATEMENT_LIST) {
+        for (size_t i = 0; i < node->n_children; i++)
+            if (references_symbol(node->children[i], variable))
+                return is_assigned_first(node->children[i], variable);
+        return false;
+    }
+    return node->type == ASSIGNMENT_STATEMENT && node->children[0]->type == IDENTIFIER_DATA &&
+           node->children[0]->symbol == variable && !references_symbol(node->children[1], variable);
+}
+
+/* Unrolls the for-loops in the subtree, starting with the innermost ones */
+static void unroll_for_loops(node_t *node) {
+    for (size_t i = 0; i < node->n_children; i++)
+        unroll_for_loops(node->children[i]);
+    if (node->type == BLOCK)
+        unroll_for_loop(node);
+}
+
+/**
+ * Unrolls a lowered for-loop with constant bounds, see fold_constant_loop_bound, that never assigns its variable.
+ * Short loops are replaced by a copy of the body for each iteration, with the variable replaced by its value.
+ * Otherwise, each iteration runs the body unroll_factor times, with the variable replaced by <variable> + 1,
+ * <variable> + 2, ..., and a remainder loop runs the last iterations one at a time:
+ *     while <variable> < <end> - <factor> + 1 begin
+ *         <body>
+ *         <body, with <variable> + 1>
+ *         ...
+ *         <variable> := <variable> + <factor>
+ *     end
+ *     while <variable> < <end> begin <body> <variable> := <variable> + 1 end
+ * Breaking out of the unrolled loop would skip past it into the remainder loop, so loops that can
+ * break use a factor dividing the number of iterations, with no remainder loop.
+ * Smaller factors are used when the body would grow larger than MAX_UNROLLED_SIZE.
+ */
+static void unroll_for_loop(node_t *block) {
+    if (block->n_children != 2 || block->children[1]->n_children != 2)
+        return;
+    node_t *statement_list = block->children[1];
+    node_t *initialization = statement_list->children[0];
+    node_t *loop = statement_list->children[1];
+    if (initialization->type != ASSIGNMENT_STATEMENT || loop->type != WHILE_STATEMENT || loop->n_children != 2)
+        return;
+
+    node_t *variable = initialization->children[0];
+    node_t *start = initialization->children[1];
+    node_t *relation = loop->children[0];
+    if (variable->type != IDENTIFIER_DATA || start->type != NUMBER_DATA || strcmp(relation->data, "<") != 0)
+        return;
+    node_t *compared = relation->children[0];
+    node_t *end = relation->children[1];
+    if (compared->type != IDENTIFIER_DATA || compared->symbol != variable->symbol || end->type != NUMBER_DATA)
+        return;
+
+    // The loop body is a block of the body of the for-loop, followed by <variable> := <variable> + 1
+    node_t *loop_block = loop->children[1];
+    if (loop_block->type != BLOCK || loop_block->n_children != 1 || loop_block->children[0]->n_children != 2)
+        return;
+    node_t *inner_list = loop_block->children[0];
+    node_t *body = inner_list->children[0];
+    node_t *increment = inner_list->children[1];
+    if (count_assignments(body, variable->symbol) != 0 || count_assignments(increment, variable->symbol) != 1)
+        return;
+
+    int64_t first = *(int64_t *)start->data;
+    int64_t last = *(int64_t *)end->data;
+    // Loops running once or not at all gain nothing. Running more than INT64_MAX times is not possible
+    if (last <= first || last - first < 2)
+        return;
+    int64_t trips = last - first;
+    size_t size = count_nodes(body);
+    bool breaks = breaks_out(body);
+
+    if (!breaks && trips <= MAX_FULL_UNROLL_TRIPS && (size_t)trips * size <= MAX_UNROLLED_SIZE) {
+        node_t *copies = malloc(sizeof(node_t));
+        node_init(copies, STATEMENT_LIST, NULL, 0);
+        copies->n_children = trips;
+        copies->children = realloc(copies->children, trips * sizeof(node_t *));
+        for (int64_t i = 0; i < trips; i++)
+            copies->children[i] = copy_body(body, variable->symbol, first + i, true);
+
+        // The copies share the variables declared in the body, so the declarations are moved outside of them
+        node_t *copies_block = malloc(sizeof(node_t));
+        if (body->type == BLOCK && body->n_children == 2) {
+            node_init(copies_block, BLOCK, NULL, 2, body->children[0], copies);
+            body->children[0] = NULL;
+        } else {
+            node_init(copies_block, BLOCK, NULL, 1, copies);
+        }
+        statement_list->children[1] = copies_block;
+        destroy_subtree(loop);
+
+        if (report_optimizations)
+            fprintf(stderr, "unroll: loop over '%s' with %ld iterations unrolled completely\n", variable->symbol->name,
+                    trips);
+        return;
+    }
+
+    int64_t factor = unroll_factor;
+    while (factor > 1 && ((size_t)factor * size > MAX_UNROLLED_SIZE || factor > trips || (breaks && trips % factor != 0)))
+        factor--;
+    if (factor < 2)
+        return;
+
+    // The remainder loop is the original loop, with a copy of the body
+    node_t *remainder = NULL;
+    if (trips % factor != 0) {
+        node_t *remainder_list = malloc(sizeof(node_t));
+        node_init(remainder_list, STATEMENT_LIST, NULL, 2, copy_body(body, variable->symbol, 0, false),
+                  copy_subtree(increment));
+        node_t *remainder_block = malloc(sizeof(node_t));
+        node_init(remainder_block, BLOCK, NULL, 1, remainder_list);
+        remainder = malloc(sizeof(node_t));
+        node_init(remainder, WHILE_STATEMENT, NULL, 2, copy_subtree(relation), remainder_block);
+    }
+
+    inner_list->children = realloc(inner_list->children, (factor + 1) * sizeof(node_t *));
+    for (int64_t i = 1; i < factor; i++)
+        inner_list->children[i] = copy_body(body, variable->symbol, i, false);
+    inner_list->children[factor] = increment;
+    inner_list->n_children = factor + 1;
+
+    // The increment is <variable> + 1, or 1 + <variable>
+    node_t *sum = increment->children[1];
+    node_t *step = sum->children[sum->children[0]->type == NUMBER_DATA ? 0 : 1];
+    assert(step->type == NUMBER_DATA);
+    *(int64_t *)step->data = factor;
+    *(int64_t *)end->data = last - factor + 1;
+
+    if (remainder != NULL) {
+        statement_list->children = realloc(statement_list->children, 3 * sizeof(node_t *));
+        statement_list->children[2] = remainder;
+        statement_list->n_children = 3;
+    }
+
+    if (report_optimizations)
+        fprintf(stderr, "unroll: loop over '%s' with %ld iterations unrolled %ld times%s\n", variable->symbol->name,
+                trips, factor, remainder != NULL ? ", with a remainder loop" : "");
+}
+
+/* Returns true if the statement can break out of the loop it is in */
+static bool breaks_out(node_t *node) {
+    if (node->type == BREAK_STATEMENT)
+        return true;
+    if (node->type == WHILE_STATEMENT)
+        return false;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (breaks_out(node->children[i]))
+            return true;
+    return false;
+}
+
+static size_t count_nodes(node_t *node) {
+    size_t count = 1;
+    for (size_t i = 0; i < node->n_children; i++)
+        count += count_nodes(node->children[i]);
+    return count;
+}
+
+/**
+ * Copies the body of a loop, with the variable replaced by <variable> + offset, or just the offset if
+ * replace_with_number is set. Variables declared in the body keep their symbols, and are not declared
+ * again in the copy, as they keep their values from one iteration to the next.
+ */
+static node_t *copy_body(node_t *body, symbol_t *variable, int64_t offset, bool replace_with_number) {
+    copied_variable = variable;
+    copied_offset = offset;
+    copied_as_number = replace_with_number;
+    node_t *copy = copy_subtree(body);
+    fold_constants(&copy);
+    copied_variable = NULL;
+    return copy;
+}
+
+/**
+ * Copies the subtree, replacing the variable as set up by copy_body, and leaving out the declarations.
+ * When copies_declarations is set, they declare what the local variables of the inlined function are replaced by
+ */
+static node_t *copy_subtree(node_t *node) {
+    if (node->type == IDENTIFIER_DATA && node->symbol != NULL && node->symbol == copied_variable) {
+        if (copied_as_number)
+            return new_number(copied_offset);
+        if (copied_offset != 0)
+            return new_expression("+", new_identifier(copied_variable), new_number(copied_offset));
+    }
+    if (node->type == IDENTIFIER_DATA && node->symbol != NULL && is_inlined_variable(node->symbol))
+        return copy_operand(inlined_values[node->symbol->sequence_number]);
+    if (node->type == IDENTIFIER_DATA && node->symbol != NULL)
+        return new_identifier(node->symbol);
+    if (node->type == DECLARATION && copies_declarations) {
+        node_t *copy = malloc(sizeof(node_t));
+        node_init(copy, DECLARATION, NULL, 0);
+        copy->children = realloc(copy->children, node->n_children * sizeof(node_t *));
+        symbol_table_t *symbols = inlined_function->function_symtable;
+        for (size_t i = 0; i < node->n_children; i++) {
+            // The declared identifiers are not bound, but are the nodes of their symbols
+            size_t local = 0;
+            while (symbols->symbols[local]->node != node->children[i])
+                local++;
+            copy->children[copy->n_children++] = inlined_values[local]->symbol->node;
+        }
+        return copy;
+    }
+    if (node->type == BLOCK && node->n_children == 2 && !copies_declarations) {
+        node_t *copy = malloc(sizeof(node_t));
+        node_init(copy, BLOCK, NULL, 1, copy_subtree(node->children[1]));
+        return copy;
+    }
+
+    node_t *copy = malloc(sizeof(node_t));
+    void *data = NULL;
+    switch (node->type) {
+        case NUMBER_DATA:
+            data = malloc(sizeof(int64_t));
+            memcpy(data, node->data, sizeof(int64_t));
+            break;
+        case STRING_DATA:
+            // The string has been replaced by its position in the string list
+            data = malloc(sizeof(size_t));
+            memcpy(data, node->data, sizeof(size_t));
+            break;
+        case EXPRESSION:
+        case RELATION:
+            data = node->data == NULL ? NULL : strdup(node->data);
+            break;
+        default:
+            assert(node->data == NULL);
+            break;
+    }
+    node_init(copy, node->type, data, 0);
+
+    copy->n_children = node->n_children;
+    copy->children = realloc(copy->children, node->n_children * sizeof(node_t *));
+    for (size_t i = 0; i < node->n_children; i++)
+        copy->children[i] = copy_subtree(node->children[i]);
+    return copy;
+}
+
+/* Evaluates the arithmetic on numbers in the subtree held by the slot, left by replacing variables with numbers */
+static void fold_constants(node_t **slot) {
+    node_t *node = *slot;
+    for (size_t i = 0; i < node->n_children; i++)
+        fold_constants(&node->children[i]);
+    if (node->type != EXPRESSION || node->data == NULL)
+        return;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (node->children[i]->type != NUMBER_DATA)
+            return;
+
+    int64_t left = *(int64_t *)node->children[0]->data;
+    int64_t right = node->n_children == 2 ? *(int64_t *)node->children[1]->data : 0;
+    int64_t result;
+    if (!apply_operator(node->data, node->n_children, left, right, &result))
+        return;
+
+    *slot = new_number(result);
+    destroy_subtree(node);
+}
+
+/**
+ * Computes the result of the operator on one or two numbers, returning false for the divisions
+ * that trap, which are left for the program to do
+ */
+static bool apply_operator(const char *operator, size_t n_operands, int64_t left, int64_t right, int64_t *result) {
+    // Computed as unsigned, wrapping around like the instructions do
+    uint64_t a = left, b = right;
+    if (n_operands == 1 && strcmp(operator, "-") == 0)
+        *result = -a;
+    else if (n_operands == 1)
+        return false;
+    else if (strcmp(operator, "+") == 0)
+        *result = a + b;
+    else if (strcmp(operator, "-") == 0)
+        *result = a - b;
+    else if (strcmp(operator, "*") == 0)
+        *result = a * b;
+    else if (strcmp(operator, "/") == 0 && right != 0 && !(right == -1 && left == INT64_MIN))
+        *result = left / right;
+    else
+        return false;
+    return true;
+}
+
+static bool holds_for(const char *relation, int64_t left, int64_t right) {
+    if (strcmp(relation, "<") == 0)
+        return left < right;
+    if (strcmp(relation, ">") == 0)
+        return left > right;
+    if (strcmp(relation, "=") == 0)
+        return left == right;
+    return left != right;
+}
+
+/* Vectorizes the for-loops in the subtree, which are innermost loops */
+static void vectorize_for_loops(node_t *node) {
+    for (size_t i = 0; i < node->n_children; i++)
+        vectorize_for_loops(node->children[i]);
+    if (node->type == BLOCK)
+        vectorize_for_loop(node);
+}
+
+/**
+ * Places a VECTOR_LOOP in front of a lowered for-loop, see fold_constant_loop_bound, that the generator
+ * turns into code handling several iterations at once. It runs as many whole vectors of iterations as
+ * there are, leaving the loop variable at the first iteration it did not run, and the for-loop finishes
+ * the rest one at a time. The body must consist of assignments of the form
+ *     <array>[<variable>] := <expression>
+ *     <sum> := <sum> + <expression>, or <sum> - <expression>
+ * where the expressions add, subtract, negate and multiply numbers, variables not assigned in the loop,
+ * the loop variable, and elements of global arrays indexed by the loop variable plus a number. Arrays
+ * written by the loop must only be indexed by the loop variable itself, so no iteration reads what another
+ * one writes, and the sums are not used for anything else, so they can be added up in any order.
+ */
+static void vectorize_for_loop(node_t *block) {
+    if (block->n_children != 2)
+        return;
+    node_t *statement_list = block->children[1];
+    if (statement_list->n_children != 2 && statement_list->n_children != 3)
+        return;
+    node_t *initialization = statement_list->children[0];
+    node_t *loop = statement_list->children[statement_list->n_children - 1];
+    if (initialization->type != ASSIGNMENT_STATEMENT || loop->type != WHILE_STATEMENT || loop->n_children != 2)
+        return;
+
+    node_t *variable = initialization->children[0];
+    node_t *relation = loop->children[0];
+    if (variable->type != IDENTIFIER_DATA || variable->symbol->type != SYMBOL_LOCAL_VAR || strcmp(relation->data, "<") != 0)
+        return;
+    node_t *compared = relation->children[0];
+    node_t *end = relation->children[1];
+    if (compared->type != IDENTIFIER_DATA || compared->symbol != variable->symbol)
+        return;
+    if (end->type != NUMBER_DATA && (end->type != IDENTIFIER_DATA || end->symbol->type == SYMBOL_GLOBAL_ARRAY ||
+                                     end->symbol->type == SYMBOL_FUNCTION || count_assignments(loop, end->symbol) != 0))
+        return;
+
+    node_t *loop_block = loop->children[1];
+    if (loop_block->type != BLOCK || loop_block->n_children != 1 || loop_block->children[0]->n_children != 2)
+        return;
+    node_t *body = loop_block->children[0]->children[0];
+    node_t *increment = loop_block->children[0]->children[1];
+    if (count_assignments(body, variable->symbol) != 0 || count_assignments(increment, variable->symbol) != 1)
+        return;
+
+    node_t *start = initialization->children[1];
+    if (start->type == NUMBER_DATA && end->type == NUMBER_DATA &&
+        *(int64_t *)end->data - *(int64_t *)start->data < MIN_VECTORIZED_TRIPS)
+        return;
+
+    // The body is a single assignment, or a block of them without declarations of its own
+    node_t **statements = &body;
+    size_t n_statements = 1;
+    if (body->type == BLOCK) {
+        if (body->n_children != 1)
+            return;
+        statements = body->children[0]->children;
+        n_statements = body->children[0]->n_children;
+    }
+    if (n_statements == 0 || count_nodes(body) > MAX_VECTORIZED_SIZE)
+        return;
+    for (size_t i = 0; i < n_statements; i++)
+        if (!is_vectorizable_statement(statements[i], variable->symbol, body))
+            return;
+    if (has_loop_carried_dependence(body, body))
+        return;
+
+    node_t *vector_list = malloc(sizeof(node_t));
+    node_init(vector_list, STATEMENT_LIST, NULL, 0);
+    vector_list->n_children = n_statements;
+    vector_list->children = realloc(vector_list->children, n_statements * sizeof(node_t *));
+    for (size_t i = 0; i < n_statements; i++)
+        vector_list->children[i] = copy_subtree(statements[i]);
+    node_t *vector_block = malloc(sizeof(node_t));
+    node_init(vector_block, BLOCK, NULL, 1, vector_list);
+    node_t *vector_loop = malloc(sizeof(node_t));
+    node_init(vector_loop, VECTOR_LOOP, NULL, 2, copy_subtree(relation), vector_block);
+
+    statement_list->children = realloc(statement_list->children, (statement_list->n_children + 1) * sizeof(node_t *));
+    statement_list->children[statement_list->n_children] = loop;
+    statement_list->children[statement_list->n_children - 1] = vector_loop;
+    statement_list->n_children++;
+
+    if (report_optimizations)
+        fprintf(stderr, "vectorize: loop over '%s' vectorized\n", variable->symbol->name);
+}
+
+static bool is_vectorizable_statement(node_t *statement, symbol_t *variable, node_t *body) {
+    if (statement->type != ASSIGNMENT_STATEMENT)
+        return false;
+    node_t *destination = statement->children[0];
+    node_t *expression = statement->children[1];
+
+    if (destination->type == ARRAY_INDEXING) {
+        node_t *index = destination->children[1];
+        return is_quadword_array(destination->children[0]->symbol) && index->type == IDENTIFIER_DATA &&
+               index->symbol == variable && is_vectorizable_expression(expression, variable, body);
+    }
+
+    // A sum is named twice, by the assignment and the addition, and never read by anything else
+    symbol_t *sum = destination->symbol;
+    if (destination->type != IDENTIFIER_DATA || sum == variable || count_references(body, sum) != 2)
+        return false;
+    if (sum->type != SYMBOL_LOCAL_VAR && sum->type != SYMBOL_PARAMETER && sum->type != SYMBOL_GLOBAL_VAR)
+        return false;
+    if (expression->type != EXPRESSION || expression->n_children != 2)
+        return false;
+    bool is_sum = strcmp(expression->data, "+") == 0;
+    if (!is_sum && strcmp(expression->data, "-") != 0)
+        return false;
+    for (size_t side = 0; side < (is_sum ? 2 : 1); side++) {
+        node_t *same = expression->children[side];
+        if (same->type == IDENTIFIER_DATA && same->symbol == sum)
+            return is_vectorizable_expression(expression->children[1 - side], variable, body);
+    }
+    return false;
+}
+
+static bool is_vectorizable_expression(node_t *node, symbol_t *variable, node_t *body) {
+    switch (node->type) {
+        case NUMBER_DATA:
+            return true;
+        case IDENTIFIER_DATA: {
+            symbol_t *symbol = node->symbol;
+            if (symbol == variable)
+                return true;
+            return (symbol->type == SYMBOL_LOCAL_VAR || symbol->type == SYMBOL_PARAMETER ||
+                    symbol->type == SYMBOL_GLOBAL_VAR) &&
+                   count_assignments(body, symbol) == 0;
+        }
+        case ARRAY_INDEXING: {
+            int64_t offset;
+            return is_quadword_array(node->children[0]->symbol) && get_element_offset(node, variable, &offset);
+        }
+        case EXPRESSION: {
+            if (node->n_children == 1)
+                return strcmp(node->data, "-") == 0 && is_vectorizable_expression(node->children[0], variable, body);
+            if (strcmp(node->data, "+") != 0 && strcmp(node->data, "-") != 0 && strcmp(node->data, "*") != 0)
+                return false;
+            return is_vectorizable_expression(node->children[0], variable, body) &&
+                   is_vectorizable_expression(node->children[1], variable, body);
+        }
+        default:
+            return false;
+    }
+}
+
+/* Finds the offset of an element indexed by <variable>, <variable> + <number>, <number> + <variable> or <variable> - <number> */
+static bool get_element_offset(node_t *element, symbol_t *variable, int64_t *offset) {
+    node_t *index = element->children[1];
+    if (index->type == IDENTIFIER_DATA && index->symbol == variable) {
+        *offset = 0;
+        return true;
+    }
+    if (index->type != EXPRESSION || index->n_children != 2)
+        return false;
+
+    bool is_sum = strcmp(index->data, "+") == 0;
+    if (!is_sum && strcmp(index->data, "-") != 0)
+        return false;
+    for (size_t side = 0; side < (is_sum ? 2 : 1); side++) {
+        node_t *same = index->children[side];
+        node_t *number = index->children[1 - side];
+        if (same->type != IDENTIFIER_DATA || same->symbol != variable || number->type != NUMBER_DATA)
+            continue;
+        int64_t value = *(int64_t *)number->data;
+        if (value < -MAX_ELEMENT_OFFSET || value > MAX_ELEMENT_OFFSET)
+            return false;
+        *offset = is_sum ? value : -value;
+        return true;
+    }
+    return false;
+}
+
+/* Returns true if the subtree reads or writes an element of an array written in the body at another iteration */
+static bool has_loop_carried_dependence(node_t *node, node_t *body) {
+    if (node->type == ARRAY_INDEXING && writes_array(body, node->children[0]->symbol)) {
+        node_t *index = node->children[1];
+        if (index->type != IDENTIFIER_DATA)
+            return true;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (has_loop_carried_dependence(node->children[i], body))
+            return true;
+    return false;
+}
+
+static size_t count_references(node_t *node, symbol_t *symbol) {
+    size_t count = node->type == IDENTIFIER_DATA && node->symbol == symbol;
+    for (size_t i = 0; i < node->n_children; i++)
+        count += count_references(node->children[i], symbol);
+    return count;
+}
+
+/**
+ * Finds the global variables and arrays every function reads and writes itself, and adds those of the
+ * functions it calls, until the functions calling each other agree. Calls to anything else than a function
+ * are assumed to read and write everything, and so is every call with -f no-mod-ref.
+ */
+static void find_memory_summaries(void) {
+    size_t n_globals = global_symbols->n_symbols;
+    function_reads = calloc(n_globals, sizeof(bool *));
+    function_writes = calloc(n_globals, sizeof(bool *));
+    for (size_t i = 0; i < n_globals; i++) {
+        symbol_t *function = global_symbols->symbols[i];
+        if (function->type != SYMBOL_FUNCTION)
+            continue;
+        function_reads[i] = calloc(n_globals, sizeof(bool));
+        function_writes[i] = calloc(n_globals, sizeof(bool));
+        if (mod_ref_summaries) {
+            find_direct_accesses(function->node->children[2], function);
+        } else {
+            memset(function_reads[i], true, n_globals * sizeof(bool));
+            memset(function_writes[i], true, n_globals * sizeof(bool));
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < n_globals; i++) {
+            symbol_t *function = global_symbols->symbols[i];
+            if (function->type == SYMBOL_FUNCTION && add_callee_accesses(function->node->children[2], function))
+                changed = true;
+        }
+    }
+}
+
+/* Marks the global variables and arrays the subtree reads and writes, not counting the functions it calls */
+static void find_direct_accesses(node_t *node, symbol_t *function) {
+    bool *reads = function_reads[function->sequence_number];
+    bool *writes = function_writes[function->sequence_number];
+    switch (node->type) {
+        case ASSIGNMENT_STATEMENT: {
+            // The destination is only written, but the index of an element is read
+            node_t *destination = node->children[0];
+            symbol_t *symbol = destination->type == IDENTIFIER_DATA ? destination->symbol : destination->children[0]->symbol;
+            if (symbol->type == SYMBOL_GLOBAL_VAR || symbol->type == SYMBOL_GLOBAL_ARRAY)
+                writes[symbol->sequence_number] = true;
+            for (size_t i = 1; i < destination->n_children; i++)
+                find_direct_accesses(destination->children[i], function);
+            find_direct_accesses(node->children[1], function);
+            return;
+        }
+        case IDENTIFIER_DATA:
+            if (node->symbol != NULL && (node->symbol->type == SYMBOL_GLOBAL_VAR || node->symbol->type == SYMBOL_GLOBAL_ARRAY))
+                reads[node->symbol->sequence_number] = true;
+            return;
+        case EXPRESSION:
+            if (is_call(node) && node->children[0]->symbol->type != SYMBOL_FUNCTION) {
+                memset(reads, true, global_symbols->n_symbols * sizeof(bool));
+                memset(writes, true, global_symbols->n_symbols * sizeof(bool));
+            }
+            break;
+        default:
+            break;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        find_direct_accesses(node->children[i], function);
+}
+
+/* Adds what the functions called in the subtree read and write to the function. Returns true if anything was added */
+static bool add_callee_accesses(node_t *node, symbol_t *function) {
+    bool changed = false;
+    if (is_call(node) && node->children[0]->symbol->type == SYMBOL_FUNCTION) {
+        size_t callee = node->children[0]->symbol->sequence_number;
+        for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+            bool *reads = &function_reads[function->sequence_number][i];
+            bool *writes = &function_writes[function->sequence_number][i];
+            changed |= (function_reads[callee][i] && !*reads) || (function_writes[callee][i] && !*writes);
+            *reads |= function_reads[callee][i];
+            *writes |= function_writes[callee][i];
+        }
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        changed |= add_callee_accesses(node->children[i], function);
+    return changed;
+}
+
+/**
+ * Returns true if a call in the subtree may access the global variable or array, according to the summaries
+ * of either function_reads or function_writes. Any array at all is looked for when the global is NULL.
+ */
+static bool calls_access(node_t *node, symbol_t *global, bool **accesses) {
+    if (is_call(node)) {
+        symbol_t *callee = node->children[0]->symbol;
+        if (callee->type != SYMBOL_FUNCTION)
+            return true;
+        bool *summary = accesses[callee->sequence_number];
+        if (global != NULL && summary[global->sequence_number])
+            return true;
+        for (size_t i = 0; i < global_symbols->n_symbols && global == NULL; i++)
+            if (summary[i] && global_symbols->symbols[i]->type == SYMBOL_GLOBAL_ARRAY)
+                return true;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (calls_access(node->children[i], global, accesses))
+            return true;
+    return false;
+}
+
+/* Returns true if a call in the subtree may read or write the global variable or array */
+static bool calls_use(node_t *node, symbol_t *global) {
+    return calls_access(node, global, function_reads) || calls_access(node, global, function_writes);
+}
+
+/* Optimizes every loop in the subtree held by the slot, starting with the innermost ones */
+static void optimize_loops(node_t **slot, size_t loop_depth) {
+    node_t *node = *slot;
+    bool is_loop = node->type == WHILE_STATEMENT;
+    for (size_t i = 0; i < node->n_children; i++)
+        optimize_loops(&node->children[i], loop_depth + is_loop);
+
+    if (is_loop)
+        optimize_loop(slot, loop_depth);
+}
+
+/**
+ * Hoists the computations that are the same in every iteration out of the loop, and then replaces
+ * multiplications of an induction variable by a loop invariant factor with additions, see reduction_t.
+ * Loops that are not nested in other loops also load the address of every array indexed inside them
+ * once, up front, instead of at every access.
+ * The variables are initialized in front of the loop, so the loop in the slot is replaced by the block
+ *     var <new variables>
+ *     <invariant variable> := <invariant expression>
+ *     <reduced variable> := <variable> * <factor>
+ *     while ...
+ */
+static void optimize_loop(node_t **slot, size_t loop_depth) {
+    node_t *loop = *slot;
+    n_invariants = n_reductions = n_updates = n_array_bases = n_prologue = n_preheader = n_declarations = 0;
+    n_epilogue = 0;
+
+    in_loop_condition = true;
+    if (find_invariants(loop, &loop->children[0], true))
+        hoist_invariant(&loop->children[0]);
+    in_loop_condition = false;
+    if (find_invariants(loop, &loop->children[1], true))
+        hoist_invariant(&loop->children[1]);
+
+    if (n_preheader > 0) {
+        node_t *statement_list = malloc(sizeof(node_t));
+        node_init(statement_list, STATEMENT_LIST, NULL, 0);
+        statement_list->n_children = n_preheader;
+        statement_list->children = realloc(statement_list->children, n_preheader * sizeof(node_t *));
+        memcpy(statement_list->children, preheader, n_preheader * sizeof(node_t *));
+        node_t *block = malloc(sizeof(node_t));
+        node_init(block, BLOCK, NULL, 1, statement_list);
+
+        assert(loop->n_children == 2);
+        loop->children = realloc(loop->children, 3 * sizeof(node_t *));
+        loop->children[2] = block;
+        loop->n_children = 3;
+    }
+
+    // The preheader runs once, so only the condition and body are worth changing
+    for (size_t i = 0; i < 2; i++)
+        reduce_products(loop, &loop->children[i]);
+    if (loop_depth == 0)
+        for (size_t i = 0; i < 2; i++)
+            hoist_array_bases(&loop->children[i]);
+
+    // The loop is only changed now, as the statement lists could move while they were being walked
+    for (size_t i = 0; i < n_updates; i++) {
+        bool inserted = insert_after(loop, updates[i].after, updates[i].statement);
+        assert(inserted);
+    }
+    for (size_t i = 0; i < n_reductions; i++)
+        destroy_subtree(reductions[i].factor);
+    if (loop_depth == 0 && global_promotion)
+        promote_globals(loop);
+
+    if (n_declarations > 0) {
+        prologue = realloc(prologue, (n_prologue + 1 + n_epilogue) * sizeof(node_t *));
+        prologue[n_prologue++] = loop;
+        memcpy(&prologue[n_prologue], epilogue, n_epilogue * sizeof(node_t *));
+        n_prologue += n_epilogue;
+        *slot = new_block(prologue, n_prologue, declarations, n_declarations);
+    }
+
+    free(invariants);
+    invariants = NULL;
+    free(preheader);
+    preheader = NULL;
+    free(reductions);
+    reductions = NULL;
+    free(updates);
+    updates = NULL;
+    free(array_bases);
+    array_bases = NULL;
+    free(prologue);
+    prologue = NULL;
+    free(declarations);
+    declarations = NULL;
+    free(epilogue);
+    epilogue = NULL;
+}
+
+/**
+ * Finds the expressions in the subtree held by the slot that have the same value in every iteration of the
+ * loop, and hoists the largest of them out of it. Returns true if the node in the slot is invariant itself,
+ * leaving it to the caller to hoist it, possibly as part of a larger expression.
+ * Unconditional is true while every iteration reaching the node has run all of the loop body up to it.
+ */
+static bool find_invariants(node_t *loop, node_t **slot, bool unconditional) {
+    node_t *node = *slot;
+    switch (node->type) {
+        case NUMBER_DATA:
+            return true;
+        case IDENTIFIER_DATA: {
+            // Global variables can be assigned by the functions called in the loop
+            symbol_t *symbol = node->symbol;
+            if (symbol->type == SYMBOL_GLOBAL_ARRAY)
+                return true;
+            if (symbol->type == SYMBOL_GLOBAL_VAR && calls_access(loop, symbol, function_writes))
+                return false;
+            return symbol->type != SYMBOL_FUNCTION && count_assignments(loop, symbol) == 0;
+        }
+        case ARRAY_INDEXING:
+        case POINTER_INDEXING: {
+            bool index_invariant = find_invariants(loop, &node->children[1], unconditional);
+            if (index_invariant && is_invariant_element(loop, node, unconditional))
+                return true;
+            if (index_invariant)
+                hoist_invariant(&node->children[1]);
+            return false;
+        }
+        case EXPRESSION: {
+            // The arguments of a call can be hoisted, but not the call itself
+            if (strcmp(node->data, "call") == 0) {
+                find_invariants(loop, &node->children[1], unconditional);
+                return false;
+            }
+
+            bool invariant = true;
+            bool child_invariant[2] = {false, false};
+            for (size_t i = 0; i < node->n_children; i++) {
+                child_invariant[i] = find_invariants(loop, &node->children[i], unconditional);
+                invariant = invariant && child_invariant[i];
+            }
+
+            // Hoisting a division could make it trap where the loop would not, unless the divisor is safe
+            if (strcmp(node->data, "/") == 0) {
+                node_t *divisor = node->children[1];
+                int64_t value = divisor->type == NUMBER_DATA ? *(int64_t *)divisor->data : 0;
+                invariant = invariant && value != 0 && value != -1;
+            }
+
+            if (invariant)
+                return true;
+            for (size_t i = 0; i < node->n_children; i++)
+                if (child_invariant[i])
+                    hoist_invariant(&node->children[i]);
+            return false;
+        }
+        case ASSIGNMENT_STATEMENT: {
+            // The destination is written rather than read, but the index of an element is read
+            node_t *destination = node->children[0];
+            if (destination->type != IDENTIFIER_DATA && find_invariants(loop, &destination->children[1], unconditional))
+                hoist_invariant(&destination->children[1]);
+            if (find_invariants(loop, &node->children[1], unconditional))
+                hoist_invariant(&node->children[1]);
+            return false;
+        }
+        case STATEMENT_LIST: {
+            // Statements following one that can branch, or skip statements, do not run on every iteration
+            for (size_t i = 0; i < node->n_children; i++) {
+                node_t *statement = node->children[i];
+                find_invariants(loop, &node->children[i], unconditional);
+                if (statement->type != ASSIGNMENT_STATEMENT && statement->type != PRINT_STATEMENT)
+                    unconditional = false;
+            }
+            return false;
+        }
+        case IF_STATEMENT:
+        case WHILE_STATEMENT:
+        case VECTOR_LOOP: {
+            if (find_invariants(loop, &node->children[0], unconditional))
+                hoist_invariant(&node->children[0]);
+            for (size_t i = 1; i < node->n_children; i++)
+                find_invariants(loop, &node->children[i], false);
+            return false;
+        }
+        case DECLARATION_LIST:
+            return false;
+        default: {
+            for (size_t i = 0; i < node->n_children; i++)
+                if (find_invariants(loop, &node->children[i], unconditional))
+                    hoist_invariant(&node->children[i]);
+            return false;
+        }
+    }
+}
+
+/**
+ * Replaces the invariant expression in the slot with a variable computed in front of the loop, unless it is
+ * as cheap to use the expression directly. Identical expressions share the variable.
+ */
+static void hoist_invariant(node_t **slot) {
+    node_t *node = *slot;
+    bool worth_hoisting = node->type == EXPRESSION || node->type == ARRAY_INDEXING ||
+                          (node->type == IDENTIFIER_DATA && node->symbol->type == SYMBOL_GLOBAL_VAR);
+    if (!worth_hoisting)
+        return;
+
+    for (size_t i = 0; i < n_invariants; i++) {
+        if (is_same_expression(invariants[i].expression, node)) {
+            *slot = new_identifier(invariants[i].variable);
+            destroy_subtree(node);
+            return;
+        }
+    }
+
+    symbol_t *variable = create_loop_variable("INVARIANT");
+    node_t *assignment = malloc(sizeof(node_t));
+    node_init(assignment, ASSIGNMENT_STATEMENT, NULL, 2, new_identifier(variable), node);
+    *slot = new_identifier(variable);
+
+    // Elements at variable indices can be out of bounds, so they are only loaded if the loop is entered.
+    // The condition is evaluated before the loop is entered, so what it loads can always be loaded
+    if (contains_variable_element(node) && !in_loop_condition) {
+        preheader = realloc(preheader, (n_preheader + 1) * sizeof(node_t *));
+        preheader[n_preheader++] = assignment;
+    } else {
+        prologue = realloc(prologue, (n_prologue + 1) * sizeof(node_t *));
+        prologue[n_prologue++] = assignment;
+    }
+
+    invariants = realloc(invariants, (n_invariants + 1) * sizeof(invariant_t));
+    invariants[n_invariants++] = (invariant_t){.expression = node, .variable = variable};
+}
+
+/**
+ * Returns true if the element, with an invariant index, holds the same value in every iteration of the loop.
+ * It can not be written in the loop, or by functions called from it, and unless it is an element at a constant
+ * index within the array, it must be loaded by every iteration.
+ */
+static bool is_invariant_element(node_t *loop, node_t *element, bool unconditional) {
+    if (element->type != ARRAY_INDEXING)
+        return false;
+    symbol_t *array = element->children[0]->symbol;
+    if (array->type != SYMBOL_GLOBAL_ARRAY || calls_access(loop, array, function_writes))
+        return false;
+    if (contains_variable_element(element) && !unconditional)
+        return false;
+    return !writes_array(loop, array);
+}
+
+/* Returns true if the node writes an element of the array, or an element through a pointer */
+static bool writes_array(node_t *node, symbol_t *array) {
+    if (node->type == ASSIGNMENT_STATEMENT) {
+        node_t *destination = node->children[0];
+        if (destination->type == POINTER_INDEXING)
+            return true;
+        if (destination->type == ARRAY_INDEXING && destination->children[0]->symbol == array)
+            return true;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (writes_array(node->children[i], array))
+            return true;
+    return false;
+}
+
+/* Returns true if the expression loads an element of an array at an index that may be outside of it */
+static bool contains_variable_element(node_t *node) {
+    if (node->type == ARRAY_INDEXING) {
+        node_t *index = node->children[1];
+        if (index->type != NUMBER_DATA)
+            return true;
+        // The size of the array is the second child of its declaration
+        int64_t value = *(int64_t *)index->data;
+        int64_t size = *(int64_t *)node->children[0]->symbol->node->children[1]->data;
+        if (value < 0 || value >= size)
+            return true;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (contains_variable_element(node->children[i]))
+            return true;
+    return false;
+}
+
+static bool is_same_expression(node_t *a, node_t *b) {
+    if (a->type != b->type || a->n_children != b->n_children)
+        return false;
+    if (a->type == NUMBER_DATA || a->type == IDENTIFIER_DATA)
+        return is_same_operand(a, b);
+    if (a->type == EXPRESSION && strcmp(a->data, b->data) != 0)
+        return false;
+    for (size_t i = 0; i < a->n_children; i++)
+        if (!is_same_expression(a->children[i], b->children[i]))
+            return false;
+    return true;
+}
+
+/* Replaces the reducible products in the subtree held by the slot, see match_reducible_product */
+static void reduce_products(node_t *loop, node_t **slot) {
+    node_t *node = *slot;
+    node_t *variable, *factor, *step;
+    // Vectorized loops index their elements by the loop variable, which the generator relies on
+    if (node->type == VECTOR_LOOP)
+        return;
+
+    // An element indexed by a product can be found through a pointer increased along with the variable
+    if (node->type == ARRAY_INDEXING && is_quadword_array(node->children[0]->symbol) &&
+        match_reducible_product(loop, node->children[1], &variable, &factor, &step)) {
+        // Products already reduced to a number are kept that way, rather than increasing two variables
+        symbol_t *array = node->children[0]->symbol, *indexed = NULL;
+        if (find_reduction(variable->symbol, factor, NULL) == NULL &&
+            find_indexed_array(loop, variable->symbol, factor, &indexed) && indexed == array) {
+            symbol_t *pointer = get_reduction(loop, variable, factor, step, array);
+            node_t *element = malloc(sizeof(node_t));
+            node_init(element, POINTER_INDEXING, NULL, 2, new_identifier(pointer), new_number(0));
+            *slot = element;
+            destroy_subtree(node);
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < node->n_children; i++)
+        reduce_products(loop, &node->children[i]);
+
+    if (match_reducible_product(loop, node, &variable, &factor, &step)) {
+        *slot = new_identifier(get_reduction(loop, variable, factor, step, NULL));
+        destroy_subtree(node);
+    }
+}
+
+/* Replaces the elements of arrays in the subtree held by the slot with elements found from a variable
+ * holding the address of the array. Elements at constant indices are addressed directly already */
+static void hoist_array_bases(node_t **slot) {
+    node_t *node = *slot;
+    if (node->type == VECTOR_LOOP)
+        return;
+    for (size_t i = 0; i < node->n_children; i++)
+        hoist_array_bases(&node->children[i]);
+
+    if (node->type != ARRAY_INDEXING || node->children[1]->type == NUMBER_DATA)
+        return;
+    symbol_t *array = node->children[0]->symbol;
+    if (!is_quadword_array(array))
+        return;
+
+    symbol_t *base = NULL;
+    for (size_t i = 0; i < n_array_bases && base == NULL; i++)
+        if (array_bases[i][0] == array)
+            base = array_bases[i][1];
+
+    if (base == NULL) {
+        // <base> := &<array>
+        base = create_loop_variable("BASE");
+        node_t *address = new_expression("&", new_identifier(array), NULL);
+        node_t *assignment = malloc(sizeof(node_t));
+        node_init(assignment, ASSIGNMENT_STATEMENT, NULL, 2, new_identifier(base), address);
+        prologue = realloc(prologue, (n_prologue + 1) * sizeof(node_t *));
+        prologue[n_prologue++] = assignment;
+
+        array_bases = realloc(array_bases, (n_array_bases + 1) * sizeof(*array_bases));
+        array_bases[n_array_bases][0] = array;
+        array_bases[n_array_bases][1] = base;
+        n_array_bases++;
+    }
+
+    node_t *element = malloc(sizeof(node_t));
+    node_init(element, POINTER_INDEXING, NULL, 2, new_identifier(base), node->children[1]);
+    node->children[1] = NULL;
+    destroy_subtree(node);
+    *slot = element;
+}
+
+/**
+ * Keeps the global variables assigned in the loop in local variables, which can be given registers, instead
+ * of loading and storing them in memory at every use. The loop becomes
+ *     <local> := <global>
+ *     while ...
+ *     <global> := <local>
+ * and the globals are written back in front of every statement in the loop calling a function that may read
+ * or write them, and loaded again after it, see find_memory_summaries. Those statements keep using the globals
+ * themselves. Returns are preceded by writing the globals back as well. Calls in conditions would need the
+ * globals in memory in the middle of the loop's control flow, so loops with them are left alone.
+ */
+static void promote_globals(node_t *loop) {
+    if (has_call_in_condition(loop))
+        return;
+
+    n_promotions = n_escapes = 0;
+    find_promotable_globals(loop);
+    if (n_promotions > 0)
+        replace_promoted_globals(loop, NULL);
+
+    for (size_t i = 0; i < n_promotions; i++) {
+        symbol_t *global = promotions[i][0], *local = promotions[i][1];
+        prologue = realloc(prologue, (n_prologue + 1) * sizeof(node_t *));
+        prologue[n_prologue++] = new_assignment(local, new_identifier(global));
+        epilogue = realloc(epilogue, (n_epilogue + 1) * sizeof(node_t *));
+        epilogue[n_epilogue++] = new_assignment(global, new_identifier(local));
+
+        size_t n_write_backs = 0;
+        for (size_t j = 0; j < n_escapes; j++) {
+            bool returns = escapes[j]->type == RETURN_STATEMENT;
+            if (!returns && !calls_use(escapes[j], global))
+                continue;
+            node_t *block = insert_before(loop, escapes[j], new_assignment(global, new_identifier(local)));
+            assert(block != NULL);
+            n_write_backs++;
+            if (returns)
+                continue;
+            bool inserted = insert_after(loop, escapes[j], new_assignment(local, new_identifier(global)));
+            assert(inserted);
+        }
+        if (report_optimizations)
+            fprintf(stderr, "promote: global '%s' kept in a local variable through a loop in '%s'%s\n", global->name,
+                    current_function->name, n_write_backs > 0 ? ", written back around calls and returns" : "");
+    }
+
+    free(promotions);
+    promotions = NULL;
+    free(escapes);
+    escapes = NULL;
+}
+
+/* Finds the global variables assigned in the subtree, outside the statements making calls */
+static void find_promotable_globals(node_t *node) {
+    if ((node->type == ASSIGNMENT_STATEMENT || node->type == PRINT_STATEMENT) && contains_call(node))
+        return;
+
+    if (node->type == ASSIGNMENT_STATEMENT && node->children[0]->type == IDENTIFIER_DATA) {
+        symbol_t *global = node->children[0]->symbol;
+        if (global->type == SYMBOL_GLOBAL_VAR && get_promoted_variable(global) == NULL) {
+            promotions = realloc(promotions, (n_promotions + 1) * sizeof(*promotions));
+            promotions[n_promotions][0] = global;
+            promotions[n_promotions][1] = create_loop_variable("GLOBAL");
+            n_promotions++;
+        }
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        find_promotable_globals(node->children[i]);
+}
+
+/* Returns true if a condition of an if-statement or loop in the subtree makes a call */
+static bool has_call_in_condition(node_t *node) {
+    if ((node->type == IF_STATEMENT || node->type == WHILE_STATEMENT) && contains_call(node->children[0]))
+        return true;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (has_call_in_condition(node->children[i]))
+            return true;
+    return false;
+}
+
+/**
+ * Replaces the promoted globals in the subtree by their locals, except in the statements calling functions that
+ * may use them. The statement holds the subtree, when it is an assignment, print or return.
+ */
+static void replace_promoted_globals(node_t *node, node_t *statement) {
+    switch (node->type) {
+        case ASSIGNMENT_STATEMENT:
+        case PRINT_STATEMENT:
+        case RETURN_STATEMENT:
+            if (node->type == RETURN_STATEMENT || contains_call(node)) {
+                escapes = realloc(escapes, (n_escapes + 1) * sizeof(node_t *));
+                escapes[n_escapes++] = node;
+            }
+            statement = node;
+            break;
+        case IDENTIFIER_DATA: {
+            symbol_t *local = node->symbol != NULL ? get_promoted_variable(node->symbol) : NULL;
+            if (local != NULL && (statement == NULL || !calls_use(statement, node->symbol))) {
+                free(node->data);
+                node->data = strdup(local->name);
+                node->symbol = local;
+            }
+            return;
+        }
+        default:
+            break;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        replace_promoted_globals(node->children[i], statement);
+}
+
+static symbol_t *get_promoted_variable(symbol_t *global) {
+    for (size_t i = 0; i < n_promotions; i++)
+        if (promotions[i][0] == global)
+            return promotions[i][1];
+    return NULL;
+}
+
+/**
+ * Returns true if the node multiplies an induction variable of the loop by a factor that is invariant in
+ * the loop, which is not a small constant that is as cheap to multiply by as it is to add.
+ */
+static bool match_reducible_product(node_t *loop, node_t *node, node_t **variable, node_t **factor, node_t **step) {
+    if (node->type != EXPRESSION || node->n_children != 2 || strcmp(node->data, "*") != 0)
+        return false;
+
+    for (size_t side = 0; side < 2; side++) {
+        *variable = node->children[side];
+        *factor = node->children[1 - side];
+        if ((*variable)->type != IDENTIFIER_DATA || !is_loop_invariant(loop, *factor))
+            continue;
+        if ((*factor)->type == NUMBER_DATA) {
+            // Multiplying by these takes a single leaq or imulq of its own, like the addition would
+            int64_t value = *(int64_t *)(*factor)->data;
+            if (value >= -1 && value <= 9)
+                continue;
+        }
+        *step = get_induction_step(loop, (*variable)->symbol);
+        if (*step != NULL)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Returns the amount a basic induction variable is increased by, or NULL if the symbol is not one.
+ * A basic induction variable is a local variable or parameter assigned only once in the loop, by
+ * <variable> := <variable> + <step>, where the step is invariant in the loop.
+ */
+static node_t *get_induction_step(node_t *loop, symbol_t *symbol) {
+    if (symbol->type != SYMBOL_LOCAL_VAR && symbol->type != SYMBOL_PARAMETER)
+        return NULL;
+    if (count_assignments(loop, symbol) != 1)
+        return NULL;
+
+    node_t *value = find_assignment(loop, symbol)->children[1];
+    if (value->type != EXPRESSION || value->n_children != 2 || strcmp(value->data, "+") != 0)
+        return NULL;
+    for (size_t side = 0; side < 2; side++) {
+        node_t *same = value->children[side];
+        node_t *step = value->children[1 - side];
+        if (same->type == IDENTIFIER_DATA && same->symbol == symbol && is_loop_invariant(loop, step))
+            return step;
+    }
+    return NULL;
+}
+
+/* Returns true if the node is a number, or a local variable or parameter never assigned in the loop */
+static bool is_loop_invariant(node_t *loop, node_t *node) {
+    if (node->type == NUMBER_DATA)
+        return true;
+    if (node->type != IDENTIFIER_DATA)
+        return false;
+
+    symbol_t *symbol = node->symbol;
+    if (symbol->type != SYMBOL_LOCAL_VAR && symbol->type != SYMBOL_PARAMETER)
+        return false;
+    // Reduced variables are assigned in the loop, but the statements doing so are not placed yet
+    for (size_t i = 0; i < n_reductions; i++)
+        if (reductions[i].reduced == symbol)
+            return false;
+    return count_assignments(loop, symbol) == 0;
+}
+
+static size_t count_assignments(node_t *node, symbol_t *symbol) {
+    size_t count = 0;
+    if (node->type == ASSIGNMENT_STATEMENT && node->children[0]->type == IDENTIFIER_DATA &&
+        node->children[0]->symbol == symbol)
+        count++;
+    for (size_t i = 0; i < node->n_children; i++)
+        count += count_assignments(node->children[i], symbol);
+    return count;
+}
+
+static node_t *find_assignment(node_t *node, symbol_t *symbol) {
+    if (node->type == ASSIGNMENT_STATEMENT && node->children[0]->type == IDENTIFIER_DATA &&
+        node->children[0]->symbol == symbol)
+        return node;
+    for (size_t i = 0; i < node->n_children; i++) {
+        node_t *assignment = find_assignment(node->children[i], symbol);
+        if (assignment != NULL)
+            return assignment;
+    }
+    return NULL;
+}
+
+/**
+ * Finds the array indexed by the products of the variable and the factor in the subtree, placing it in
+ * array if it is the first one found. Returns false if a product is used for anything else, or as the
+ * index of another array.
+ */
+static bool find_indexed_array(node_t *node, symbol_t *variable, node_t *factor, symbol_t **array) {
+    for (size_t i = 0; i < node->n_children; i++) {
+        node_t *child = node->children[i];
+        bool is_product = child->type == EXPRESSION && child->n_children == 2 && strcmp(child->data, "*") == 0 &&
+                          ((child->children[0]->type == IDENTIFIER_DATA && child->children[0]->symbol == variable &&
+                            is_same_operand(child->children[1], factor)) ||
+                           (child->children[1]->type == IDENTIFIER_DATA && child->children[1]->symbol == variable &&
+                            is_same_operand(child->children[0], factor)));
+        if (!is_product) {
+            if (!find_indexed_array(child, variable, factor, array))
+                return false;
+            continue;
+        }
+
+        if (node->type != ARRAY_INDEXING || i != 1 || node->children[0]->symbol->type != SYMBOL_GLOBAL_ARRAY)
+            return false;
+        if (*array != NULL && *array != node->children[0]->symbol)
+            return false;
+        *array = node->children[0]->symbol;
+    }
+    return true;
+}
+
+/**
+ * Returns the variable the product of the variable and the factor is reduced to, creating it if this is the
+ * first time the product is seen in the loop. With an array, the variable holds the address of the element
+ * indexed by the product instead.
+ */
+static symbol_t *get_reduction(node_t *loop, node_t *variable, node_t *factor, node_t *step, symbol_t *array) {
+    symbol_t *reduced = find_reduction(variable->symbol, factor, array);
+    if (reduced != NULL)
+        return reduced;
+
+    reduced = create_loop_variable(array != NULL ? "POINTER" : "REDUCED");
+
+    // <reduced> := <variable> * <factor>, or &<array> + <variable> * <factor> * 8 for an address
+    node_t *initial = new_expression("*", copy_operand(variable), copy_operand(factor));
+
+    // <reduced> := <reduced> + <step> * <factor>, also scaled by 8 for an address
+    node_t *increment;
+    if (step->type == NUMBER_DATA && factor->type == NUMBER_DATA)
+        increment = new_number((int64_t)((uint64_t) * (int64_t *)step->data * *(int64_t *)factor->data));
+    else if (step->type == NUMBER_DATA && *(int64_t *)step->data == 1)
+        increment = copy_operand(factor);
+    else
+        increment = new_expression("*", copy_operand(step), copy_operand(factor));
+
+    if (array != NULL) {
+        node_t *address = new_expression("&", new_identifier(array), NULL);
+        initial = new_expression("+", address, new_expression("*", initial, new_number(8)));
+        if (increment->type == NUMBER_DATA)
+            *(int64_t *)increment->data = (int64_t)((uint64_t) * (int64_t *)increment->data * 8);
+        else
+            increment = new_expression("*", increment, new_number(8));
+    }
+
+    node_t *assignment = malloc(sizeof(node_t));
+    node_init(assignment, ASSIGNMENT_STATEMENT, NULL, 2, new_identifier(reduced), initial);
+    prologue = realloc(prologue, (n_prologue + 1) * sizeof(node_t *));
+    prologue[n_prologue++] = assignment;
+
+    node_t *update = malloc(sizeof(node_t));
+    node_t *sum = new_expression("+", new_identifier(reduced), increment);
+    node_init(update, ASSIGNMENT_STATEMENT, NULL, 2, new_identifier(reduced), sum);
+    updates = realloc(updates, (n_updates + 1) * sizeof(update_t));
+    updates[n_updates++] = (update_t){.after = find_assignment(loop, variable->symbol), .statement = update};
+
+    reductions = realloc(reductions, (n_reductions + 1) * sizeof(reduction_t));
+    reductions[n_reductions++] = (reduction_t){
+        .variable = variable->symbol,
+        .factor = copy_operand(factor),
+        .array = array,
+        .reduced = reduced,
+    };
+    return reduced;
+}
+
+static symbol_t *find_reduction(symbol_t *variable, node_t *factor, symbol_t *array) {
+    for (size_t i = 0; i < n_reductions; i++) {
+        reduction_t *reduction = &reductions[i];
+        if (reduction->variable == variable && is_same_operand(reduction->factor, factor) && reduction->array == array)
+            return reduction->reduced;
+    }
+    return NULL;
+}
+
+/**
+ * Computes the expressions that are evaluated more than once with the same value into a variable the first
+ * time, and reads the variable the other times. Values are numbered through the statements in the order they
+ * run, and each is available to the statements it dominates, which follow it in its block, or are nested in
+ * them, until one of them may change what it reads. Loops only keep the values none of their statements change.
+ * Global variables and array elements are memory, which calls change if the function called may write them.
+ */
+static void eliminate_common_subexpressions(symbol_t *function) {
+    n_values = n_reused_values = 0;
+    number_values_in_statement(function->node->children[2]);
+    if (report_optimizations && n_reused_values > 0)
+        fprintf(stderr, "cse: %zu values reused in '%s'\n", n_reused_values, function->name);
+
+    free(values);
+    values = NULL;
+    values_capacity = 0;
+}
+
+static void number_values_in_statement(node_t *statement) {
+    switch (statement->type) {
+        case BLOCK: {
+            node_t *statement_list = statement->children[statement->n_children - 1];
+            size_t outer_values = n_values;
+            for (size_t i = 0; i < statement_list->n_children; i++) {
+                node_t *child = statement_list->children[i];
+                number_values_in_statement(child);
+                // The variables of reused values are assigned in front of the statement, moving it down the list
+                while (statement_list->children[i] != child)
+                    i++;
+            }
+            n_values = outer_values;
+            break;
+        }
+        case ASSIGNMENT_STATEMENT: {
+            // Expressions can not be moved in front of a call that may change what they read, or print before they trap
+            bool makes_call = contains_call(statement);
+            if (makes_call)
+                kill_values_written_by_calls(statement);
+            node_t *destination = statement->children[0];
+            number_values_in_expression(&statement->children[1], statement, !makes_call);
+            if (destination->type != IDENTIFIER_DATA)
+                number_values_in_expression(&destination->children[1], statement, !makes_call);
+            kill_values_changed_by(destination);
+            break;
+        }
+        case RETURN_STATEMENT: {
+            bool makes_call = contains_call(statement);
+            if (makes_call)
+                kill_values_written_by_calls(statement);
+            number_values_in_expression(&statement->children[0], statement, !makes_call);
+            break;
+        }
+        case PRINT_STATEMENT: {
+            // Every item is printed before the next is evaluated, and printing changes no memory
+            bool makes_call = contains_call(statement);
+            if (makes_call)
+                kill_values_written_by_calls(statement);
+            for (size_t i = 0; i < statement->n_children; i++) {
+                node_t *item = statement->children[i];
+                if (item->type != STRING_DATA)
+                    number_values_in_expression(&statement->children[i], statement, !makes_call && (i == 0 || !can_trap(item)));
+            }
+            break;
+        }
+        case IF_STATEMENT: {
+            node_t *relation = statement->children[0];
+            bool makes_call = contains_call(relation);
+            if (makes_call)
+                kill_values_written_by_calls(relation);
+            for (size_t i = 0; i < relation->n_children; i++)
+                number_values_in_expression(&relation->children[i], statement, !makes_call);
+
+            // What is computed in one branch is not available in the other, or after the if-statement
+            size_t outer_values = n_values;
+            for (size_t i = 1; i < statement->n_children; i++) {
+                number_values_in_statement(statement->children[i]);
+                n_values = outer_values;
+            }
+            break;
+        }
+        case WHILE_STATEMENT: {
+            // The condition runs again after the body, so it only reuses values, without making new ones
+            kill_values(statement);
+            node_t *relation = statement->children[0];
+            for (size_t i = 0; i < relation->n_children; i++)
+                number_values_in_expression(&relation->children[i], NULL, false);
+
+            size_t outer_values = n_values;
+            for (size_t i = 1; i < statement->n_children; i++) {
+                number_values_in_statement(statement->children[i]);
+                n_values = outer_values;
+            }
+            break;
+        }
+        case BREAK_STATEMENT:
+            break;
+        default:
+            // Vectorized loops keep the shape the generator expects
+            kill_values(statement);
+            break;
+    }
+}
+
+/**
+ * Numbers the values computed by the expression in the slot and the expressions inside it, replacing the
+ * ones already available. Values that are found for the first time are made available to what follows,
+ * placing their variable in front of the anchor if they are reused. Movable is false if the statement does
+ * something that could tell that expressions reading memory, or that can trap, were evaluated before it.
+ */
+static void number_values_in_expression(node_t **slot, node_t *anchor, bool movable) {
+    node_t *node = *slot;
+    switch (node->type) {
+        case IDENTIFIER_DATA:
+            break;
+        case ARRAY_INDEXING:
+        case POINTER_INDEXING:
+            number_values_in_expression(&node->children[1], anchor, movable);
+            break;
+        case EXPRESSION: {
+            // The value returned by a call is never the same, but its arguments can be
+            if (is_call(node)) {
+                node_t *arguments = node->children[1];
+                for (size_t i = 0; i < arguments->n_children; i++)
+                    number_values_in_expression(&arguments->children[i], anchor, movable);
+                return;
+            }
+            for (size_t i = 0; i < node->n_children; i++)
+                number_values_in_expression(&node->children[i], anchor, movable);
+            break;
+        }
+        default:
+            return;
+    }
+    // Operations on the values returned by calls are not the same from one evaluation to the next either
+    if (!is_worth_numbering(node) || contains_call(node))
+        return;
+
+    for (size_t i = 0; i < n_values; i++) {
+        if (!values[i].killed && values[i].expression != node && is_same_expression(values[i].expression, node)) {
+            reuse_value(i, slot);
+            return;
+        }
+    }
+
+    if (anchor == NULL || (!movable && (reads_memory(node) || can_trap(node))))
+        return;
+    if (n_values == values_capacity) {
+        values_capacity = values_capacity == 0 ? 16 : values_capacity * 2;
+        values = realloc(values, values_capacity * sizeof(value_t));
+    }
+    values[n_values++] = (value_t){.expression = node, .slot = slot, .anchor = anchor};
+}
+
+/**
+ * Returns true for the expressions that are more expensive to evaluate again than to keep in a variable:
+ * loads from memory, multiplications and divisions, and operations on the results of other operations.
+ */
+static bool is_worth_numbering(node_t *node) {
+    switch (node->type) {
+        case IDENTIFIER_DATA:
+            return node->symbol->type == SYMBOL_GLOBAL_VAR;
+        case ARRAY_INDEXING:
+        case POINTER_INDEXING:
+            return true;
+        case EXPRESSION: {
+            if (strcmp(node->data, "*") == 0 || strcmp(node->data, "/") == 0)
+                return true;
+            for (size_t i = 0; i < node->n_children; i++) {
+                node_t *child = node->children[i];
+                if (child->type != NUMBER_DATA && (child->type != IDENTIFIER_DATA || is_worth_numbering(child)))
+                    return true;
+            }
+            return false;
+        }
+        default:
+            return false;
+    }
+}
+
+/* Replaces the expression in the slot by the variable of the value, which is assigned the value the first time */
+static void reuse_value(size_t index, node_t **slot) {
+    value_t *value = &values[index];
+    node_t *node = *slot;
+    if (value->variable == NULL) {
+        symbol_t *variable = create_variable("VALUE");
+        node_t *assignment = new_assignment(variable, value->expression);
+        *value->slot = new_identifier(variable);
+
+        // The values found inside the expression are now computed by the assignment
+        for (size_t i = 0; i < n_values; i++)
+            if (i != index && values[i].variable == NULL && references_node(value->expression, values[i].expression))
+                values[i].anchor = assignment;
+
+        node_t *block = insert_before(current_function->node, value->anchor, assignment);
+        assert(block != NULL && "The statement of a value is in the function");
+        declare_in_block(block, variable->node);
+        value->variable = variable;
+        value->slot = NULL;
+    }
+
+    // The values found inside the replaced expression go away with it
+    for (size_t i = 0; i < n_values; i++)
+        if (values[i].variable == NULL && references_node(node, values[i].expression))
+            values[i].killed = true;
+
+    *slot = new_identifier(value->variable);
+    destroy_subtree(node);
+    n_reused_values++;
+}
+
+/* Kills the values read by the subtree that its assignments and calls may change */
+static void kill_values(node_t *node) {
+    if (node->type == ASSIGNMENT_STATEMENT)
+        kill_values_changed_by(node->children[0]);
+    if (is_call(node))
+        kill_values_written_by_calls(node);
+    for (size_t i = 0; i < node->n_children; i++)
+        kill_values(node->children[i]);
+}
+
+/* Kills the values reading the variable or element assigned */
+static void kill_values_changed_by(node_t *destination) {
+    for (size_t i = 0; i < n_values; i++) {
+        node_t *expression = values[i].expression;
+        if (destination->type == IDENTIFIER_DATA)
+            values[i].killed |= references_symbol(expression, destination->symbol);
+        else if (destination->type == ARRAY_INDEXING)
+            values[i].killed |= reads_elements(expression, destination->children[0]->symbol);
+        else
+            values[i].killed |= reads_elements(expression, NULL);
+    }
+}
+
+/* Kills the values reading global variables or arrays that the calls in the subtree may change */
+static void kill_values_written_by_calls(node_t *calls) {
+    for (size_t i = 0; i < n_values; i++)
+        values[i].killed |= is_written_by_calls(values[i].expression, calls);
+}
+
+static bool is_written_by_calls(node_t *node, node_t *calls) {
+    switch (node->type) {
+        case IDENTIFIER_DATA:
+            return node->symbol->type == SYMBOL_GLOBAL_VAR && calls_access(calls, node->symbol, function_writes);
+        case ARRAY_INDEXING:
+            if (calls_access(calls, node->children[0]->symbol, function_writes))
+                return true;
+            break;
+        case POINTER_INDEXING:
+            // The pointer can point into any array
+            if (calls_access(calls, NULL, function_writes))
+                return true;
+            break;
+        default:
+            break;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (is_written_by_calls(node->children[i], calls))
+            return true;
+    return false;
+}
+
+static bool reads_memory(node_t *node) {
+    if (node->type == ARRAY_INDEXING || node->type == POINTER_INDEXING)
+        return true;
+    if (node->type == IDENTIFIER_DATA && node->symbol->type == SYMBOL_GLOBAL_VAR)
+        return true;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (reads_memory(node->children[i]))
+            return true;
+    return false;
+}
+
+/**
+ * Returns true if the expression reads an element of the array, or through a pointer, which can point into any
+ * array. Any element at all is looked for when the array is NULL.
+ */
+static bool reads_elements(node_t *node, symbol_t *array) {
+    if (node->type == POINTER_INDEXING)
+        return true;
+    if (node->type == ARRAY_INDEXING && (array == NULL || node->children[0]->symbol == array))
+        return true;
+    for (size_t i = 0; i < node->n_children; i++)
+        if (reads_elements(node->children[i], array))
+            return true;
+    return false;
+}
+
+/* Returns true if evaluating the expression could fault, by dividing by 0 or -1, or reading outside of an array */
+static bool can_trap(node_t *node) {
+    if (node->type == POINTER_INDEXING || contains_variable_element(node))
+        return true;
+    if (node->type == EXPRESSION && strcmp(node->data, "/") == 0) {
+        node_t *divisor = node->children[1];
+        int64_t value = divisor->type == NUMBER_DATA ? *(int64_t *)divisor->data : 0;
+        if (value == 0 || value == -1)
+            return true;
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        if (can_trap(node->children[i]))
+            return true;
+    return false;
+}
+
+/* Creates a local variable of the current function, declared in front of the loop being optimized */
+static symbol_t *create_loop_variable(const char *prefix) {
+    symbol_t *symbol = create_variable(prefix);
+    declarations = realloc(declarations, (n_declarations + 1) * sizeof(node_t *));
+    declarations[n_declarations++] = symbol->node;
+    return symbol;
+}
+
+/* Creates a local variable of the current function. Its identifier is left for the caller to declare */
+static symbol_t *create_variable(const char *prefix) {
+    node_t *identifier = malloc(sizeof(node_t));
+    symbol_t *symbol = malloc(sizeof(symbol_t));
+    symbol->type = SYMBOL_LOCAL_VAR;
+    symbol->node = identifier;
+    symbol->function_symtable = current_function->function_symtable;
+
+    // The names are numbered, skipping any that the function's parameters happen to use already
+    char name[32];
+    do {
+        snprintf(name, sizeof(name), "__%s%zu__", prefix, n_created_variables++);
+        node_init(identifier, IDENTIFIER_DATA, strdup(name), 0);
+        symbol->name = identifier->data;
+        if (symbol_table_insert(current_function->function_symtable, symbol) == INSERT_OK)
+            break;
+        free(identifier->data);
+        free(identifier->children);
+    } while (true);
+    return symbol;
+}
+
+/* Places the new statement right after the statement, somewhere in the subtree. Returns false if it is not found */
+static bool insert_after(node_t *node, node_t *statement, node_t *new_statement) {
+    for (size_t i = 0; i < node->n_children; i++) {
+        if (node->children[i] != statement) {
+            if (insert_after(node->children[i], statement, new_statement))
+                return true;
+            continue;
+        }
+
+        if (node->type == STATEMENT_LIST) {
+            node->children = realloc(node->children, (node->n_children + 1) * sizeof(node_t *));
+            memmove(&node->children[i + 2], &node->children[i + 1], (node->n_children - i - 1) * sizeof(node_t *));
+            node->children[i + 1] = new_statement;
+            node->n_children++;
+        } else {
+            // A lone statement, like the body of an if statement, becomes a block of both
+            node_t *statement_list = malloc(sizeof(node_t));
+            node_init(statement_list, STATEMENT_LIST, NULL, 2, statement, new_statement);
+            node_t *block = malloc(sizeof(node_t));
+            node_init(block, BLOCK, NULL, 1, statement_list);
+            node->children[i] = block;
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Places the new statement right in front of the statement, somewhere in the subtree.
+ * Returns the block it ends up in, or NULL if the statement is not found.
+ */
+static node_t *insert_before(node_t *node, node_t *statement, node_t *new_statement) {
+    if (node->type == BLOCK) {
+        node_t *statement_list = node->children[node->n_children - 1];
+        for (size_t i = 0; i < statement_list->n_children; i++) {
+            if (statement_list->children[i] != statement)
+                continue;
+            statement_list->children = realloc(statement_list->children, (statement_list->n_children + 1) * sizeof(node_t *));
+            memmove(&statement_list->children[i + 1], &statement_list->children[i],
+                    (statement_list->n_children - i) * sizeof(node_t *));
+            statement_list->children[i] = new_statement;
+            statement_list->n_children++;
+            return node;
+        }
+    }
+
+    for (size_t i = 0; i < node->n_children; i++) {
+        if (node->children[i] == statement) {
+            // A lone statement, like the body of an if statement, becomes a block of both
+            node_t *statement_list = malloc(sizeof(node_t));
+            node_init(statement_list, STATEMENT_LIST, NULL, 2, new_statement, statement);
+            node_t *block = malloc(sizeof(node_t));
+            node_init(block, BLOCK, NULL, 1, statement_list);
+            node->children[i] = block;
+            return block;
+        }
+        node_t *block = insert_before(node->children[i], statement, new_statement);
+        if (block != NULL)
+            return block;
+    }
+    return NULL;
+}
+
+static node_t *new_identifier(symbol_t *symbol) {
+    node_t *identifier = malloc(sizeof(node_t));
+    node_init(identifier, IDENTIFIER_DATA, strdup(symbol->name), 0);
+    identifier->symbol = symbol;
+    return identifier;
+}
+
+static node_t *new_number(int64_t value) {
+    int64_t *data = malloc(sizeof(int64_t));
+    *data = value;
+    node_t *number = malloc(sizeof(node_t));
+    node_init(number, NUMBER_DATA, data, 0);
+    return number;
+}
+
+/* Creates a binary expression, or a unary one when right is NULL */
+static node_t *new_expression(const char *operator, node_t *left, node_t *right) {
+    node_t *expression = malloc(sizeof(node_t));
+    if (right == NULL)
+        node_init(expression, EXPRESSION, strdup(operator), 1, left);
+    else
+        node_init(expression, EXPRESSION, strdup(operator), 2, left, right);
+    return expression;
+}
+
+static node_t *new_assignment(symbol_t *variable, node_t *expression) {
+    node_t *assignment = malloc(sizeof(node_t));
+    node_init(assignment, ASSIGNMENT_STATEMENT, NULL, 2, new_identifier(variable), expression);
+    return assignment;
+}
+
+static node_t *new_element(symbol_t *array, node_t *index) {
+    node_t *element = malloc(sizeof(node_t));
+    node_init(element, ARRAY_INDEXING, NULL, 2, new_identifier(array), index);
+    return element;
+}
+
+static node_t *new_relation(const char *operator, node_t *left, node_t *right) {
+    node_t *relation = malloc(sizeof(node_t));
+    node_init(relation, RELATION, strdup(operator), 2, left, right);
+    return relation;
+}
+
+/* Creates a statement of the type with up to two children, leaving out those that are NULL */
+static node_t *new_statement(node_type_t type, node_t *first, node_t *second) {
+    node_t *statement = malloc(sizeof(node_t));
+    if (first == NULL)
+        node_init(statement, type, NULL, 0);
+    else if (second == NULL)
+        node_init(statement, type, NULL, 1, first);
+    else
+        node_init(statement, type, NULL, 2, first, second);
+    return statement;
+}
+
+/* Creates a block of the statements, declaring the identifiers, if there are any */
+static node_t *new_block(node_t **statements, size_t n_statements, node_t **declared, size_t n_declared) {
+    node_t *statement_list = malloc(sizeof(node_t));
+    node_init(statement_list, STATEMENT_LIST, NULL, 0);
+    statement_list->n_children = n_statements;
+    statement_list->children = realloc(statement_list->children, n_statements * sizeof(node_t *));
+    memcpy(statement_list->children, statements, n_statements * sizeof(node_t *));
+
+    node_t *block = malloc(sizeof(node_t));
+    if (n_declared == 0) {
+        node_init(block, BLOCK, NULL, 1, statement_list);
+        return block;
+    }
+
+    node_t *declaration = malloc(sizeof(node_t));
+    node_init(declaration, DECLARATION, NULL, 0);
+    declaration->n_children = n_declared;
+    declaration->children = realloc(declaration->children, n_declared * sizeof(node_t *));
+    memcpy(declaration->children, declared, n_declared * sizeof(node_t *));
+    node_t *declaration_list = malloc(sizeof(node_t));
+    node_init(declaration_list, DECLARATION_LIST, NULL, 1, declaration);
+    node_init(block, BLOCK, NULL, 2, declaration_list, statement_list);
+    return block;
+}
+
+/* Adds the identifier to the variables declared by the block */
+static void declare_in_block(node_t *block, node_t *identifier) {
+    if (block->n_children == 1) {
+        node_t *declaration = malloc(sizeof(node_t));
+        node_init(declaration, DECLARATION, NULL, 1, identifier);
+        node_t *declaration_list = malloc(sizeof(node_t));
+        node_init(declaration_list, DECLARATION_LIST, NULL, 1, declaration);
+        block->children = realloc(block->children, 2 * sizeof(node_t *));
+        block->children[1] = block->children[0];
+        block->children[0] = declaration_list;
+        block->n_children = 2;
+        return;
+    }
+
+    node_t *declaration = block->children[0]->children[0];
+    declaration->children = realloc(declaration->children, (declaration->n_children + 1) * sizeof(node_t *));
+    declaration->children[declaration->n_children++] = identifier;
+}
+
+/* Copies a number or a variable */
+static node_t *copy_operand(node_t *node) {
+    if (node->type == NUMBER_DATA)
+        return new_number(*(int64_t *)node->data);
+    assert(node->type == IDENTIFIER_DATA);
+    return new_identifier(node->symbol);
+}
+
+static bool is_same_operand(node_t *a, node_t *b) {
+    if (a->type == NUMBER_DATA && b->type == NUMBER_DATA)
+        return *(int64_t *)a->data == *(int64_t *)b->data;
+    return a->type == IDENTIFIER_DATA && b->type == IDENTIFIER_DATA && a->symbol == b->symbol;
+}
@@ -0,0 +1,600 @@
+#include <vslc.h>
+
+#include "emit.h"
+#include "peephole.h"
+
+// How many instructions ahead are searched for the pop matching a push, or the next use of a register
+#define WINDOW_SIZE 8
+
+#define MAX_OPERANDS 3
+#define OPERAND_LENGTH 64
+
+/* One emitted line. Labels and directives are kept as they are, while instructions start with a tab */
+typedef struct {
+    char *text;
+    bool removed;
+} line_t;
+
+/* An instruction split into its mnemonic and operands */
+typedef struct {
+    char mnemonic[16];
+    char operands[MAX_OPERANDS][OPERAND_LENGTH];
+    size_t n_operands;
+} instruction_t;
+
+typedef enum {
+    REWRITE_PUSH_POP,
+    REWRITE_STORE_RELOAD,
+    REWRITE_REDUNDANT_MOVE,
+    REWRITE_COPY_PROPAGATION,
+    REWRITE_JUMP_TO_NEXT,
+    REWRITE_INVERTED_BRANCH,
+    REWRITE_JUMP_THREADING,
+    REWRITE_UNREACHABLE_CODE,
+    NUM_REWRITES
+} rewrite_t;
+
+static const char *REWRITE_NAMES[NUM_REWRITES] = {
+    "push/pop pairs turned into moves",
+    "reloads of a value just stored",
+    "redundant moves",
+    "moves propagated into their use",
+    "jumps to the next instruction",
+    "branches inverted around a jump",
+    "jumps threaded through a jump",
+    "unreachable instructions",
+};
+
+// The 64-bit registers, followed by the names of their lower 32, 16 and 8 bits
+static const char *REGISTER_NAMES[][5] = {
+    {"rax", "eax", "ax", "al", "ah"},  {"rbx", "ebx", "bx", "bl", "bh"},  {"rcx", "ecx", "cx", "cl", "ch"},
+    {"rdx", "edx", "dx", "dl", "dh"},  {"rsi", "esi", "si", "sil", ""},   {"rdi", "edi", "di", "dil", ""},
+    {"rbp", "ebp", "bp", "bpl", ""},   {"rsp", "esp", "sp", "spl", ""},   {"r8", "r8d", "r8w", "r8b", ""},
+    {"r9", "r9d", "r9w", "r9b", ""},   {"r10", "r10d", "r10w", "r10b", ""}, {"r11", "r11d", "r11w", "r11b", ""},
+    {"r12", "r12d", "r12w", "r12b", ""}, {"r13", "r13d", "r13w", "r13b", ""}, {"r14", "r14d", "r14w", "r14b", ""},
+    {"r15", "r15d", "r15w", "r15b", ""},
+};
+#define NUM_REGISTERS (sizeof(REGISTER_NAMES) / sizeof(*REGISTER_NAMES))
+
+// Bitmasks of registers, indexed like REGISTER_NAMES
+#define BIT(index) (1u << (index))
+#define RAX_BIT BIT(0)
+#define RDX_BIT BIT(3)
+#define RBP_BIT BIT(6)
+#define RSP_BIT BIT(7)
+// Callee-saved registers are restored before returning, so they are read by ret
+#define CALLEE_SAVED_BITS (BIT(1) | BIT(12) | BIT(13) | BIT(14) | BIT(15))
+// rdi, rsi, rdx, rcx, r8, r9, r10 and r11 carry arguments into the functions of the program,
+// and %al the number of vector registers with arguments into printf
+#define ARGUMENT_BITS (BIT(5) | BIT(4) | BIT(3) | BIT(2) | BIT(8) | BIT(9) | BIT(10) | BIT(11))
+
+static line_t *lines;
+static size_t n_lines, lines_capacity;
+
+static size_t rewrite_counts[NUM_REWRITES];
+
+static bool apply_rewrites(size_t index);
+static bool parse_instruction(const char *text, instruction_t *instruction);
+
+/* External interface */
+
+void emit_line(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *text = malloc(length + 1);
+    va_start(args, format);
+    vsnprintf(text, length + 1, format, args);
+    va_end(args);
+
+    if (n_lines == lines_capacity) {
+        lines_capacity = lines_capacity == 0 ? 1024 : lines_capacity * 2;
+        lines = realloc(lines, lines_capacity * sizeof(line_t));
+    }
+    lines[n_lines++] = (line_t){.text = text, .removed = false};
+}
+
+void peephole_optimize(void) {
+    // Every rewrite removes or simplifies an instruction, so this stops eventually
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 0; i < n_lines; i++)
+            if (!lines[i].removed)
+                changed |= apply_rewrites(i);
+    }
+
+    if (report_optimizations) {
+        for (size_t i = 0; i < NUM_REWRITES; i++)
+            fprintf(stderr, "peephole: %zu %s\n", rewrite_counts[i], REWRITE_NAMES[i]);
+    }
+}
+
+void flush_emitted_lines(void) {
+    for (size_t i = 0; i < n_lines; i++) {
+        if (!lines[i].removed)
+            printf("%s\n", lines[i].text);
+        free(lines[i].text);
+    }
+    free(lines);
+    lines = NULL;
+    n_lines = lines_capacity = 0;
+}
+
+size_t count_emitted_lines(void) {
+    return n_lines;
+}
+
+void discard_emitted_lines(size_t first) {
+    assert(first <= n_lines);
+    for (size_t i = first; i < n_lines; i++)
+        free(lines[i].text);
+    n_lines = first;
+}
+
+uint32_t register_mask(const char *text) {
+    uint32_t mask = 0;
+    for (const char *c = strchr(text, '%'); c != NULL; c = strchr(c + 1, '%')) {
+        size_t length = strspn(c + 1, "abcdehilnoprstwxz0123456789");
+        for (size_t i = 0; i < NUM_REGISTERS; i++) {
+            for (size_t j = 0; j < 5; j++) {
+                const char *name = REGISTER_NAMES[i][j];
+                if (name[0] != '\0' && strlen(name) == length && strncmp(c + 1, name, length) == 0)
+                    mask |= BIT(i);
+            }
+        }
+    }
+    return mask;
+}
+
+uint32_t registers_named_since(size_t first_line) {
+    uint32_t mask = 0;
+    for (size_t i = first_line; i < n_lines; i++)
+        if (!lines[i].removed)
+            mask |= register_mask(lines[i].text);
+    return mask;
+}
+
+size_t count_emitted_bytes_since(size_t first_line) {
+    size_t bytes = 0;
+    for (size_t i = first_line; i < n_lines; i++)
+        if (!lines[i].removed)
+            bytes += strlen(lines[i].text) + 1;
+    return bytes;
+}
+
+/* Inner workings */
+
+static bool is_instruction(size_t index) {
+    return lines[index].text[0] == '\t';
+}
+
+static bool is_label(size_t index) {
+    const char *text = lines[index].text;
+    size_t length = strlen(text);
+    return length > 1 && text[length - 1] == ':' && strchr(text, ' ') == NULL && text[0] != '\t';
+}
+
+static bool is_label_named(size_t index, const char *name) {
+    size_t length = strlen(name);
+    return is_label(index) && strncmp(lines[index].text, name, length) == 0 && lines[index].text[length] == ':';
+}
+
+/* Returns the index of the next line that has not been removed, or n_lines if there is none */
+static size_t next_line(size_t index) {
+    do {
+        index++;
+    } while (index < n_lines && lines[index].removed);
+    return index;
+}
+
+/* Returns the first line after the given one, and any labels directly following it */
+static size_t skip_labels(size_t index) {
+    index = next_line(index);
+    while (index < n_lines && is_label(index))
+        index = next_line(index);
+    return index;
+}
+
+/* Returns true if one of the labels directly following the given line is the named one */
+static bool is_followed_by_label(size_t index, const char *name) {
+    for (index = next_line(index); index < n_lines && is_label(index); index = next_line(index))
+        if (is_label_named(index, name))
+            return true;
+    return false;
+}
+
+static size_t find_label(const char *name) {
+    for (size_t i = 0; i < n_lines; i++)
+        if (!lines[i].removed && is_label_named(i, name))
+            return i;
+    return n_lines;
+}
+
+static void replace_line(size_t index, const char *format, ...) {
+    char text[3 * OPERAND_LENGTH + 32];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    free(lines[index].text);
+    lines[index].text = strdup(text);
+}
+
+static void remove_line(size_t index) {
+    lines[index].removed = true;
+}
+
+/* Splits an instruction into its mnemonic and operands. Returns false for anything else */
+static bool parse_instruction(const char *text, instruction_t *instruction) {
+    if (text[0] != '\t')
+        return false;
+    text++;
+
+    size_t length = strcspn(text, " ");
+    if (length >= sizeof(instruction->mnemonic))
+        return false;
+    memcpy(instruction->mnemonic, text, length);
+    instruction->mnemonic[length] = '\0';
+    text += length;
+
+    // Operands are separated by commas, except for the ones inside the parentheses of a memory operand
+    instruction->n_operands = 0;
+    while (*text != '\0') {
+        while (*text == ' ' || *text == ',')
+            text++;
+        if (*text == '\0')
+            break;
+        if (instruction->n_operands == MAX_OPERANDS)
+            return false;
+
+        char *operand = instruction->operands[instruction->n_operands++];
+        size_t operand_length = 0;
+        int depth = 0;
+        while (*text != '\0' && (depth > 0 || *text != ',')) {
+            if (*text == '(')
+                depth++;
+            else if (*text == ')')
+                depth--;
+            if (operand_length + 1 == OPERAND_LENGTH)
+                return false;
+            operand[operand_length++] = *text++;
+        }
+        while (operand_length > 0 && operand[operand_length - 1] == ' ')
+            operand_length--;
+        operand[operand_length] = '\0';
+    }
+    return true;
+}
+
+static bool is_register(const char *operand) {
+    return operand[0] == '%';
+}
+
+/* The xmm and ymm registers of the vectorized loops */
+static bool is_vector_register(const char *operand) {
+    return strncmp(operand, "%xmm", 4) == 0 || strncmp(operand, "%ymm", 4) == 0;
+}
+
+static bool is_memory(const char *operand) {
+    return strchr(operand, '(') != NULL;
+}
+
+/* Returns true if the operand is an immediate, that fits in the sign extended 32 bits most instructions take */
+static bool is_small_immediate(const char *operand) {
+    if (operand[0] != '$')
+        return false;
+    char *end;
+    long long value = strtoll(operand + 1, &end, 10);
+    return *end == '\0' && end != operand + 1 && value >= INT32_MIN && value <= INT32_MAX;
+}
+
+static bool is_jump_target(const char *operand) {
+    return !is_register(operand) && operand[0] != '*' && operand[0] != '$' && !is_memory(operand);
+}
+
+/* Reading from a register, or from memory addressed by it */
+static uint32_t read_mask(const char *operand) {
+    return register_mask(operand);
+}
+
+/* Only registers are written, as registers in a memory operand are read to find the address */
+static uint32_t write_mask(const char *operand) {
+    return is_register(operand) ? register_mask(operand) : 0;
+}
+
+static bool is_mnemonic(const instruction_t *instruction, const char *mnemonic) {
+    return strcmp(instruction->mnemonic, mnemonic) == 0;
+}
+
+static bool is_conditional_jump(const instruction_t *instruction) {
+    static const char *JUMPS[] = {"je", "jne", "jl", "jle", "jg", "jge"};
+    for (size_t i = 0; i < sizeof(JUMPS) / sizeof(*JUMPS); i++)
+        if (is_mnemonic(instruction, JUMPS[i]))
+            return instruction->n_operands == 1;
+    return false;
+}
+
+static const char *invert_condition(const char *jump) {
+    static const char *PAIRS[][2] = {{"je", "jne"}, {"jl", "jge"}, {"jg", "jle"}};
+    for (size_t i = 0; i < sizeof(PAIRS) / sizeof(*PAIRS); i++) {
+        if (strcmp(jump, PAIRS[i][0]) == 0)
+            return PAIRS[i][1];
+        if (strcmp(jump, PAIRS[i][1]) == 0)
+            return PAIRS[i][0];
+    }
+    assert(false && "Unknown conditional jump");
+    return NULL;
+}
+
+/**
+ * Finds the registers read and written by a straight-line instruction.
+ * Returns false for control flow and for instructions the optimizer does not know,
+ * which must be assumed to do anything.
+ */
+static bool get_effects(const instruction_t *instruction, uint32_t *reads, uint32_t *writes) {
+    const char(*op)[OPERAND_LENGTH] = instruction->operands;
+    size_t n = instruction->n_operands;
+    *reads = *writes = 0;
+
+    if ((is_mnemonic(instruction, "movq") || is_mnemonic(instruction, "movl") || is_mnemonic(instruction, "leaq")) && n == 2) {
+        *reads = read_mask(op[0]) | (is_register(op[1]) ? 0 : read_mask(op[1]));
+        *writes = write_mask(op[1]);
+    } else if ((is_mnemonic(instruction, "xorl") || is_mnemonic(instruction, "xorq")) && n == 2 &&
+               strcmp(op[0], op[1]) == 0 && is_register(op[0])) {
+        *writes = write_mask(op[1]);  // Zeroing a register does not depend on its value
+    } else if ((is_mnemonic(instruction, "addq") || is_mnemonic(instruction, "subq") || is_mnemonic(instruction, "imulq") ||
+                is_mnemonic(instruction, "andq") || is_mnemonic(instruction, "orq") || is_mnemonic(instruction, "xorq") ||
+                is_mnemonic(instruction, "xorl") || is_mnemonic(instruction, "shlq") || is_mnemonic(instruction, "sarq") ||
+                is_mnemonic(instruction, "shrq")) && n == 2) {
+        *reads = read_mask(op[0]) | read_mask(op[1]);
+        *writes = write_mask(op[1]);
+    } else if (strncmp(instruction->mnemonic, "cmov", 4) == 0 && n == 2) {
+        // The destination keeps its value when the condition does not hold
+        *reads = read_mask(op[0]) | read_mask(op[1]);
+        *writes = write_mask(op[1]);
+    } else if (is_mnemonic(instruction, "imulq") && n == 1) {
+        *reads = RAX_BIT | read_mask(op[0]);
+        *writes = RAX_BIT | RDX_BIT;
+    } else if (is_mnemonic(instruction, "imulq") && n == 3) {
+        *reads = read_mask(op[0]) | read_mask(op[1]);
+        *writes = write_mask(op[2]);
+    } else if ((is_mnemonic(instruction, "negq") || is_mnemonic(instruction, "notq")) && n == 1) {
+        *reads = read_mask(op[0]);
+        *writes = write_mask(op[0]);
+    } else if ((is_mnemonic(instruction, "cmpq") || is_mnemonic(instruction, "testq")) && n == 2) {
+        *reads = read_mask(op[0]) | read_mask(op[1]);
+    } else if (is_mnemonic(instruction, "pushq") && n == 1) {
+        *reads = read_mask(op[0]) | RSP_BIT;
+        *writes = RSP_BIT;
+    } else if (is_mnemonic(instruction, "popq") && n == 1) {
+        *reads = RSP_BIT | (is_register(op[0]) ? 0 : read_mask(op[0]));
+        *writes = RSP_BIT | write_mask(op[0]);
+    } else if (is_mnemonic(instruction, "cqo") && n == 0) {
+        *reads = RAX_BIT;
+        *writes = RDX_BIT;
+    } else if (is_mnemonic(instruction, "idivq") && n == 1) {
+        *reads = RAX_BIT | RDX_BIT | read_mask(op[0]);
+        *writes = RAX_BIT | RDX_BIT;
+    } else if (is_mnemonic(instruction, "call") && n == 1) {
+        // The functions of the program leave the registers they do not use alone, so only the returned
+        // value is certain to be written. Any other register the callee changes is dead at the call anyway
+        *reads = ARGUMENT_BITS | RAX_BIT | RSP_BIT;
+        *writes = RAX_BIT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Returns true if the value in the register is never read after the given instruction */
+static bool is_dead_after(size_t index, uint32_t reg) {
+    size_t seen = 0;
+    for (size_t i = next_line(index); i < n_lines && seen < WINDOW_SIZE; i = next_line(i)) {
+        // Falling through a label continues the same path
+        if (is_label(i))
+            continue;
+
+        instruction_t instruction;
+        if (!parse_instruction(lines[i].text, &instruction))
+            return false;
+        if (is_mnemonic(&instruction, "ret"))
+            return (reg & (RAX_BIT | RSP_BIT | RBP_BIT | CALLEE_SAVED_BITS)) == 0;
+
+        uint32_t reads, writes;
+        if (!get_effects(&instruction, &reads, &writes))
+            return false;
+        if (reads & reg)
+            return false;
+        if (writes & reg)
+            return true;
+        seen++;
+    }
+    return false;
+}
+
+/* Removes the instructions following an unconditional jump or return, up to the next label */
+static bool remove_unreachable_code(size_t index) {
+    bool changed = false;
+    for (size_t i = next_line(index); i < n_lines && is_instruction(i); i = next_line(i)) {
+        remove_line(i);
+        rewrite_counts[REWRITE_UNREACHABLE_CODE]++;
+        changed = true;
+    }
+    return changed;
+}
+
+/* Makes a jump to a label followed directly by another jump go to the target of that jump instead */
+static bool thread_jump(size_t index, instruction_t *jump) {
+    size_t label = find_label(jump->operands[0]);
+    if (label == n_lines)
+        return false;
+
+    size_t target = skip_labels(label);
+    instruction_t target_jump;
+    if (target >= n_lines || !parse_instruction(lines[target].text, &target_jump))
+        return false;
+    if (!is_mnemonic(&target_jump, "jmp") || !is_jump_target(target_jump.operands[0]))
+        return false;
+    if (strcmp(target_jump.operands[0], jump->operands[0]) == 0 || target == index)
+        return false;
+
+    replace_line(index, "\t%s %s", jump->mnemonic, target_jump.operands[0]);
+    rewrite_counts[REWRITE_JUMP_THREADING]++;
+    return true;
+}
+
+static bool rewrite_jump(size_t index, instruction_t *jump) {
+    if (!is_jump_target(jump->operands[0]))
+        return false;
+
+    if (is_followed_by_label(index, jump->operands[0])) {
+        remove_line(index);
+        rewrite_counts[REWRITE_JUMP_TO_NEXT]++;
+        return true;
+    }
+
+    if (is_conditional_jump(jump)) {
+        // jCC a; jmp b; a: becomes jNCC b; a:
+        size_t next = next_line(index);
+        instruction_t next_jump;
+        if (next < n_lines && parse_instruction(lines[next].text, &next_jump) && is_mnemonic(&next_jump, "jmp") &&
+            is_jump_target(next_jump.operands[0]) && is_followed_by_label(next, jump->operands[0])) {
+            replace_line(index, "\t%s %s", invert_condition(jump->mnemonic), next_jump.operands[0]);
+            remove_line(next);
+            rewrite_counts[REWRITE_INVERTED_BRANCH]++;
+            return true;
+        }
+        return thread_jump(index, jump);
+    }
+
+    bool changed = remove_unreachable_code(index);
+    return thread_jump(index, jump) || changed;
+}
+
+/**
+ * Turns pushq a, followed by popq b within the window, into movq a, b.
+ * The instructions in between can not touch the stack or b.
+ */
+static bool rewrite_push(size_t index, instruction_t *push) {
+    const char *source = push->operands[0];
+    if (read_mask(source) & RSP_BIT)
+        return false;
+
+    uint32_t used = 0;  // Registers read or written between the push and the pop
+    size_t seen = 0;
+    for (size_t i = next_line(index); i < n_lines && seen < WINDOW_SIZE; i = next_line(i), seen++) {
+        instruction_t instruction;
+        if (!parse_instruction(lines[i].text, &instruction))
+            return false;
+
+        if (is_mnemonic(&instruction, "popq") && instruction.n_operands == 1) {
+            const char *destination = instruction.operands[0];
+            if (!is_register(destination) || (used & register_mask(destination)))
+                return false;
+
+            if (strcmp(source, destination) == 0)
+                remove_line(index);
+            else
+                replace_line(index, "\tmovq %s, %s", source, destination);
+            remove_line(i);
+            rewrite_counts[REWRITE_PUSH_POP]++;
+            return true;
+        }
+
+        uint32_t reads, writes;
+        if (!get_effects(&instruction, &reads, &writes) || ((reads | writes) & RSP_BIT))
+            return false;
+        used |= reads | writes;
+    }
+    return false;
+}
+
+/* Instructions reading their first operand, which a register copy can be propagated into */
+static bool can_propagate_into(const instruction_t *instruction) {
+    static const char *MNEMONICS[] = {"movq", "addq", "subq", "imulq", "andq", "orq", "cmpq"};
+    for (size_t i = 0; i < sizeof(MNEMONICS) / sizeof(*MNEMONICS); i++)
+        if (is_mnemonic(instruction, MNEMONICS[i]))
+            return instruction->n_operands == 2;
+    return false;
+}
+
+static bool rewrite_move(size_t index, instruction_t *move) {
+    const char *source = move->operands[0];
+    const char *destination = move->operands[1];
+
+    if (strcmp(source, destination) == 0) {
+        remove_line(index);
+        rewrite_counts[REWRITE_REDUNDANT_MOVE]++;
+        return true;
+    }
+
+    size_t next = next_line(index);
+    instruction_t instruction;
+    if (next >= n_lines || !parse_instruction(lines[next].text, &instruction))
+        return false;
+    const char *next_source = instruction.operands[0];
+    const char *next_destination = instruction.operands[1];
+
+    if (is_mnemonic(&instruction, "movq") && instruction.n_operands == 2) {
+        // movq a, b; movq b, a or movq a, b; movq a, b, where neither a nor b is changed by the first move
+        bool reversed = strcmp(next_source, destination) == 0 && strcmp(next_destination, source) == 0;
+        bool repeated = strcmp(next_source, source) == 0 && strcmp(next_destination, destination) == 0;
+        if ((reversed || repeated) && (register_mask(source) & register_mask(destination)) == 0) {
+            remove_line(next);
+            rewrite_counts[REWRITE_REDUNDANT_MOVE]++;
+            return true;
+        }
+
+        // movq %reg, mem; movq mem, b loads the value still in %reg
+        if (is_register(source) && is_memory(destination) && strcmp(next_source, destination) == 0) {
+            if (strcmp(next_destination, source) == 0)
+                remove_line(next);
+            else
+                replace_line(next, "\tmovq %s, %s", source, next_destination);
+            rewrite_counts[REWRITE_STORE_RELOAD]++;
+            return true;
+        }
+    }
+
+    // movq a, %reg; op %reg, b becomes op a, b, when %reg is not needed afterwards
+    uint32_t reg = register_mask(destination);
+    if (!is_register(destination) || (reg & (RSP_BIT | RBP_BIT)) || !can_propagate_into(&instruction))
+        return false;
+    if (strcmp(next_source, destination) != 0 || (register_mask(next_destination) & reg))
+        return false;
+    if (is_memory(source) && is_memory(next_destination))
+        return false;
+    // Only movq moves between vector and general purpose registers, and not with immediates
+    if (is_vector_register(source) || is_vector_register(next_destination))
+        return false;
+    if (source[0] == '$' && !is_small_immediate(source) && !(is_mnemonic(&instruction, "movq") && is_register(next_destination)))
+        return false;
+    if (!is_dead_after(next, reg))
+        return false;
+
+    replace_line(next, "\t%s %s, %s", instruction.mnemonic, source, next_destination);
+    remove_line(index);
+    rewrite_counts[REWRITE_COPY_PROPAGATION]++;
+    return true;
+}
+
+/* Tries every rewrite starting at the given line. Returns true if anything changed */
+static bool apply_rewrites(size_t index) {
+    instruction_t instruction;
+    if (!parse_instruction(lines[index].text, &instruction))
+        return false;
+
+    if ((is_mnemonic(&instruction, "jmp") || is_conditional_jump(&instruction)) && instruction.n_operands == 1)
+        return rewrite_jump(index, &instruction);
+    if (is_mnemonic(&instruction, "ret"))
+        return remove_unreachable_code(index);
+    if (is_mnemonic(&instruction, "pushq") && instruction.n_operands == 1)
+        return rewrite_push(index, &instruction);
+    if (is_mnemonic(&instruction, "movq") && instruction.n_operands == 2)
+        return rewrite_move(index, &instruction);
+    return false;
+}
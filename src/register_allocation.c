@@ -0,0 +1,573 @@
+#include <vslc.h>
+
+#include "emit.h"
+#include "register_allocation.h"
+
+// Registers that survive function calls. Using one means saving and restoring it in the function
+static const char *CALLEE_SAVED_REGISTERS[] = {RBX, R12, R13, R14, R15};
+#define NUM_CALLEE_SAVED_REGISTERS (sizeof(CALLEE_SAVED_REGISTERS) / sizeof(*CALLEE_SAVED_REGISTERS))
+
+// Registers that are free to use, but clobbered by the calls to functions writing to them.
+// %rax, %rdx and %r10 are left out, as the generator needs them to evaluate expressions.
+// The generator hands out scratch registers in the opposite order, so they are taken from here last.
+static const char *CALLER_SAVED_REGISTERS[] = {R9, R8, RDI, RSI, RCX, R11};
+#define NUM_CALLER_SAVED_REGISTERS (sizeof(CALLER_SAVED_REGISTERS) / sizeof(*CALLER_SAVED_REGISTERS))
+
+// The functions of the program pass up to 8 parameters in registers, see REGISTER_PARAMS in generator.c.
+// The first 6 always are, while the last 2 are only passed in registers if they get to stay in one
+#define NUM_REGISTER_PARAMS 8
+#define NUM_FIXED_REGISTER_PARAMS 6
+static const char *REGISTER_PARAMS[NUM_REGISTER_PARAMS] = {RDI, RSI, RDX, RCX, R8, R9, R10, R11};
+
+// Loops nested deeper than this are all considered equally hot when weighing spill candidates
+#define MAX_WEIGHTED_LOOP_DEPTH 8
+
+/**
+ * The live interval of a parameter or local variable.
+ * Positions are handed out while walking the function body in the same order as the generator
+ * emits code for it. All reads within one expression share a position, and so does every call
+ * made while evaluating it, which makes a variable read next to a call live across that call.
+ */
+typedef struct {
+    size_t start, end;
+    size_t weight;  // Number of references, where references inside loops count ten times more per loop
+    uint32_t clobbered;  // The registers changed by the calls made while the variable is live, see register_mask
+} live_interval_t;
+
+typedef struct {
+    size_t start, end;
+    // Variables that are live around the back edge of the loop, and must stay live for all of it
+    bool *extends;
+} loop_t;
+
+/* State for the function currently being allocated */
+static symbol_t *current_function;
+static size_t n_register_params;  // Parameters from here on are passed on the stack
+static size_t n_symbols;
+static live_interval_t *intervals;
+static variable_location_t *locations;
+static size_t *declaration_depths;  // How many loops enclose the declaration of each variable
+static size_t position;
+
+static loop_t *loops;
+static size_t n_loops, loops_capacity;
+static size_t *loop_stack;  // Indices into loops, for the loops enclosing the current position
+static size_t loop_depth;
+
+static size_t *call_positions;
+static uint32_t *call_clobbers;  // The registers each call can change
+static size_t n_calls, calls_capacity;
+
+// The registers changed by a call to each function of the program, indexed by its sequence number
+static const uint32_t *function_clobbers;
+
+static bool is_variable(symbol_t *symbol);
+static void find_uninitialized_reads(node_t *node, bool *assigned);
+static symbol_t *find_declared_symbol(node_t *identifier);
+static void number_statement(node_t *node);
+static void number_expression(node_t *node, size_t expression_position);
+static void reference_variable(symbol_t *symbol, size_t reference_position);
+static void add_call(size_t call_position, uint32_t clobbers);
+static void compute_intervals(void);
+static void linear_scan(register_allocation_t *allocation);
+static void choose_register_params(register_allocation_t *allocation);
+static int compare_interval_starts(const void *a, const void *b);
+
+/* External interface */
+
+register_allocation_t *allocate_registers(symbol_t *function, const uint32_t *clobbers, int register_params) {
+    assert(function->type == SYMBOL_FUNCTION);
+
+    current_function = function;
+    function_clobbers = clobbers;
+    n_register_params = register_params >= 0 ? (size_t)register_params : NUM_REGISTER_PARAMS;
+    n_symbols = function->function_symtable->n_symbols;
+    intervals = calloc(n_symbols, sizeof(live_interval_t));
+    locations = calloc(n_symbols, sizeof(variable_location_t));
+    declaration_depths = calloc(n_symbols, sizeof(size_t));
+    loop_stack = calloc(1, sizeof(size_t));
+    position = 0;
+    n_loops = loop_depth = n_calls = 0;
+
+    for (size_t i = 0; i < n_symbols; i++) {
+        locations[i].reg = NULL;
+        locations[i].stack_slot = -1;
+    }
+
+    // Parameters are assigned on entry, while all local variables start out unassigned
+    bool *assigned = calloc(n_symbols, sizeof(bool));
+    for (size_t i = 0; i < n_symbols; i++)
+        assigned[i] = function->function_symtable->symbols[i]->type == SYMBOL_PARAMETER;
+    node_t *body = function->node->children[2];
+    find_uninitialized_reads(body, assigned);
+    free(assigned);
+
+    number_statement(body);
+    compute_intervals();
+
+    register_allocation_t *allocation = malloc(sizeof(register_allocation_t));
+    allocation->locations = locations;
+    allocation->n_locations = n_symbols;
+    allocation->callee_saved = malloc(sizeof(CALLEE_SAVED_REGISTERS));
+    allocation->n_callee_saved = 0;
+    allocation->n_stack_slots = 0;
+    linear_scan(allocation);
+    if (register_params < 0)
+        choose_register_params(allocation);
+    allocation->n_register_params = n_register_params;
+
+    for (size_t i = 0; i < n_loops; i++)
+        free(loops[i].extends);
+    free(loops);
+    loops = NULL;
+    loops_capacity = 0;
+    free(loop_stack);
+    free(call_positions);
+    free(call_clobbers);
+    call_positions = NULL;
+    call_clobbers = NULL;
+    calls_capacity = 0;
+    free(declaration_depths);
+    free(intervals);
+
+    return allocation;
+}
+
+void register_allocation_destroy(register_allocation_t *allocation) {
+    free(allocation->locations);
+    free(allocation->callee_saved);
+    free(allocation);
+}
+
+/* Internal matters */
+
+/* Returns true for the symbols the register allocator is responsible for placing */
+static bool is_variable(symbol_t *symbol) {
+    return symbol != NULL && (symbol->type == SYMBOL_PARAMETER || symbol->type == SYMBOL_LOCAL_VAR);
+}
+
+/**
+ * Definite assignment analysis. Walks the statements in execution order, tracking which variables
+ * have been assigned on every path leading up to the current point.
+ * Variables read while possibly unassigned are marked as needing to be zeroed on function entry.
+ */
+static void find_uninitialized_reads(node_t *node, bool *assigned) {
+    switch (node->type) {
+        case IDENTIFIER_DATA: {
+            if (is_variable(node->symbol) && !assigned[node->symbol->sequence_number])
+                locations[node->symbol->sequence_number].needs_zero = true;
+            break;
+        }
+        case DECLARATION_LIST:
+            // The identifiers being declared are not reads
+            break;
+        case ASSIGNMENT_STATEMENT: {
+            node_t *destination = node->children[0];
+            find_uninitialized_reads(node->children[1], assigned);
+            if (destination->type != IDENTIFIER_DATA)
+                find_uninitialized_reads(destination, assigned);
+            else if (is_variable(destination->symbol))
+                assigned[destination->symbol->sequence_number] = true;
+            break;
+        }
+        case IF_STATEMENT: {
+            find_uninitialized_reads(node->children[0], assigned);
+
+            bool *then_assigned = malloc(n_symbols * sizeof(bool));
+            memcpy(then_assigned, assigned, n_symbols * sizeof(bool));
+            find_uninitialized_reads(node->children[1], then_assigned);
+            if (node->n_children == 3)
+                find_uninitialized_reads(node->children[2], assigned);
+
+            // Only variables assigned along both branches are assigned after the if statement
+            for (size_t i = 0; i < n_symbols; i++)
+                assigned[i] = assigned[i] && then_assigned[i];
+            free(then_assigned);
+            break;
+        }
+        case WHILE_STATEMENT:
+        case VECTOR_LOOP: {
+            find_uninitialized_reads(node->children[0], assigned);
+
+            // The preheader and body may run zero times, so their assignments do not count after the loop
+            bool *body_assigned = malloc(n_symbols * sizeof(bool));
+            memcpy(body_assigned, assigned, n_symbols * sizeof(bool));
+            if (node->n_children == 3)
+                find_uninitialized_reads(node->children[2], body_assigned);
+            find_uninitialized_reads(node->children[1], body_assigned);
+            free(body_assigned);
+            break;
+        }
+        case RETURN_STATEMENT:
+        case BREAK_STATEMENT: {
+            for (size_t i = 0; i < node->n_children; i++)
+                find_uninitialized_reads(node->children[i], assigned);
+
+            // Nothing following these statements can be reached from here
+            for (size_t i = 0; i < n_symbols; i++)
+                assigned[i] = true;
+            break;
+        }
+        default: {
+            for (size_t i = 0; i < node->n_children; i++)
+                find_uninitialized_reads(node->children[i], assigned);
+            break;
+        }
+    }
+}
+
+/* Declared identifiers are not bound, so look up the symbol that was created from the node */
+static symbol_t *find_declared_symbol(node_t *identifier) {
+    symbol_table_t *table = current_function->function_symtable;
+    for (size_t i = 0; i < table->n_symbols; i++)
+        if (table->symbols[i]->node == identifier)
+            return table->symbols[i];
+    assert(false && "Declared identifier has no symbol");
+    return NULL;
+}
+
+/* Hands out positions to the statement and everything it contains, in the order code is generated */
+static void number_statement(node_t *node) {
+    switch (node->type) {
+        case BLOCK: {
+            if (node->n_children == 2) {
+                node_t *declaration_list = node->children[0];
+                for (size_t i = 0; i < declaration_list->n_children; i++) {
+                    node_t *declaration = declaration_list->children[i];
+                    for (size_t j = 0; j < declaration->n_children; j++) {
+                        symbol_t *symbol = find_declared_symbol(declaration->children[j]);
+                        declaration_depths[symbol->sequence_number] = loop_depth;
+                    }
+                }
+            }
+            node_t *statement_list = node->children[node->n_children - 1];
+            for (size_t i = 0; i < statement_list->n_children; i++)
+                number_statement(statement_list->children[i]);
+            break;
+        }
+        case ASSIGNMENT_STATEMENT: {
+            node_t *destination = node->children[0];
+            size_t expression_position = ++position;
+            number_expression(node->children[1], expression_position);
+            if (destination->type != IDENTIFIER_DATA)
+                number_expression(destination, expression_position);
+            else if (is_variable(destination->symbol))
+                reference_variable(destination->symbol, ++position);
+            break;
+        }
+        case PRINT_STATEMENT: {
+            for (size_t i = 0; i < node->n_children; i++) {
+                if (node->children[i]->type != STRING_DATA)
+                    number_expression(node->children[i], ++position);
+                add_call(++position, register_mask(SYSTEM_V_CALLER_SAVED));
+            }
+            // The final newline is printed with a call as well
+            add_call(++position, register_mask(SYSTEM_V_CALLER_SAVED));
+            break;
+        }
+        case RETURN_STATEMENT:
+            number_expression(node->children[0], ++position);
+            break;
+        case IF_STATEMENT: {
+            number_expression(node->children[0], ++position);
+            for (size_t i = 1; i < node->n_children; i++)
+                number_statement(node->children[i]);
+            break;
+        }
+        case WHILE_STATEMENT:
+        case VECTOR_LOOP: {
+            // Vectorized loops keep the loop variable and sums in registers of their own while they run,
+            // but read and write them at the same positions as a loop would
+            if (n_loops == loops_capacity) {
+                loops_capacity = loops_capacity * 2 + 8;
+                loops = realloc(loops, loops_capacity * sizeof(loop_t));
+            }
+            // The condition is tested once before entering the loop, which runs the preheader,
+            // and then at the bottom of every iteration
+            number_expression(node->children[0], ++position);
+            if (node->n_children == 3)
+                number_statement(node->children[2]);
+
+            size_t loop_index = n_loops++;
+            loops[loop_index].start = position + 1;
+            loops[loop_index].extends = calloc(n_symbols, sizeof(bool));
+
+            loop_stack = realloc(loop_stack, (loop_depth + 1) * sizeof(size_t));
+            loop_stack[loop_depth++] = loop_index;
+
+            number_statement(node->children[1]);
+            number_expression(node->children[0], ++position);
+
+            loop_depth--;
+            loops[loop_index].end = ++position;
+            break;
+        }
+        case BREAK_STATEMENT:
+            break;
+        default:
+            assert(false && "Unknown statement type");
+    }
+}
+
+/* Records every variable read and call made in the expression as happening at the given position */
+static void number_expression(node_t *node, size_t expression_position) {
+    switch (node->type) {
+        case IDENTIFIER_DATA: {
+            if (is_variable(node->symbol))
+                reference_variable(node->symbol, expression_position);
+            break;
+        }
+        case EXPRESSION: {
+            for (size_t i = 0; i < node->n_children; i++)
+                number_expression(node->children[i], expression_position);
+            if (node->data != NULL && strcmp(node->data, "call") == 0) {
+                symbol_t *callee = node->children[0]->symbol;
+                uint32_t clobbers = register_mask(SYSTEM_V_CALLER_SAVED);
+                if (callee->type == SYMBOL_FUNCTION)
+                    clobbers = function_clobbers[callee->sequence_number];
+                add_call(expression_position, clobbers);
+            }
+            break;
+        }
+        default: {
+            for (size_t i = 0; i < node->n_children; i++)
+                number_expression(node->children[i], expression_position);
+            break;
+        }
+    }
+}
+
+static void reference_variable(symbol_t *symbol, size_t reference_position) {
+    size_t index = symbol->sequence_number;
+    live_interval_t *interval = &intervals[index];
+
+    if (!locations[index].referenced) {
+        locations[index].referenced = true;
+        interval->start = interval->end = reference_position;
+    }
+    if (reference_position < interval->start)
+        interval->start = reference_position;
+    if (reference_position > interval->end)
+        interval->end = reference_position;
+
+    size_t weight = 1;
+    for (size_t i = 0; i < loop_depth && i < MAX_WEIGHTED_LOOP_DEPTH; i++)
+        weight *= 10;
+    interval->weight += weight;
+
+    // A variable that may carry its value from one iteration to the next must be live for the
+    // entire loop. Those that are always assigned before they are read only need to stay live
+    // for the loops inside their own scope, as they start over for every iteration of the others.
+    size_t outermost = locations[index].needs_zero ? 0 : declaration_depths[index];
+    if (symbol->type == SYMBOL_PARAMETER)
+        outermost = 0;
+    if (outermost < loop_depth)
+        loops[loop_stack[outermost]].extends[index] = true;
+}
+
+static void add_call(size_t call_position, uint32_t clobbers) {
+    if (n_calls == calls_capacity) {
+        calls_capacity = calls_capacity * 2 + 8;
+        call_positions = realloc(call_positions, calls_capacity * sizeof(size_t));
+        call_clobbers = realloc(call_clobbers, calls_capacity * sizeof(uint32_t));
+    }
+    call_positions[n_calls] = call_position;
+    call_clobbers[n_calls++] = clobbers;
+}
+
+/* Extends the intervals for loops and zero initialization, and finds the registers clobbered by the calls they span */
+static void compute_intervals(void) {
+    for (size_t i = 0; i < n_loops; i++) {
+        for (size_t j = 0; j < n_symbols; j++) {
+            if (!loops[i].extends[j])
+                continue;
+            if (loops[i].start < intervals[j].start)
+                intervals[j].start = loops[i].start;
+            if (loops[i].end > intervals[j].end)
+                intervals[j].end = loops[i].end;
+        }
+    }
+
+    for (size_t i = 0; i < n_symbols; i++) {
+        symbol_t *symbol = current_function->function_symtable->symbols[i];
+        // Parameters are live from the very start, as are variables relying on being zeroed
+        if (symbol->type == SYMBOL_PARAMETER || locations[i].needs_zero)
+            intervals[i].start = 0;
+
+        // Calls are always handed positions in increasing order
+        for (size_t j = 0; j < n_calls; j++) {
+            if (call_positions[j] > intervals[i].end)
+                break;
+            if (call_positions[j] > intervals[i].start)
+                intervals[i].clobbered |= call_clobbers[j];
+        }
+    }
+}
+
+static int compare_interval_starts(const void *a, const void *b) {
+    size_t start_a = intervals[*(const size_t *)a].start;
+    size_t start_b = intervals[*(const size_t *)b].start;
+    if (start_a != start_b)
+        return start_a < start_b ? -1 : 1;
+    // Keep the order stable, so the output does not depend on the qsort implementation
+    return *(const size_t *)a < *(const size_t *)b ? -1 : 1;
+}
+
+/* Returns a register not held by any of the active intervals, that the interval is allowed to use */
+static const char *find_free_register(size_t interval, size_t *active, size_t n_active) {
+    // Intervals spanning calls can only use the caller-saved registers none of the callees change.
+    // Caller-saved registers are tried first, as they are free to use, and callee-saved ones need saving.
+    // Parameters prefer to stay in the register they were passed in, saving a move.
+    const char *candidates[NUM_CALLER_SAVED_REGISTERS + NUM_CALLEE_SAVED_REGISTERS + 1];
+    size_t n_candidates = 0;
+    symbol_t *symbol = current_function->function_symtable->symbols[interval];
+    uint32_t clobbered = intervals[interval].clobbered;
+    if (symbol->type == SYMBOL_PARAMETER && symbol->sequence_number < n_register_params) {
+        const char *incoming = REGISTER_PARAMS[symbol->sequence_number];
+        for (size_t i = 0; i < NUM_CALLER_SAVED_REGISTERS; i++)
+            if (CALLER_SAVED_REGISTERS[i] == incoming && !(register_mask(incoming) & clobbered))
+                candidates[n_candidates++] = incoming;
+    }
+    for (size_t i = 0; i < NUM_CALLER_SAVED_REGISTERS; i++)
+        if (!(register_mask(CALLER_SAVED_REGISTERS[i]) & clobbered))
+            candidates[n_candidates++] = CALLER_SAVED_REGISTERS[i];
+    for (size_t i = 0; i < NUM_CALLEE_SAVED_REGISTERS; i++)
+        candidates[n_candidates++] = CALLEE_SAVED_REGISTERS[i];
+
+    for (size_t i = 0; i < n_candidates; i++) {
+        bool taken = false;
+        for (size_t j = 0; j < n_active && !taken; j++)
+            taken = locations[active[j]].reg == candidates[i];
+        if (!taken)
+            return candidates[i];
+    }
+    return NULL;
+}
+
+static void spill(register_allocation_t *allocation, size_t index) {
+    symbol_t *symbol = current_function->function_symtable->symbols[index];
+    locations[index].reg = NULL;
+
+    // Parameters passed on the stack already have a home in the caller's frame
+    bool passed_on_stack = symbol->type == SYMBOL_PARAMETER && symbol->sequence_number >= n_register_params;
+    if (passed_on_stack)
+        return;
+
+    // Variables that are never live at the same time share a slot, like the variables of disjoint scopes
+    for (size_t slot = 0; slot < allocation->n_stack_slots; slot++) {
+        bool overlaps = false;
+        for (size_t i = 0; i < n_symbols && !overlaps; i++) {
+            overlaps = locations[i].stack_slot == (int)slot && intervals[i].start <= intervals[index].end &&
+                       intervals[index].start <= intervals[i].end;
+        }
+        if (!overlaps) {
+            locations[index].stack_slot = slot;
+            return;
+        }
+    }
+    locations[index].stack_slot = allocation->n_stack_slots++;
+}
+
+/**
+ * Linear scan register allocation. Intervals are visited in order of increasing start position.
+ * When no register is free, the interval among the current one and the active ones with the
+ * lowest weight is spilled to the stack, so variables used in inner loops keep their registers.
+ */
+static void linear_scan(register_allocation_t *allocation) {
+    size_t *order = malloc(n_symbols * sizeof(size_t));
+    size_t n_order = 0;
+    for (size_t i = 0; i < n_symbols; i++)
+        if (locations[i].referenced)
+            order[n_order++] = i;
+    qsort(order, n_order, sizeof(size_t), compare_interval_starts);
+
+    size_t *active = malloc(n_symbols * sizeof(size_t));
+    size_t n_active = 0;
+
+    for (size_t i = 0; i < n_order; i++) {
+        size_t current = order[i];
+
+        // Expire all intervals that ended before this one starts, freeing their registers
+        size_t kept = 0;
+        for (size_t j = 0; j < n_active; j++)
+            if (intervals[active[j]].end >= intervals[current].start)
+                active[kept++] = active[j];
+        n_active = kept;
+
+        const char *reg = find_free_register(current, active, n_active);
+        if (reg != NULL) {
+            locations[current].reg = reg;
+            active[n_active++] = current;
+            continue;
+        }
+
+        // Find the cheapest active interval holding a register this interval could use instead
+        size_t victim = n_active;
+        for (size_t j = 0; j < n_active; j++) {
+            if (register_mask(locations[active[j]].reg) & intervals[current].clobbered)
+                continue;
+            if (victim == n_active || intervals[active[j]].weight < intervals[active[victim]].weight)
+                victim = j;
+        }
+
+        if (victim != n_active && intervals[active[victim]].weight < intervals[current].weight) {
+            locations[current].reg = locations[active[victim]].reg;
+            spill(allocation, active[victim]);
+            active[victim] = current;
+        } else {
+            spill(allocation, current);
+        }
+    }
+
+    // Every callee-saved register that ended up holding a variable must be preserved
+    for (size_t i = 0; i < NUM_CALLEE_SAVED_REGISTERS; i++) {
+        for (size_t j = 0; j < n_symbols; j++) {
+            if (locations[j].reg == CALLEE_SAVED_REGISTERS[i]) {
+                allocation->callee_saved[allocation->n_callee_saved++] = CALLEE_SAVED_REGISTERS[i];
+                break;
+            }
+        }
+    }
+
+    free(active);
+    free(order);
+}
+
+/**
+ * Decides how many parameters the callers pass in registers. The parameters past the first 6 that would
+ * only be spilled to a stack slot are better off staying where the caller pushes them, along with the
+ * ones after them. Their slots are given up, and the remaining slots are numbered again.
+ */
+static void choose_register_params(register_allocation_t *allocation) {
+    size_t n_parameters = current_function->node->children[1]->n_children;
+    n_register_params = n_parameters < NUM_FIXED_REGISTER_PARAMS ? n_parameters : NUM_FIXED_REGISTER_PARAMS;
+    while (n_register_params < NUM_REGISTER_PARAMS && n_register_params < n_parameters) {
+        variable_location_t *location = &locations[n_register_params];
+        if (location->referenced && location->reg == NULL)
+            break;
+        n_register_params++;
+    }
+
+    symbol_table_t *symtable = current_function->function_symtable;
+
+    bool *used = calloc(allocation->n_stack_slots + 1, sizeof(bool));
+    for (size_t i = 0; i < n_symbols; i++) {
+        symbol_t *symbol = symtable->symbols[i];
+        if (symbol->type == SYMBOL_PARAMETER && symbol->sequence_number >= n_register_params)
+            locations[i].stack_slot = -1;
+        if (locations[i].stack_slot >= 0)
+            used[locations[i].stack_slot] = true;
+    }
+
+    int *renumbered = malloc((allocation->n_stack_slots + 1) * sizeof(int));
+    size_t n_slots = 0;
+    for (size_t slot = 0; slot < allocation->n_stack_slots; slot++)
+        renumbered[slot] = used[slot] ? (int)n_slots++ : -1;
+    for (size_t i = 0; i < n_symbols; i++)
+        if (locations[i].stack_slot >= 0)
+            locations[i].stack_slot = renumbered[locations[i].stack_slot];
+    allocation->n_stack_slots = n_slots;
+
+    free(renumbered);
+    free(used);
+}
@@ -11,13 +11,18 @@ static void find_global_array_declaration(node_t *node);
 static void find_global_function(node_t *node);
 static void find_globals(void);
 
+static void find_reachable_functions(symbol_t *function);
 static void bind();
+static void bind_function(symbol_t *function);
 static void bind_block(symbol_table_t *local_symbols, node_t *node);
 static void bind_identifier(symbol_table_t *local_symbols, node_t *node);
 static void bind_names(symbol_table_t *local_symbols, node_t *root);
 static void push_local_scope(symbol_table_t *table);
 static void pop_local_scope(symbol_table_t *table);
 
+static void find_used_globals(node_t *node, bool *used);
+static void remove_global_node(symbol_t *symbol);
+
 static void print_symbol_table(symbol_table_t *table, int nesting);
 static void destroy_symbol_tables(void);
 
@@ -25,6 +30,12 @@ static size_t add_string(char *string);
 static void print_string_list(void);
 static void destroy_string_list(void);
 
+/**
+ * The functions the first function can reach through calls, indexed by sequence number. Only these are
+ * bound, and compiled, as the first function is where the program starts
+ */
+static bool *reachable_functions;
+
 /* External interface */
 
 /**
@@ -44,6 +55,13 @@ void create_tables(void) {
  * Finally prints out the AST again, with bound symbols.
  */
 void print_tables(void) {
+    // The functions that can not be reached are bound as well, so the tables are complete
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION && !reachable_functions[i])
+            bind_function(symbol);
+    }
+
     print_symbol_table(global_symbols, 0);
     printf("\n == STRING LIST == \n");
     print_string_list();
@@ -51,8 +69,54 @@ void print_tables(void) {
     print_syntax_tree();
 }
 
+/**
+ * Removes the functions no call can reach from the first function, and the global variables and arrays the
+ * remaining functions never name, from the global symbol table and the syntax tree. The symbols that are
+ * kept are given new sequence numbers. The calls are followed through the bound symbols, so the optimizer
+ * can call this again, once it has changed which functions are called.
+ */
+void remove_unused_globals(void) {
+    bool *used = calloc(global_symbols->n_symbols, sizeof(bool));
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
+        symbol_t *symbol = global_symbols->symbols[i];
+        if (symbol->type == SYMBOL_FUNCTION) {
+            used[i] = true;
+            find_used_globals(symbol->node->children[2], used);
+            break;
+        }
+    }
+
+    symbol_table_t *old_symbols = global_symbols;
+    global_symbols = symbol_table_init();
+    for (size_t i = 0; i < old_symbols->n_symbols; i++) {
+        symbol_t *symbol = old_symbols->symbols[i];
+        if (used[i]) {
+            symbol_table_insert(global_symbols, symbol);
+            if (symbol->type == SYMBOL_FUNCTION)
+                symbol->function_symtable->hashmap->backup = global_symbols->hashmap;
+            continue;
+        }
+
+        if (report_optimizations)
+            fprintf(stderr, "dead: %s '%s' removed\n",
+                    symbol->type == SYMBOL_FUNCTION ? "unreachable function" : "unused global", symbol->name);
+        if (symbol->type == SYMBOL_FUNCTION)
+            symbol_table_destroy(symbol->function_symtable);
+        remove_global_node(symbol);
+        free(symbol);
+    }
+
+    // The kept symbols belong to the new table now
+    old_symbols->n_symbols = 0;
+    symbol_table_destroy(old_symbols);
+    free(used);
+    free(reachable_functions);
+    reachable_functions = NULL;
+}
+
 /* Destroys all symbol tables and the global string list */
 void destroy_tables(void) {
+    free(reachable_functions);
     destroy_symbol_tables();
     destroy_string_list();
 }
@@ -69,15 +133,56 @@ void destroy_tables(void) {
  * A final task performed by bind_names(), is adding strings to the global string list
  */
 static void bind() {
-    for (int i = 0; i < global_symbols->n_symbols; i++) {
+    reachable_functions = calloc(global_symbols->n_symbols, sizeof(bool));
+    for (size_t i = 0; i < global_symbols->n_symbols; i++) {
         symbol_t *symbol = global_symbols->symbols[i];
-
         if (symbol->type == SYMBOL_FUNCTION) {
-            assert(symbol->node->n_children == 3);
-            node_t *child = symbol->node->children[2];
-            bind_names(symbol->function_symtable, child);
+            find_reachable_functions(symbol);
+            break;
         }
     }
+
+    // Functions that can not be reached are left unbound, see remove_unused_globals
+    for (size_t i = 0; i < global_symbols->n_symbols; i++)
+        if (reachable_functions[i])
+            bind_function(global_symbols->symbols[i]);
+}
+
+static void bind_function(symbol_t *function) {
+    assert(function->node->n_children == 3);
+    node_t *child = function->node->children[2];
+    bind_names(function->function_symtable, child);
+}
+
+/**
+ * Marks the function, and the functions its body calls, as reachable. The body is not bound yet, so calls are
+ * followed by the name of the function, which local variables can not hide, as they can not be called
+ */
+static void find_reachable_functions(symbol_t *function) {
+    if (reachable_functions[function->sequence_number])
+        return;
+    reachable_functions[function->sequence_number] = true;
+
+    // Walks the body without recursing, as the calls can nest deeply
+    node_t **stack = malloc(sizeof(node_t *));
+    size_t n_stack = 1, stack_capacity = 1;
+    stack[0] = function->node->children[2];
+    while (n_stack > 0) {
+        node_t *node = stack[--n_stack];
+        if (node->type == EXPRESSION && node->data != NULL && strcmp(node->data, "call") == 0) {
+            symbol_t *callee = symbol_hashmap_lookup(global_symbols->hashmap, node->children[0]->data);
+            if (callee != NULL && callee->type == SYMBOL_FUNCTION)
+                find_reachable_functions(callee);
+        }
+        for (size_t i = 0; i < node->n_children; i++) {
+            if (n_stack == stack_capacity) {
+                stack_capacity *= 2;
+                stack = realloc(stack, stack_capacity * sizeof(node_t *));
+            }
+            stack[n_stack++] = node->children[i];
+        }
+    }
+    free(stack);
 }
 
 static void find_global_declaration(node_t *node) {
@@ -104,6 +209,7 @@ static void find_global_array_declaration(node_t *node) {
     global_array_symbol->name = identifier->data;
     global_array_symbol->type = SYMBOL_GLOBAL_ARRAY;
     global_array_symbol->node = node;
+    global_array_symbol->element_width = ELEMENT_QUADWORD;
     symbol_table_insert(global_symbols, global_array_symbol);
 }
 
@@ -245,6 +351,53 @@ static void bind_names(symbol_table_t *local_symbols, node_t *node) {
     }
 }
 
+/* Marks the global variables, arrays and functions named in the bound subtree as used, and what the functions use */
+static void find_used_globals(node_t *node, bool *used) {
+    symbol_t *symbol = node->symbol;
+    if (node->type == IDENTIFIER_DATA && symbol != NULL &&
+        (symbol->type == SYMBOL_GLOBAL_VAR || symbol->type == SYMBOL_GLOBAL_ARRAY || symbol->type == SYMBOL_FUNCTION) &&
+        !used[symbol->sequence_number]) {
+        used[symbol->sequence_number] = true;
+        if (symbol->type == SYMBOL_FUNCTION)
+            find_used_globals(symbol->node->children[2], used);
+    }
+    for (size_t i = 0; i < node->n_children; i++)
+        find_used_globals(node->children[i], used);
+}
+
+/* Removes the declaration of the global symbol from the syntax tree */
+static void remove_global_node(symbol_t *symbol) {
+    for (size_t i = 0; i < root->n_children; i++) {
+        node_t *node = root->children[i];
+        node_t *removed = NULL;
+        if (node == symbol->node) {
+            removed = node;
+        } else if (node->type == DECLARATION) {
+            // One declaration can name several global variables
+            for (size_t j = 0; j < node->n_children; j++) {
+                if (node->children[j] != symbol->node)
+                    continue;
+                destroy_subtree(node->children[j]);
+                memmove(&node->children[j], &node->children[j + 1], (node->n_children - j - 1) * sizeof(node_t *));
+                node->n_children--;
+                if (node->n_children == 0)
+                    removed = node;
+                else
+                    return;
+                break;
+            }
+        }
+
+        if (removed != NULL) {
+            destroy_subtree(removed);
+            memmove(&root->children[i], &root->children[i + 1], (root->n_children - i - 1) * sizeof(node_t *));
+            root->n_children--;
+            return;
+        }
+    }
+    assert(false && "Global symbols are declared at the top of the syntax tree");
+}
+
 /**
  * Prints the given symbol table, with sequence number, symbol names and types.
  * When printing function symbols, its local symbol table is recursively printed, with indentation.
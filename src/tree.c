@@ -16,7 +16,6 @@ typedef enum ArithmeticOperator {
 
 static void node_print(node_t *node, int nesting);
 static void node_finalize(node_t *discard);
-static void destroy_subtree(node_t *discard);
 static node_t *simplify_tree(node_t *node);
 static node_t *replace_with_child(node_t *node);
 static node_t *squash_child(node_t *node);
@@ -118,7 +117,7 @@ static void node_finalize(node_t *discard) {
 }
 
 /* Recursively frees the memory owned by the given node, and all its children */
-static void destroy_subtree(node_t *discard) {
+void destroy_subtree(node_t *discard) {
     if (discard == NULL) {
         return;
     }
@@ -196,7 +195,6 @@ static node_t *simplify_tree(node_t *node) {
         variable = malloc(sizeof(node_t));                   \
         node_init(variable, IDENTIFIER_DATA, identifier, 0); \
     } while (false)
-#define FOR_END_VARIABLE "__FOR_END__"
 
 /**
  * @brief Replaces a node with its only child, letting the child take over the parent's position.
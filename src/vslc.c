@@ -5,12 +5,62 @@
 
 /* Command line option parsing for the main function */
 static void options ( int argc, char **argv );
+static void optimization_option ( const char *option );
 static bool
     print_full_tree = false,
     print_simplified_tree = false,
     print_symbol_table_contents = false,
     print_generated_program = false;
 
+/* Set by -R, making the optimizations report what they did on stderr */
+bool report_optimizations = false;
+
+/* Set by -f unroll-loops and -f unroll-factor=<n>, see unroll_for_loop in optimizer.c */
+bool unroll_loops = false;
+int unroll_factor = 4;
+
+/* Turned off by -f no-vectorize, see vectorize_for_loop in optimizer.c */
+bool vectorize_loops = true;
+
+/* Set by -f inline and -f inline-limit=<n>, see inline_functions in optimizer.c */
+bool inline_calls = true;
+int inline_limit = 40;
+
+/* Set by -f evaluate-calls and -f evaluate-limit=<n>, see evaluate_pure_calls in optimizer.c */
+bool evaluate_calls = true;
+int evaluate_limit = 100000;
+
+/* Set by -f specialize and -f specialize-limit=<n>, see specialize_functions in optimizer.c */
+bool specialize_calls = true;
+int specialize_limit = 8;
+
+/* Set by -f memoize, see memoize_functions in optimizer.c */
+bool memoize_calls = false;
+
+/* Turned off by -f no-narrow-arrays, see narrow_arrays in optimizer.c */
+bool array_narrowing = true;
+
+/* Turned off by -f no-promote-globals, see promote_globals in optimizer.c */
+bool global_promotion = true;
+
+/* Turned off by -f no-mod-ref, see find_memory_summaries in optimizer.c */
+bool mod_ref_summaries = true;
+
+/* Turned off by -f no-cse, see eliminate_common_subexpressions in optimizer.c */
+bool common_subexpressions = true;
+
+/* Turned off by -f no-tail-calls, see generate_tail_call in generator.c */
+bool tail_calls = true;
+
+/* Turned off by -f no-cmov, see generate_conditional_move in generator.c */
+bool conditional_moves = true;
+
+/* Turned off by -f no-jump-tables, see generate_dispatch in generator.c */
+bool jump_tables = true;
+
+/* Turned off by -f no-icf, see fold_identical_function in generator.c */
+bool identical_code_folding = true;
+
 /* Entry point */
 int main ( int argc, char **argv )
 {
@@ -31,6 +81,14 @@ int main ( int argc, char **argv )
     if ( print_symbol_table_contents )
         print_tables();
 
+    // Operations in symbols.c, dropping what the program being compiled never uses
+    if ( print_generated_program )
+        remove_unused_globals ();
+
+    // Operations in optimizer.c, only done to the program being compiled
+    if ( print_generated_program )
+        optimize_syntax_tree ();
+
     // Operations in generator.c
     if ( print_generated_program )
         generate_program ();
@@ -45,13 +103,34 @@ static const char *usage =
 "\t-t\tOutput the full syntax tree\n"
 "\t-T\tOutput the simplified syntax tree\n"
 "\t-s\tOutput the symbol table contents\n"
-"\t-c\tCompile and generate assembly output\n";
+"\t-c\tCompile and generate assembly output\n"
+"\t-R\tReport statistics from the optimizations to stderr\n"
+"\t-f unroll-loops\n\t\tUnroll for-loops with constant bounds\n"
+"\t-f unroll-factor=<n>\n\t\tRun the body of unrolled loops up to n times per iteration (default 4)\n"
+"\t-f no-vectorize\n\t\tDo not use SSE2 and AVX2 instructions for loops over arrays\n"
+"\t-f no-inline\n\t\tDo not replace calls by the body of the called function\n"
+"\t-f inline-limit=<n>\n\t\tInline functions of up to n syntax tree nodes at every call (default 40)\n"
+"\t-f no-evaluate-calls\n\t\tDo not compute calls to pure functions passing only numbers while compiling\n"
+"\t-f evaluate-limit=<n>\n\t\tRun at most n statements to compute such a call (default 100000)\n"
+"\t-f no-specialize\n\t\tDo not make copies of functions for the numbers they are called with\n"
+"\t-f specialize-limit=<n>\n\t\tMake at most n such copies (default 8)\n"
+"\t-f memoize\n\t\tKeep the results of pure recursive functions in tables, returning them\n"
+"\t\twhen called with the same arguments again\n"
+"\t-f no-narrow-arrays\n\t\tStore every array element in 64 bits, even when fewer hold all its numbers\n"
+"\t-f no-promote-globals\n\t\tLoad and store global variables at every use in loops, instead of keeping them in registers\n"
+"\t-f no-mod-ref\n\t\tAssume every call reads and writes every global variable and array\n"
+"\t-f no-cse\n\t\tEvaluate every expression where it appears, instead of reusing values computed before\n"
+"\t-f no-tail-calls\n\t\tCall functions returned from, instead of jumping to them\n"
+"\t-f no-cmov\n\t\tBranch around the assignments of if-statements, instead of using conditional moves\n"
+"\t-f no-jump-tables\n\t\tCompare else-if chains on one variable against one constant at a time,\n"
+"\t\tinstead of using jump tables and binary search\n"
+"\t-f no-icf\n\t\tGenerate every function, instead of one for each set of functions with the same body\n";
 
 
 static void options ( int argc, char **argv )
 {
     int o;
-    while ( (o=getopt(argc,argv,"htTsc")) != -1 )
+    while ( (o=getopt(argc,argv,"htTscRf:")) != -1 )
     {
         switch ( o )
         {
@@ -63,6 +142,118 @@ static void options ( int argc, char **argv )
             case 'T':   print_simplified_tree = true;       break;
             case 's':   print_symbol_table_contents = true; break;
             case 'c':   print_generated_program = true;     break;
+            case 'R':   report_optimizations = true;        break;
+            case 'f':   optimization_option ( optarg );     break;
+        }
+    }
+}
+
+/* Parses the argument of -f, written like -funroll-loops */
+static void optimization_option ( const char *option )
+{
+    if ( strcmp ( option, "unroll-loops" ) == 0 )
+        unroll_loops = true;
+    else if ( strcmp ( option, "no-unroll-loops" ) == 0 )
+        unroll_loops = false;
+    else if ( strcmp ( option, "vectorize" ) == 0 )
+        vectorize_loops = true;
+    else if ( strcmp ( option, "no-vectorize" ) == 0 )
+        vectorize_loops = false;
+    else if ( strcmp ( option, "inline" ) == 0 )
+        inline_calls = true;
+    else if ( strcmp ( option, "no-inline" ) == 0 )
+        inline_calls = false;
+    else if ( strcmp ( option, "evaluate-calls" ) == 0 )
+        evaluate_calls = true;
+    else if ( strcmp ( option, "no-evaluate-calls" ) == 0 )
+        evaluate_calls = false;
+    else if ( strcmp ( option, "specialize" ) == 0 )
+        specialize_calls = true;
+    else if ( strcmp ( option, "no-specialize" ) == 0 )
+        specialize_calls = false;
+    else if ( strcmp ( option, "memoize" ) == 0 )
+        memoize_calls = true;
+    else if ( strcmp ( option, "no-memoize" ) == 0 )
+        memoize_calls = false;
+    else if ( strcmp ( option, "narrow-arrays" ) == 0 )
+        array_narrowing = true;
+    else if ( strcmp ( option, "no-narrow-arrays" ) == 0 )
+        array_narrowing = false;
+    else if ( strcmp ( option, "promote-globals" ) == 0 )
+        global_promotion = true;
+    else if ( strcmp ( option, "no-promote-globals" ) == 0 )
+        global_promotion = false;
+    else if ( strcmp ( option, "mod-ref" ) == 0 )
+        mod_ref_summaries = true;
+    else if ( strcmp ( option, "no-mod-ref" ) == 0 )
+        mod_ref_summaries = false;
+    else if ( strcmp ( option, "cse" ) == 0 )
+        common_subexpressions = true;
+    else if ( strcmp ( option, "no-cse" ) == 0 )
+        common_subexpressions = false;
+    else if ( strcmp ( option, "tail-calls" ) == 0 )
+        tail_calls = true;
+    else if ( strcmp ( option, "no-tail-calls" ) == 0 )
+        tail_calls = false;
+    else if ( strcmp ( option, "cmov" ) == 0 )
+        conditional_moves = true;
+    else if ( strcmp ( option, "no-cmov" ) == 0 )
+        conditional_moves = false;
+    else if ( strcmp ( option, "jump-tables" ) == 0 )
+        jump_tables = true;
+    else if ( strcmp ( option, "no-jump-tables" ) == 0 )
+        jump_tables = false;
+    else if ( strcmp ( option, "icf" ) == 0 )
+        identical_code_folding = true;
+    else if ( strcmp ( option, "no-icf" ) == 0 )
+        identical_code_folding = false;
+    else if ( strncmp ( option, "inline-limit=", strlen ( "inline-limit=" ) ) == 0 )
+    {
+        char *end;
+        long limit = strtol ( option + strlen ( "inline-limit=" ), &end, 10 );
+        if ( *end != '\0' || limit < 0 || limit > 10000 )
+        {
+            fprintf ( stderr, "error: the inline limit must be a number from 0 to 10000\n" );
+            exit ( EXIT_FAILURE );
+        }
+        inline_limit = limit;
+    }
+    else if ( strncmp ( option, "evaluate-limit=", strlen ( "evaluate-limit=" ) ) == 0 )
+    {
+        char *end;
+        long limit = strtol ( option + strlen ( "evaluate-limit=" ), &end, 10 );
+        if ( *end != '\0' || limit < 0 || limit > 100000000 )
+        {
+            fprintf ( stderr, "error: the evaluate limit must be a number from 0 to 100000000\n" );
+            exit ( EXIT_FAILURE );
         }
+        evaluate_limit = limit;
+    }
+    else if ( strncmp ( option, "specialize-limit=", strlen ( "specialize-limit=" ) ) == 0 )
+    {
+        char *end;
+        long limit = strtol ( option + strlen ( "specialize-limit=" ), &end, 10 );
+        if ( *end != '\0' || limit < 0 || limit > 1000 )
+        {
+            fprintf ( stderr, "error: the specialize limit must be a number from 0 to 1000\n" );
+            exit ( EXIT_FAILURE );
+        }
+        specialize_limit = limit;
+    }
+    else if ( strncmp ( option, "unroll-factor=", strlen ( "unroll-factor=" ) ) == 0 )
+    {
+        char *end;
+        long factor = strtol ( option + strlen ( "unroll-factor=" ), &end, 10 );
+        if ( *end != '\0' || factor < 1 || factor > 64 )
+        {
+            fprintf ( stderr, "error: the unroll factor must be a number from 1 to 64\n" );
+            exit ( EXIT_FAILURE );
+        }
+        unroll_factor = factor;
+    }
+    else
+    {
+        fprintf ( stderr, "error: unknown optimization option '-f%s'\n", option );
+        exit ( EXIT_FAILURE );
     }
 }